@@ -7,6 +7,9 @@ int log(LOGLEVEL lev, const char* format, ...)
     if(lev < logging_level || lev == OFF)
         return 0;
 
+    // one line at a time when several threads log
+    flockfile(stdout);
+
     switch(lev)
     {
     case WARN:
@@ -53,6 +56,8 @@ int log(LOGLEVEL lev, const char* format, ...)
 
     printf("\x1b[0m");
 
+    funlockfile(stdout);
+
     return ret;
 }
 
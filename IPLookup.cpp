@@ -29,7 +29,8 @@ All Rights Reserved.
 #include <signal.h>
 
 
-IPLookup::IPLookup(const char* hostfile)
+IPLookup::IPLookup(const char* hostfile, uint16_t port)
+:_port(port)
 {
     // read hostfile
     std::ifstream infile(hostfile);
@@ -37,8 +38,14 @@ IPLookup::IPLookup(const char* hostfile)
     uint32_t id = 0;
     while (std::getline(infile, line))
     {
+        // a line is a hostname, optionally followed by what the host's
+        // links run over
+        size_t end = line.find_first_of(" \t\r");
+        size_t transport = (end == std::string::npos)? end : line.find_first_not_of(" \t\r", end);
+        size_t transportEnd = (transport == std::string::npos)? transport : line.find_first_of(" \t\r", transport);
 
-        insertHost(line, id);
+        insertHost(line.substr(0, end), id);
+        _transports.push_back((transport == std::string::npos)? "" : line.substr(transport, transportEnd - transport));
 
         id++;
     }
@@ -61,6 +68,16 @@ IPLookup::IPLookup(const char* hostfile)
     {
         _thisComputer = lookupName(hostname);
     }
+
+    // datagrams we send ourselves over loopback come from 127.0.0.1
+    if(_thisComputer != -1)
+    {
+        struct sockaddr_in loopback;
+        memset(&loopback, 0, sizeof loopback);
+        loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        loopback.sin_port = htons(_port);
+        _addressMap.insert(std::make_pair(addressKey(loopback), _thisComputer));
+    }
 #ifndef NDEBUG
 
     log(DEBUG, "Generating host mapping:\n");
@@ -80,6 +97,11 @@ void IPLookup::insertHost(std::string line, uint32_t id)
     _lineMap.insert(std::make_pair(id, line));  // the given line to a hostname.
     _nameMap.insert(std::make_pair(line, id));  // the given name of the resource in the hosts file.
 
+    // the address we send to, filled in from the first IPv4 result below.
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_UNSPEC;
+
     // Set hints
     struct addrinfo hints;
     memset(&hints, 0, sizeof hints);
@@ -100,7 +122,17 @@ void IPLookup::insertHost(std::string line, uint32_t id)
         {
             char hostname[NI_MAXHOST];
 
-            _addressMap.insert(std::make_pair(std::string(res->ai_addr->sa_data, 14), id));
+            if(res->ai_family == AF_INET)
+            {
+                struct sockaddr_in resolved;
+                memcpy(&resolved, res->ai_addr, sizeof resolved);
+                resolved.sin_port = htons(_port);
+
+                _addressMap.insert(std::make_pair(addressKey(resolved), id));
+
+                if(address.sin_family == AF_UNSPEC)
+                    address = resolved;
+            }
 
             error = getnameinfo(res->ai_addr, res->ai_addrlen, hostname, NI_MAXHOST, NULL, 0, 0);
             if (error != 0)
@@ -112,32 +144,77 @@ void IPLookup::insertHost(std::string line, uint32_t id)
             if (*hostname != '\0')
                 _nameMap.insert(std::make_pair(std::string(hostname), id));
         }
+
+        freeaddrinfo(servinfo);
+    }
+    else
+    {
+        log(WARN, "could not resolve host %s: %s\n", node, gai_strerror(ret));
     }
+
+    _addresses.push_back(address);
 }
 
 
-int IPLookup::lookupSock(struct sockaddr* theirAddress, socklen_t theirAddressLen)
+int IPLookup::lookupSockSlow(struct sockaddr* theirAddress, socklen_t theirAddressLen)
 {
     char hostname[NI_MAXHOST];
+    int id = -1;
+    bool unknown = false; // the resolver answered, and it wasn't one of ours
 
-    if(getnameinfo(theirAddress, theirAddressLen, hostname, sizeof(hostname), NULL, 0, NI_NAMEREQD) == 0)
+    int ret = getnameinfo(theirAddress, theirAddressLen, hostname, sizeof(hostname), NULL, 0, NI_NAMEREQD);
+    if(ret == 0)
     {
         std::string host(hostname);
 
         if(host == "localhost" && _thisComputer != -1)
         {
-            return _thisComputer;
+            id = _thisComputer;
         }
+        else
+        {
+            auto loc = _nameMap.find(host);
+            if(loc == _nameMap.end())
+            {
+                log(WARN, "Could not get index for host with name %s\n", hostname);
+                unknown = true;
+            }
+            else
+            {
+                id = loc->second;
+            }
+        }
+    }
+    else if(ret == EAI_NONAME)
+    {
+        unknown = true;
+    }
+    else
+    {
+        // the resolver may well answer next time
+        log(WARN, "could not look up a sender: %s\n", gai_strerror(ret));
+    }
 
-        auto loc = _nameMap.find(host);
-        if(loc == _nameMap.end())
+    // remember a definite answer so this address never goes to the
+    // resolver again, whether or not it is one of our hosts.
+    if(theirAddress->sa_family == AF_INET)
+    {
+        uint64_t key = addressKey(*(struct sockaddr_in*) theirAddress);
+
+        if(id != -1)
         {
-            log(WARN, "Could not get index for host with name %s\n", hostname);
-            return -1;
+            log(DEBUG, "caching address of host %d\n", id);
+            _addressMap.insert(std::make_pair(key, id));
         }
+        else if(unknown)
+        {
+            if(_unknownAddresses.size() >= MAX_UNKNOWN_ADDRESSES)
+                _unknownAddresses.clear();
 
-        return loc->second;
+            log(WARN, "ignoring datagrams from an unknown sender from now on\n");
+            _unknownAddresses.insert(key);
+        }
     }
 
-    return -1;
+    return id;
 }
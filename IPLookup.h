@@ -10,6 +10,9 @@ All Rights Reserved.
 #include <map>
 #include <netinet/in.h>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 /**
 Provides an ip lookup mechanism for a piece of software, translating hosts
@@ -20,9 +23,10 @@ class IPLookup
     public:
     /**
     Sets up IPLookup with the given hosts file. Hosts are indexed starting
-    with 0.
+    with 0. Each host's address is resolved once here and stored with the
+    given port so senders never have to go back to the resolver.
     **/
-    IPLookup(const char* hostfilePath);
+    IPLookup(const char* hostfilePath, uint16_t port = 0);
 
     /**
     Looks up the given name to return the ID. returns -1 if not found.
@@ -46,21 +50,68 @@ class IPLookup
 
     /**
     Looks up the id of the given connection, returns the id or -1 if not in
-    the hosts file.
+    the hosts file. Known address/port pairs are answered from a hash table
+    built when the hostfile is loaded; anything else falls back to a reverse
+    lookup whose answer is cached, a miss included, so a stray sender only
+    costs the resolver once.
     **/
-    int lookupSock(struct sockaddr* theirAddress, socklen_t theirAddressLen);
+    int lookupSock(struct sockaddr* theirAddress, socklen_t theirAddressLen)
+    {
+        if(theirAddress->sa_family == AF_INET)
+        {
+            uint64_t key = addressKey(*(struct sockaddr_in*) theirAddress);
+            auto val = _addressMap.find(key);
+            if(val != _addressMap.end())
+                return (int) val->second;
+            if(_unknownAddresses.count(key) != 0)
+                return -1;
+        }
+
+        return lookupSockSlow(theirAddress, theirAddressLen);
+    }
 
     int getNumberOfHosts() const {return _numHosts;}
     std::string hostnameForId(uint32_t id) {return _lineMap[id];}
 
+    /**
+    What the hostfile says the host's links run over, the word after its
+    name ("udp", "tcp", "shm" or "shm:group"); empty if nothing follows.
+    **/
+    const std::string& transportForId(uint32_t id) const {return _transports[id];}
+
+    /**
+    Returns the address resolved for the given id when the hostfile was
+    loaded. sin_family is AF_UNSPEC if the host could not be resolved.
+    **/
+    const struct sockaddr_in& addressForId(uint32_t id) const {return _addresses[id];}
+
+    /**
+    All resolved addresses, indexed by id, getNumberOfHosts() long.
+    **/
+    const struct sockaddr_in* addresses() const {return &_addresses[0];}
+
 private:
     std::map<std::string, uint32_t> _nameMap;
-    std::map<std::string, uint32_t> _addressMap;
+    std::unordered_map<uint64_t, uint32_t> _addressMap; // (ipv4 address, port) -> id
+    std::unordered_set<uint64_t> _unknownAddresses; // (ipv4 address, port) the resolver had no id for
     std::map<uint32_t, std::string> _lineMap;
+    std::vector<struct sockaddr_in> _addresses;
+    std::vector<std::string> _transports;
+    uint16_t _port;
     uint32_t _numHosts;
     int _thisComputer;
 
     void insertHost(std::string hostname, uint32_t id);
+    int lookupSockSlow(struct sockaddr* theirAddress, socklen_t theirAddressLen);
+
+    // misses remembered at most, a sender cycling through ports can't grow
+    // the set without bound, it starts over instead
+    static const size_t MAX_UNKNOWN_ADDRESSES = 4096;
+
+    static uint64_t addressKey(const struct sockaddr_in& address)
+    {
+        return ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+    }
 
 };
 
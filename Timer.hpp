@@ -103,6 +103,12 @@ class Timer
     {
         return std::chrono::duration_cast<std::chrono::milliseconds>(_alarmTime - std::chrono::high_resolution_clock::now()).count();
     }
+
+    /// Like getMsUntilAlarm, in microseconds.
+    long getUsUntilAlarm()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(_alarmTime - std::chrono::high_resolution_clock::now()).count();
+    }
 };
 
 #endif //TIMER_HPP
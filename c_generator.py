@@ -127,6 +127,42 @@ class PrimaryItem(StateItem):
         else:
             kill_parser("Could not resolve: {}".format(name))
 
+    def fixed_size(self):
+        ''' The size of the items as a C expression, None if it depends on
+        what is in them.
+        '''
+        sizes = [child.fixed_size() for child in self.children]
+        if None in sizes:
+            return None
+        return " + ".join(sizes) if len(sizes) > 0 else "0"
+
+    def wire_size(self, source):
+        ''' The packed size of the items of source as a C expression. '''
+        return " + ".join([child.wire_size(source) for child in self.children] or ["0"])
+
+    def generate_decoder(self, exact):
+        ''' Generates a function that reads the items from a span into a
+        struct, false if the span doesn't hold them. With exact, bytes left
+        over are an error too.
+        '''
+        ow = OutputWriter()
+        ow.add("bool _decode_{}(_span& in, {}& target)".format(self.name, self.struct_name))
+        ow.open_scope()
+
+        size = self.fixed_size()
+        if size != None:
+            # everything is where the layout says, one check does
+            ow.add("if (in.length {} {}) return false;".format("!=" if exact else "<", size))
+        if any(isinstance(child, ChecksumBegin) for child in self.children):
+            ow.add("const char* _checksum_from = in.data;")
+
+        for child in self.children:
+            child.generate_decoder(ow, "target")
+
+        ow.add("return {};".format("in.length == 0" if exact and size == None else "true"))
+        ow.close_scope()
+        return str(ow)
+
 class Prefix(PrimaryItem):
     def __init__(self, node):
         PrimaryItem.__init__(self, node, "prefix", None)
@@ -160,9 +196,36 @@ class Prefix(PrimaryItem):
         else:
             kill_parser("Could not choose a first state id, there were no children of header and there were multiple messages to descend to")
 
-    def generate_packer(self, messageName, outputwriter):
+    def generate_packer(self, ow, source):
         for child in self.children:
-            child.generate_packer(messageName, outputwriter)
+            child.generate_packer(ow, source)
+
+    def generate_decode(self):
+        ''' Generates decode(), which reads a whole message straight out of
+        the caller's buffer and hands it to its handler.
+        '''
+        ow = OutputWriter()
+        ow.add("bool decode(const char* data, size_t length)")
+        ow.open_scope()
+        ow.add("_span in = {data, length};")
+        ow.add("{} prefix;".format(self.struct_name))
+        ow.add("if (!_decode_{}(in, prefix))".format(self.name))
+        ow.open_scope()
+        ow.add("handle_invalid_message(\"message shorter than its header\");")
+        ow.add("return false;")
+        ow.close_scope()
+
+        for msg in messages:
+            if len(messages) > 1:
+                ow.add("if({})".format(msg.generate_message_check("prefix")))
+            ow.open_scope()
+            msg.generate_dispatch(ow)
+            ow.close_scope()
+
+        ow.add("handle_invalid_message(\"could not parse the given message, unknown type\");")
+        ow.add("return false;")
+        ow.close_scope()
+        return str(ow)
 
     def generate_states(self, output):
         output.add("case {}:".format(self.state_id))
@@ -190,7 +253,7 @@ class Message(PrimaryItem):
         PrimaryItem.__init__(self, node, node.attrib["name"], header)
         self.handler_method_name = "handle_%s" % (self.name)
 
-    def generate_message_check(self):
+    def generate_message_check(self, structname=None):
         checks = []
         keys = self.node.attrib.keys()
 
@@ -205,7 +268,11 @@ class Message(PrimaryItem):
         if len(checks) == 0:
             kill_parser("there are no checks for the message {}".format(self.name))
 
-        full_checks = [self.resolve(field) + translations[c] + self.node.attrib[c] for c in checks]
+        value = self.resolve(field)
+        if structname != None:
+            value = structname + value[value.index("."):]
+
+        full_checks = [value + translations[c] + self.node.attrib[c] for c in checks]
 
         return " && ".join(full_checks)
 
@@ -244,22 +311,79 @@ class Message(PrimaryItem):
             child.process()
 
         global reset_procedures
-        reset_procedures.append("%s = (const struct %s){ 0 };" % (self.working_struct, self.struct_name))
+        reset_procedures.append("%s = %s();" % (self.working_struct, self.struct_name))
 
     def get_first_state_id(self):
         return self.children[0].state_id if len(self.children) > 0 else self.state_id
 
+    def generate_dispatch(self, ow):
+        global header
+
+        ow.add("{} message;".format(self.struct_name))
+        for typ, name in header.generate_struct():
+            ow.add("message.{} = prefix.{};".format(name, name))
+        ow.add("if (!_decode_{}(in, message))".format(self.name))
+        ow.open_scope()
+        ow.add("handle_invalid_message(\"{} has the wrong length\");".format(self.name))
+        ow.add("return false;")
+        ow.close_scope()
+        ow.add(self.handler_method_name + "(message);")
+        ow.add("return true;")
+
+    def wire_constant(self):
+        ''' The name of the constant holding the packed size, None if the
+        size depends on the contents.
+        '''
+        return self.name + "_WIRE_BYTES" if self.fixed_wire_size() != None else None
+
+    def fixed_wire_size(self):
+        ''' The packed size with the header, None if it depends on the
+        contents.
+        '''
+        global header
+
+        sizes = [header.fixed_size(), self.fixed_size()]
+        return None if None in sizes else " + ".join(sizes)
+
+    def generate_sizes(self):
+        global header
+
+        ow = OutputWriter()
+        if self.wire_constant() != None:
+            ow.add("constexpr size_t {} = {};".format(self.wire_constant(), self.fixed_wire_size()))
+        ow.add("size_t wire_bytes(const {}& input);".format(self.struct_name))
+        return str(ow)
+
     def generate_packer(self):
         global header
 
         ow = OutputWriter()
-        ow.add("void pack_{}({} input, std::vector<char> &message)".format(self.name, self.struct_name))
+        ow.add("size_t wire_bytes(const {}& input)".format(self.struct_name))
         ow.open_scope()
-        header.generate_packer("message", ow)  # do the header packing first.
+        if self.wire_constant() != None:
+            ow.add("return {};".format(self.wire_constant()))
+        else:
+            ow.add("return {} + {};".format(header.wire_size("input"), self.wire_size("input")))
+        ow.close_scope()
+        ow.add("")
+
+        ow.add("size_t pack_{}(const {}& input, char* buffer)".format(self.name, self.struct_name))
+        ow.open_scope()
+        ow.add("char* out = buffer;")
+        header.generate_packer(ow, "input")  # do the header packing first.
 
         for child in self.children:
-            child.generate_packer("message", ow)
+            child.generate_packer(ow, "input")
+
+        ow.add("return out - buffer;")
+        ow.close_scope()
+        ow.add("")
 
+        ow.add("void pack_{}(const {}& input, std::vector<char> &message)".format(self.name, self.struct_name))
+        ow.open_scope()
+        ow.add("size_t at = message.size();")
+        ow.add("message.resize(at + wire_bytes(input));")
+        ow.add("pack_{}(input, &message[at]);".format(self.name))
         ow.close_scope()
         return str(ow)
 
@@ -292,8 +416,20 @@ class Field(StateItem):
         #reset_procedures.append("{} = 0;".format(self.working_struct_var))
         pass
 
-    def generate_packer(self, messageName, ow):
-        ow.add("_push_back_generic({}, (char*) &input.{}, {});".format(self.field_size, self.name, messageName))
+    def generate_packer(self, ow, source):
+        ow.add("_put(out, (const char*) & {}.{}, {});".format(source, self.name, self.field_size))
+
+    def fixed_size(self):
+        return self.field_size
+
+    def wire_size(self, source):
+        return self.field_size
+
+    def generate_decoder(self, ow, target):
+        ow.add("if (!_take(in, {}, (char*) & {}.{})) return false;".format(self.field_size, target, self.name))
+
+    def generate_masked_decoder(self, ow, target, value):
+        ow.add("{}.{} = {};".format(target, self.name, value))
 
     def get_value(self, structname=None):
         return self.working_struct_var if structname == None else structname + "." + self.name
@@ -338,9 +474,24 @@ class Flag(NonChildStateItem):
         variables["_checksum"] = "std::vector<char>"
         variables["_checksum_running"] = "bool"
 
-    def generate_packer(self, messageName, ow):
-        ow.add("{} tmp = ({} & 1) << {};".format(self.type, self.working_struct_var, self.offset))
-        ow.add("_push_back_generic({}, (char*) &tmp, {});".format(self.read_amt_variable, messageName))
+    def generate_packer(self, ow, source):
+        ow.open_scope()
+        ow.add("{} tmp = ({}.{} & 1) << {};".format(self.type, source, self.name, self.offset))
+        ow.add("_put(out, (const char*) &tmp, {});".format(self.field_size))
+        ow.close_scope()
+
+    def fixed_size(self):
+        return self.field_size
+
+    def wire_size(self, source):
+        return self.field_size
+
+    def generate_decoder(self, ow, target):
+        ow.add("if (!_take(in, {}, (char*) & {}.{})) return false;".format(self.field_size, target, self.name))
+        self.generate_masked_decoder(ow, target, "{}.{}".format(target, self.name))
+
+    def generate_masked_decoder(self, ow, target, value):
+        ow.add("{}.{} = ({} >> {}) & 1;".format(target, self.name, value, self.offset))
 
     def get_value(self, structname=None):
         return self.working_struct_var if structname == None else structname + "." + self.name
@@ -386,8 +537,17 @@ class ChecksumBegin(StateItem):
 
 
 
-    def generate_packer(self, messageName, ow):
-        pass
+    def generate_packer(self, ow, source):
+        ow.add("const char* _checksum_from = out;")
+
+    def fixed_size(self):
+        return "0"
+
+    def wire_size(self, source):
+        return "0"
+
+    def generate_decoder(self, ow, target):
+        ow.add("_checksum_from = in.data;")
 
     def get_value(self, structname=None):
         return None
@@ -444,8 +604,36 @@ class ChecksumEnd(StateItem):
         reset_procedures.append("_checksum.clear();")
         variables["_checksum"] = "std::vector<char>"
 
-    def generate_packer(self, messageName, ow):
-        pass
+    def generate_packer(self, ow, source):
+        ow.open_scope()
+        ow.add("uint16_t sum1 = 0, sum2 = 0;")
+        ow.add("for(const char* c = _checksum_from; c < out; c++)")
+        ow.open_scope()
+        ow.add("sum1 = (sum1 + (uint8_t) *c) % 256;")
+        ow.add("sum2 = (sum2 + sum1) % 256;")
+        ow.close_scope()
+        ow.add("uint16_t sum = (sum2 << 8) | sum1;")
+        ow.add("_put(out, (const char*) &sum, sizeof(uint16_t));")
+        ow.close_scope()
+
+    def fixed_size(self):
+        return "(sizeof(uint16_t))"
+
+    def wire_size(self, source):
+        return "(sizeof(uint16_t))"
+
+    def generate_decoder(self, ow, target):
+        # only Fletcher16 exists, over what was read since checksum_begin
+        ow.open_scope()
+        ow.add("uint16_t actual = 0, sum1 = 0, sum2 = 0;")
+        ow.add("for(const char* c = _checksum_from; c < in.data; c++)")
+        ow.open_scope()
+        ow.add("sum1 = (sum1 + (uint8_t) *c) % 256;")
+        ow.add("sum2 = (sum2 + sum1) % 256;")
+        ow.close_scope()
+        ow.add("if (!_take(in, sizeof(uint16_t), (char*) &actual)) return false;")
+        ow.add("if (((sum2 << 8) | sum1) != actual) return false;")
+        ow.close_scope()
 
     def get_value(self, structname=None):
         return None
@@ -460,10 +648,9 @@ class Buffer(StateItem):
             # should get type, name, length, maxlength
 
         self.base_type = self.type;
-        self.type = "{}[{}]".format(self.type, self.maxlength)
+        self.type = "entries_t<{}>".format(self.type)
         self.working_struct_var = self.message.working_struct + "." + self.name
-        self.field_size = "(sizeof({}))".format(self.type)
-        self.field_ptr = "((char*) & " + self.working_struct_var + ")"
+        self.field_ptr = "((char*) " + self.working_struct_var + ".data())"
 
         try:
             self.read_amt_variable = eval(self.length)
@@ -471,10 +658,19 @@ class Buffer(StateItem):
             self.read_amt_variable = self.message.working_struct + "." + self.length
 
     def generate_struct(self):
-        return [(self.base_type, "{}[{}]".format(self.name, self.maxlength))]
+        return [(self.type, self.name)]
 
     def generate_code(self, output, next):
-        output.add("if (!_read_front({}, {})) break;".format(self.read_amt_variable, self.field_ptr))
+        count = self.count(self.message.working_struct)
+
+        output.add("if ({} > {})".format(count, self.maxlength))
+        output.open_scope()
+        output.add("_die(\"{} has too many entries\");".format(self.name))
+        output.add("break;")
+        output.close_scope()
+        output.add("if (_buffer.size() < {} * sizeof({})) break;".format(count, self.base_type))
+        output.add("{}.allocate({});".format(self.working_struct_var, count))
+        output.add("if (!_read_front({} * sizeof({}), {})) break;".format(count, self.base_type, self.field_ptr))
         output.add("_state = {};".format(next))
 
     def generate_states(self, output, next):
@@ -489,8 +685,34 @@ class Buffer(StateItem):
         #reset_procedures.append("for(int i = 0; i < {}; i++) {}[i] = 0;".format(self.maxlength, self.working_struct_var))
         pass
 
-    def generate_packer(self, messageName, ow):
-        ow.add("_push_back_generic(({} * sizeof({}) ), ((char*) &input.{}), {});".format(self.read_amt_variable, self.base_type, self.name, messageName))
+    def count(self, source):
+        ''' The number of items in the buffer of source. '''
+        if isinstance(self.read_amt_variable, str):
+            return source + "." + self.length
+        return str(self.read_amt_variable)
+
+    def generate_packer(self, ow, source):
+        # entries that were never allocated have no data() to copy from
+        ow.add("if ({} != 0)".format(self.count(source)))
+        ow.increase_indent()
+        ow.add("_put(out, (const char*) {}.{}.data(), {});".format(source, self.name, self.wire_size(source)))
+        ow.decrease_indent()
+
+    def fixed_size(self):
+        return None
+
+    def wire_size(self, source):
+        return "{} * sizeof({})".format(self.count(source), self.base_type)
+
+    def generate_decoder(self, ow, target):
+        count = self.count(target)
+
+        # the count came off the wire, nothing is allocated for it before
+        # the span is known to hold that many
+        ow.add("if ({} > {}) return false;".format(count, self.maxlength))
+        ow.add("if (in.length < {} * sizeof({})) return false;".format(count, self.base_type))
+        ow.add("{}.{}.allocate({});".format(target, self.name, count))
+        ow.add("if (!_take(in, {} * sizeof({}), (char*) {}.{}.data())) return false;".format(count, self.base_type, target, self.name))
 
     def get_value(self, structname=None):
         return self.working_struct_var if structname == None else structname + "." + self.name
@@ -554,10 +776,24 @@ class Union(StateItem):
         for child in self.children:
             child.process()
 
-    def generate_packer(self, messageName, ow):
+    def generate_packer(self, ow, source):
         ow.open_scope()
-        ow.add("{} temp = {};".format(self.typename, self.get_value("input")))
-        ow.add("_push_back_generic({}, (char*) &temp, {});".format(self.field_size, messageName))
+        ow.add("{} temp = {};".format(self.typename, self.get_value(source)))
+        ow.add("_put(out, (const char*) &temp, {});".format(self.field_size))
+        ow.close_scope()
+
+    def fixed_size(self):
+        return self.field_size
+
+    def wire_size(self, source):
+        return self.field_size
+
+    def generate_decoder(self, ow, target):
+        ow.open_scope()
+        ow.add(self.typename + " tmp;")
+        ow.add("if (!_take(in, {}, (char*) &tmp)) return false;".format(self.field_size))
+        for num, child in enumerate(self.children):
+            child.generate_masked_decoder(ow, target, "(tmp & {})".format(self.masks[num]))
         ow.close_scope()
 
     def get_value(self, structname=None):
@@ -608,12 +844,28 @@ class Const(StateItem):
     def process(self):
         pass
 
-    def generate_packer(self, messageName, ow):
+    def generate_packer(self, ow, source):
         ow.open_scope()
         ow.add("{} tmp = {};".format(self.typename, self.value))
-        ow.add("_push_back_generic({}, (char*) &tmp, {});".format(self.field_size, messageName))
+        ow.add("_put(out, (const char*) &tmp, {});".format(self.field_size))
         ow.close_scope()
 
+    def fixed_size(self):
+        return self.field_size
+
+    def wire_size(self, source):
+        return self.field_size
+
+    def generate_decoder(self, ow, target):
+        ow.open_scope()
+        ow.add(self.typename + " tmp;")
+        ow.add("if (!_take(in, {}, (char*) &tmp)) return false;".format(self.field_size))
+        ow.add("if (tmp != {}) return false;".format(self.value))
+        ow.close_scope()
+
+    def generate_masked_decoder(self, ow, target, value):
+        ow.add("if ({} != {}) return false;".format(value, self.value))
+
     def get_value(self, structname=None):
         return self.value
 
@@ -628,6 +880,8 @@ c = '''
 #include <deque>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <vector>
 
 namespace {namespace}
@@ -636,31 +890,81 @@ namespace {namespace}
 // User supplied typdefs
 {typedefs}
 
+// The entries of a buffer, allocated to fit how many there are. They are
+// shared by every copy of the message they belong to, so copying a message
+// copies none of them; a message is filled in once and only read after.
+template<typename T>
+class entries_t
+{{
+public:
+    // room for count zeroed entries, the ones held before are let go
+    void allocate(size_t count)
+    {{
+        _entries = std::shared_ptr<T>(new T[count](), std::default_delete<T[]>());
+    }}
+
+    T* data() const {{return _entries.get();}}
+    T& operator[](size_t i) const {{return _entries.get()[i];}}
+
+private:
+    std::shared_ptr<T> _entries;
+}};
+
 // Message definitions
 {structs}
 
+// Packed sizes, fixed ones are known at compile time
+{sizes}
+
 // Forward declarations
 {forwards}
 void handle_invalid_message(const char* message); // usesupplied, when the parser encounters an error
 
-std::deque<char> _buffer;
-
-int _state = 0;
-{variables}
+// Parses a stream, update() takes bytes as they arrive and the handler of
+// each message is called once it is complete. Everything it keeps is its
+// own, so there can be one per connection or thread.
+class Parser
+{{
+public:
+    Parser();
+
+    void update(int length, char* buffer);
+    void clear();
+
+private:
+    void _reset();
+    void _die(const char* message);
+    void _push_back(int length, char* buffer);
+    void _push_front(int length, char* buffer);
+    bool _read_front(int length, char* outbuffer);
+    void _process();
+
+    std::deque<char> _buffer;
+    int _state;
+    int _push_front_amt;
+    {variables}
+}};
+
+Parser::Parser()
+:_state(0),
+_push_front_amt(0)
+{{
+    _reset();
+}}
 
-void _reset()
+void Parser::_reset()
 {{
     _state = 0;
     {reset_code}
 }}
 
-void _die(const char* message)
+void Parser::_die(const char* message)
 {{
     _reset();
     handle_invalid_message(message);
 }}
 
-void _push_back(int length, char* buffer)
+void Parser::_push_back(int length, char* buffer)
 {{
     for(int i = 0; i < length; i++)
     {{
@@ -669,16 +973,15 @@ void _push_back(int length, char* buffer)
 }}
 
 
-void _push_back_generic(int length, char* buffer, std::vector<char> &outputbuf)
+// copies length bytes of value to out and moves past them, packers size
+// the buffer up front so there is no check.
+void _put(char*& out, const char* value, size_t length)
 {{
-    for(int i = 0; i < length; i++)
-    {{
-        outputbuf.push_back(buffer[i]);
-    }}
+    memcpy(out, value, length);
+    out += length;
 }}
 
-int _push_front_amt = 0;
-void _push_front(int length, char* buffer)
+void Parser::_push_front(int length, char* buffer)
 {{
     _push_front_amt += length;
     for(int i = length - 1; i >= 0; i--)
@@ -687,7 +990,7 @@ void _push_front(int length, char* buffer)
     }}
 }}
 
-bool _read_front(int length, char* outbuffer)
+bool Parser::_read_front(int length, char* outbuffer)
 {{
     if(_buffer.size() < length)
         return false;
@@ -707,7 +1010,7 @@ bool _read_front(int length, char* outbuffer)
     return true;
 }}
 
-void _process()
+void Parser::_process()
 {{
     // do cleanup of a possible remaining useless variables.
     char a;
@@ -729,7 +1032,7 @@ void _process()
     }}
 }}
 
-void update(int length, char* buffer)
+void Parser::update(int length, char* buffer)
 {{
     _push_back(length, buffer);
 
@@ -742,13 +1045,54 @@ void update(int length, char* buffer)
     }} while(laststate != _state);
 }}
 
-void clear()
+void Parser::clear()
 {{
     _push_front_amt = 0;
     _buffer.clear();
     _reset();
 }}
 
+// the parser behind update() and clear(), for programs with one stream
+Parser _parser;
+
+void update(int length, char* buffer)
+{{
+    _parser.update(length, buffer);
+}}
+
+void clear()
+{{
+    _parser.clear();
+}}
+
+// a non-owning view of the bytes of a message still to be decoded
+struct _span
+{{
+    const char* data;
+    size_t length;
+}};
+
+// copies the next length bytes of in to outbuffer and moves past them,
+// false if in is shorter.
+bool _take(_span& in, size_t length, char* outbuffer)
+{{
+    if(in.length < length)
+        return false;
+
+    memcpy(outbuffer, in.data, length);
+    in.data += length;
+    in.length -= length;
+    return true;
+}}
+
+{decoders}
+
+// Decodes the one message in data, fields are read in place rather than
+// through the stream parser, and calls its handler. Unlike update() the
+// whole message has to be there and nothing else; anything else goes to
+// handle_invalid_message and false is returned.
+{decode}
+
 {packs}
 
 }} // end namespace
@@ -807,13 +1151,16 @@ def parse(input_file, output_file):
     header.process()
 
     d = dict({
-    "variables" :  "\n".join("%s %s;" % (t, n) for n, t in variables.items()),
+    "variables" :  "\n    ".join("%s %s;" % (t, n) for n, t in variables.items()),
     "reset_code" : "\n".join(reset_procedures),
     "structs" : generate_structs(),
     "switches" : generate_switches(),
     "forwards" : "\n\t".join(forward_declares),
     "initial_state" : header.get_first_state_id(),
+    "sizes" : "\n".join([m.generate_sizes() for m in messages]),
     "packs" : "\n".join([m.generate_packer() for m in messages]),
+    "decoders" : "\n".join([header.generate_decoder(False)] + [m.generate_decoder(True) for m in messages]),
+    "decode" : header.generate_decode(),
     "typedefs":""
     }.items() + GENERATOR_PROPERTIES.items() + HOOKS.items())
 
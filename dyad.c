@@ -22,6 +22,7 @@
   #include <sys/types.h>
   #include <sys/socket.h>
   #include <sys/time.h>
+  #include <sys/uio.h>
   #include <netinet/in.h>
   #include <netinet/tcp.h>
   #include <arpa/inet.h>
@@ -37,6 +38,11 @@
 
 #define DYAD_VERSION "0.2.0"
 
+#ifdef __linux__
+  #define DYAD_EPOLL
+  #include <sys/epoll.h>
+#endif
+
 
 #ifdef _WIN32
   #define close(a) closesocket(a)
@@ -145,6 +151,135 @@ static void dyad_vectorSplice(
 
 
 
+/*===========================================================================*/
+/* Buffers                                                                   */
+/*===========================================================================*/
+
+/* Output is kept in a list of chunks so writing appends with memcpy and
+ * flushing hands every chunk to writev() at once, nothing is ever moved. */
+
+#define DYAD_CHUNK_SIZE 4096
+#define DYAD_IOV_MAX    64
+
+typedef struct dyad_Chunk {
+  struct dyad_Chunk *next;
+  int start, end, capacity; /* unsent bytes are data[start, end) */
+  char data[];
+} dyad_Chunk;
+
+typedef struct {
+  dyad_Chunk *head, *tail;
+  int length;
+} dyad_WriteBuffer;
+
+
+static void dyad_writeBufferPush(dyad_WriteBuffer *b, const char *data, int size) {
+  while (size > 0) {
+    dyad_Chunk *c = b->tail;
+    int n;
+    if (!c || c->end == c->capacity) {
+      int capacity = size > DYAD_CHUNK_SIZE ? size : DYAD_CHUNK_SIZE;
+      c = dyad_realloc(NULL, sizeof(*c) + capacity);
+      c->next = NULL;
+      c->start = c->end = 0;
+      c->capacity = capacity;
+      if (b->tail) {
+        b->tail->next = c;
+      } else {
+        b->head = c;
+      }
+      b->tail = c;
+    }
+    n = c->capacity - c->end;
+    if (n > size) n = size;
+    memcpy(c->data + c->end, data, n);
+    c->end += n;
+    b->length += n;
+    data += n;
+    size -= n;
+  }
+}
+
+
+static void dyad_writeBufferPushChar(dyad_WriteBuffer *b, char c) {
+  dyad_writeBufferPush(b, &c, 1);
+}
+
+
+static void dyad_writeBufferConsume(dyad_WriteBuffer *b, int size) {
+  b->length -= size;
+  while (size > 0) {
+    dyad_Chunk *c = b->head;
+    int n = c->end - c->start;
+    if (n > size) {
+      c->start += size;
+      return;
+    }
+    size -= n;
+    b->head = c->next;
+    if (!b->head) b->tail = NULL;
+    dyad_free(c);
+  }
+}
+
+
+static void dyad_writeBufferClear(dyad_WriteBuffer *b) {
+  while (b->head) {
+    dyad_Chunk *c = b->head;
+    b->head = c->next;
+    dyad_free(c);
+  }
+  b->tail = NULL;
+  b->length = 0;
+}
+
+
+/* Received bytes waiting for a newline. Lines are handed out in place, so
+ * consuming one only moves the start; the unread tail is moved back to the
+ * front only when new data would not fit behind it. */
+
+typedef struct {
+  char *data;
+  int start, length, capacity; /* unread bytes are data[start, start+length) */
+} dyad_LineBuffer;
+
+
+static char *dyad_lineBufferAppend(dyad_LineBuffer *b, const char *data, int size) {
+  char *dst;
+  if (b->start + b->length + size > b->capacity) {
+    if (b->start > 0) {
+      memmove(b->data, b->data + b->start, b->length);
+      b->start = 0;
+    }
+    if (b->length + size > b->capacity) {
+      int capacity = b->capacity ? b->capacity : 256;
+      while (capacity < b->length + size) capacity <<= 1;
+      b->data = dyad_realloc(b->data, capacity);
+      b->capacity = capacity;
+    }
+  }
+  dst = b->data + b->start + b->length;
+  memcpy(dst, data, size);
+  b->length += size;
+  return dst;
+}
+
+
+static void dyad_lineBufferConsume(dyad_LineBuffer *b, int size) {
+  b->start += size;
+  b->length -= size;
+  if (b->length == 0) b->start = 0;
+}
+
+
+static void dyad_lineBufferClear(dyad_LineBuffer *b) {
+  b->start = b->length = 0;
+}
+
+
+
+#ifndef DYAD_EPOLL
+
 /*===========================================================================*/
 /* SelectSet                                                                 */
 /*===========================================================================*/
@@ -255,6 +390,8 @@ static int dyad_selectHas(dyad_SelectSet *s, int set, int fd) {
 #endif
 }
 
+#endif /* DYAD_EPOLL */
+
 
 /*===========================================================================*/
 /* Core                                                                      */
@@ -275,23 +412,37 @@ struct dyad_Stream {
   int bytesSent, bytesReceived;
   double lastActivity, timeout;
   dyad_Vector(dyad_Listener) listeners;
-  dyad_Vector(char) lineBuffer;
-  dyad_Vector(char) writeBuffer;
-  dyad_Stream *next;
+  dyad_LineBuffer lineBuffer;
+  dyad_WriteBuffer writeBuffer;
+  dyad_Stream *next, *prev;
+  dyad_Stream *nextWritten;  /* on dyad_writtenStreams */
+  dyad_Stream *nextClosed;   /* on dyad_closedStreams */
 };
 
-#define DYAD_FLAG_READY   (1 << 0)
-#define DYAD_FLAG_WRITTEN (1 << 1)
+#define DYAD_FLAG_READY        (1 << 0)
+#define DYAD_FLAG_WRITTEN      (1 << 1)
+#define DYAD_FLAG_ON_WRITTEN   (1 << 2)
+#define DYAD_FLAG_ON_CLOSED    (1 << 3)
 
 
 static dyad_Stream *dyad_streams;
+static dyad_Stream *dyad_writtenStreams; /* written to since their last flush */
+static dyad_Stream *dyad_closedStreams;  /* may be closed, checked on update */
 static int dyad_streamCount;
 static char dyad_panicMsgBuffer[128];
 static dyad_PanicCallback dyad_panicCallback;
-static dyad_SelectSet dyad_selectSet;
 static double dyad_updateTimeout = 1;
 static double dyad_tickInterval = 1;
 static double dyad_lastTick = 0;
+static double dyad_lastTimeoutCheck = 0;
+#ifdef DYAD_EPOLL
+static int dyad_epollFd = -1;
+#else
+static dyad_SelectSet dyad_selectSet;
+#endif
+
+#define DYAD_TIMEOUT_CHECK_INTERVAL 0.1
+#define DYAD_MAX_EVENTS 256
 
 
 static void dyad_panic(const char *fmt, ...) {
@@ -326,14 +477,47 @@ static const char *dyad_intToStr(int x) {
 static void dyad_destroyStream(dyad_Stream *stream);
 
 static void dyad_destroyClosedStreams(void) {
-  dyad_Stream *stream = dyad_streams;
-  while (stream) {
+  while (dyad_closedStreams) {
+    dyad_Stream *stream = dyad_closedStreams;
+    dyad_closedStreams = stream->nextClosed;
+    stream->flags &= ~DYAD_FLAG_ON_CLOSED;
+    /* It may have been reopened since */
     if (stream->state == DYAD_STATE_CLOSED) {
-      dyad_Stream *next = stream->next;
       dyad_destroyStream(stream);
-      stream = next;
-    } else {
-      stream = stream->next;
+    }
+  }
+}
+
+
+static void dyad_markClosed(dyad_Stream *stream) {
+  if (stream->flags & DYAD_FLAG_ON_CLOSED) return;
+  stream->flags |= DYAD_FLAG_ON_CLOSED;
+  stream->nextClosed = dyad_closedStreams;
+  dyad_closedStreams = stream;
+}
+
+
+static void dyad_markWritten(dyad_Stream *stream) {
+  stream->flags |= DYAD_FLAG_WRITTEN;
+  if (stream->flags & DYAD_FLAG_ON_WRITTEN) return;
+  stream->flags |= DYAD_FLAG_ON_WRITTEN;
+  stream->nextWritten = dyad_writtenStreams;
+  dyad_writtenStreams = stream;
+}
+
+
+static int dyad_flushWriteBuffer(dyad_Stream *stream);
+
+static void dyad_flushWrittenStreams(void) {
+  /* Data written to a stream since the last update is sent right away */
+  while (dyad_writtenStreams) {
+    dyad_Stream *stream = dyad_writtenStreams;
+    dyad_writtenStreams = stream->nextWritten;
+    stream->flags &= ~DYAD_FLAG_ON_WRITTEN;
+    if (stream->flags & DYAD_FLAG_WRITTEN &&
+        stream->state != DYAD_STATE_CLOSED
+    ) {
+      dyad_flushWriteBuffer(stream);
     }
   }
 }
@@ -366,6 +550,12 @@ static void dyad_updateStreamTimeouts(void) {
   dyad_Stream *stream;
   dyad_Event e = dyad_createEvent(DYAD_EVENT_TIMEOUT);
   e.msg = "stream timed out";
+  /* Walking every stream on every update would cost more than the
+   * update itself with many idle streams */
+  if (currentTime - dyad_lastTimeoutCheck < DYAD_TIMEOUT_CHECK_INTERVAL) {
+    return;
+  }
+  dyad_lastTimeoutCheck = currentTime;
   stream = dyad_streams;
   while (stream) {
     if (stream->timeout) {
@@ -384,11 +574,20 @@ static void dyad_updateStreamTimeouts(void) {
 /* Stream                                                                    */
 /*===========================================================================*/
 
+static void dyad_unwatchSocket(dyad_Stream *stream) {
+#ifdef DYAD_EPOLL
+  epoll_ctl(dyad_epollFd, EPOLL_CTL_DEL, stream->sockfd, NULL);
+#else
+  (void) stream;
+#endif
+}
+
+
 static void dyad_destroyStream(dyad_Stream *stream) {
   dyad_Event e;
-  dyad_Stream **next;
   /* Close socket */
   if (stream->sockfd != -1) {
+    dyad_unwatchSocket(stream);
     close(stream->sockfd);
   }
   /* Emit destroy event */
@@ -396,16 +595,19 @@ static void dyad_destroyStream(dyad_Stream *stream) {
   e.msg = "the stream has been destroyed";
   dyad_emitEvent(stream, &e);
   /* Remove from list and decrement count */
-  next = &dyad_streams;
-  while (*next != stream) {
-    next = &(*next)->next;
+  if (stream->prev) {
+    stream->prev->next = stream->next;
+  } else {
+    dyad_streams = stream->next;
+  }
+  if (stream->next) {
+    stream->next->prev = stream->prev;
   }
-  *next = stream->next;
   dyad_streamCount--;
   /* Destroy and free */
   dyad_vectorDeinit(&stream->listeners);
-  dyad_vectorDeinit(&stream->lineBuffer);
-  dyad_vectorDeinit(&stream->writeBuffer);
+  dyad_free(stream->lineBuffer.data);
+  dyad_writeBufferClear(&stream->writeBuffer);
   dyad_free(stream->address);
   dyad_free(stream);
 }
@@ -485,6 +687,18 @@ static void dyad_setSocket(dyad_Stream *stream, int sockfd) {
   stream->sockfd = sockfd;
   dyad_setSocketNonBlocking(stream, 1);
   dyad_initAddress(stream);
+#ifdef DYAD_EPOLL
+  /* Edge triggered: every handler reads or writes until the socket would
+   * block, so the socket never has to be re-armed. dyad_listenEx makes the
+   * listener level triggered */
+  if (sockfd != -1) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = stream;
+    epoll_ctl(dyad_epollFd, EPOLL_CTL_ADD, sockfd, &ev);
+  }
+#endif
 }
 
 
@@ -547,38 +761,31 @@ static void dyad_handleReceivedData(dyad_Stream *stream) {
 
     /* Handle line event */
     if (dyad_hasListenerForEvent(stream, DYAD_EVENT_LINE)) {
-      int i, start;
-      char *buf;
-      for (i = 0; i < size; i++) {
-        dyad_vectorPush(&stream->lineBuffer, data[i]);
-      }
-      start = 0;
-      buf = stream->lineBuffer.data;
-      for (i = 0; i < stream->lineBuffer.length; i++) {
-        if (buf[i] == '\n') {
-          dyad_Event e;
-          buf[i] = '\0';
-          e = dyad_createEvent(DYAD_EVENT_LINE);
-          e.msg = "received line";
-          e.data = &buf[start];
-          e.size = i - start;
-          /* Check and strip carriage return */
-          if (e.size > 0 && e.data[e.size - 1] == '\r') {
-            e.data[--e.size] = '\0';
-          }
-          dyad_emitEvent(stream, &e);
-          start = i + 1;
-          /* Check stream state in case it was closed during one of the line
-           * event handlers. */
-          if (stream->state != DYAD_STATE_CONNECTED) {
-            return;
-          }
+      /* Only the new bytes can hold a newline, anything older would have
+       * been handed out already */
+      char *scan = dyad_lineBufferAppend(&stream->lineBuffer, data, size);
+      char *end = scan + size;
+      char *line = stream->lineBuffer.data + stream->lineBuffer.start;
+      char *nl;
+      while ((nl = memchr(scan, '\n', end - scan)) != NULL) {
+        dyad_Event e;
+        *nl = '\0';
+        e = dyad_createEvent(DYAD_EVENT_LINE);
+        e.msg = "received line";
+        e.data = line;
+        e.size = nl - line;
+        /* Check and strip carriage return */
+        if (e.size > 0 && e.data[e.size - 1] == '\r') {
+          e.data[--e.size] = '\0';
         }
-      }
-      if (start == stream->lineBuffer.length) {
-        dyad_vectorClear(&stream->lineBuffer);
-      } else {
-        dyad_vectorSplice(&stream->lineBuffer, 0, start);
+        dyad_lineBufferConsume(&stream->lineBuffer, nl + 1 - line);
+        dyad_emitEvent(stream, &e);
+        /* Check stream state in case it was closed during one of the line
+         * event handlers. */
+        if (stream->state != DYAD_STATE_CONNECTED) {
+          return;
+        }
+        line = scan = nl + 1;
       }
     }
   }
@@ -620,10 +827,27 @@ static void dyad_acceptPendingConnections(dyad_Stream *stream) {
 
 static int dyad_flushWriteBuffer(dyad_Stream *stream) {
   stream->flags &= ~DYAD_FLAG_WRITTEN;
-  if (stream->writeBuffer.length > 0) {
-    /* Send data */
-    int size = send(stream->sockfd, stream->writeBuffer.data,
-                    stream->writeBuffer.length, 0);
+  while (stream->writeBuffer.length > 0) {
+    /* Send data, every chunk at once where there's writev */
+    int size, wanted;
+#ifdef _WIN32
+    dyad_Chunk *c = stream->writeBuffer.head;
+    wanted = c->end - c->start;
+    size = send(stream->sockfd, c->data + c->start, wanted, 0);
+#else
+    struct iovec iov[DYAD_IOV_MAX];
+    int count = 0;
+    dyad_Chunk *c = stream->writeBuffer.head;
+    wanted = 0;
+    while (c && count < DYAD_IOV_MAX) {
+      iov[count].iov_base = c->data + c->start;
+      iov[count].iov_len = c->end - c->start;
+      wanted += c->end - c->start;
+      count++;
+      c = c->next;
+    }
+    size = writev(stream->sockfd, iov, count);
+#endif
     if (size <= 0) {
       if (errno == EWOULDBLOCK) {
         /* No more data can be written */
@@ -634,15 +858,16 @@ static int dyad_flushWriteBuffer(dyad_Stream *stream) {
         return 0;
       }
     }
-    if (size == stream->writeBuffer.length) {
-      dyad_vectorClear(&stream->writeBuffer);
-    } else {
-      dyad_vectorSplice(&stream->writeBuffer, 0, size);
-    }
+    dyad_writeBufferConsume(&stream->writeBuffer, size);
     /* Update status */
     stream->bytesSent += size;
     stream->lastActivity = dyad_getTime();
-  } 
+    /* The socket's buffer is full, we'll hear when it drains */
+    if (size < wanted) {
+      return 0;
+    }
+  }
+
 
   if (stream->writeBuffer.length == 0) {
     dyad_Event e;
@@ -672,14 +897,101 @@ static int dyad_flushWriteBuffer(dyad_Stream *stream) {
 /* Core                                                                      */
 /*---------------------------------------------------------------------------*/
 
+#ifdef DYAD_EPOLL
+
+static void dyad_handleStreamEvents(dyad_Stream *stream, uint32_t events) {
+  switch (stream->state) {
+
+    case DYAD_STATE_CONNECTED:
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        dyad_handleReceivedData(stream);
+        if (stream->state == DYAD_STATE_CLOSED) {
+          break;
+        }
+      }
+      /* Only a stream with something to say, or which hasn't said it is
+       * ready yet, cares that the socket is writable */
+      if (!(stream->flags & DYAD_FLAG_READY) ||
+          stream->writeBuffer.length != 0
+      ) {
+        if (events & EPOLLOUT) {
+          dyad_flushWriteBuffer(stream);
+        }
+      }
+      break;
+
+    case DYAD_STATE_CLOSING:
+      if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        dyad_flushWriteBuffer(stream);
+      }
+      break;
+
+    case DYAD_STATE_CONNECTING:
+      if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        /* Check socket for error */
+        int optval = 0;
+        socklen_t optlen = sizeof(optval);
+        dyad_Event e;
+        getsockopt(stream->sockfd, SOL_SOCKET, SO_ERROR, &optval, &optlen);
+        if (optval != 0 || (events & (EPOLLERR | EPOLLHUP))) {
+          dyad_streamError(stream, "could not connect to server", 0);
+          break;
+        }
+        /* Handle succeselful connection */
+        stream->state = DYAD_STATE_CONNECTED;
+        stream->lastActivity = dyad_getTime();
+        dyad_initAddress(stream);
+        /* Emit connect event */
+        e = dyad_createEvent(DYAD_EVENT_CONNECT);
+        e.msg = "connected to server";
+        dyad_emitEvent(stream, &e);
+        /* The socket is writable already and won't say so again */
+        if (stream->state == DYAD_STATE_CONNECTED) {
+          dyad_flushWriteBuffer(stream);
+        }
+      }
+      break;
+
+    case DYAD_STATE_LISTENING:
+      if (events & EPOLLIN) {
+        dyad_acceptPendingConnections(stream);
+      }
+      break;
+  }
+}
+
+#endif
+
+
 void dyad_update(void) {
+#ifdef DYAD_EPOLL
+  struct epoll_event events[DYAD_MAX_EVENTS];
+  int i, count;
+#else
   dyad_Stream *stream;
   struct timeval tv;
+#endif
 
+  /* Flushed first, a stream written and then closed since the last update
+   * is still on the written list */
+  dyad_flushWrittenStreams();
   dyad_destroyClosedStreams();
   dyad_updateTickTimer();
   dyad_updateStreamTimeouts();
 
+#ifdef DYAD_EPOLL
+  /* Only streams the kernel reports ready are visited */
+  count = epoll_wait(dyad_epollFd, events, DYAD_MAX_EVENTS,
+                     (int) (dyad_updateTimeout * 1000));
+  for (i = 0; i < count; i++) {
+    dyad_Stream *stream = events[i].data.ptr;
+    /* Closed by an earlier stream's handler in this batch */
+    if (stream->state == DYAD_STATE_CLOSED) {
+      continue;
+    }
+    dyad_handleStreamEvents(stream, events[i].events);
+  }
+#else
   /* Create fd sets for select() */
   dyad_selectZero(&dyad_selectSet);
 
@@ -770,16 +1082,13 @@ void dyad_update(void) {
         break;
     }
 
-    /* If data was just now written to the stream we should immediately try to
-     * send it */
-    if (stream->flags & DYAD_FLAG_WRITTEN &&
-        stream->state != DYAD_STATE_CLOSED
-    ) {
-      dyad_flushWriteBuffer(stream);
-    }
-
     stream = stream->next;
   }
+#endif
+
+  /* If data was just now written to a stream we should immediately try to
+   * send it */
+  dyad_flushWrittenStreams();
 }
 
 
@@ -794,6 +1103,12 @@ void dyad_init(void) {
   /* Stops the SIGPIPE signal being raised when writing to a closed socket */
   signal(SIGPIPE, SIG_IGN);
 #endif
+#ifdef DYAD_EPOLL
+  dyad_epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (dyad_epollFd == -1) {
+    dyad_panic("epoll_create1 failed (%d)", errno);
+  }
+#endif
 }
 
 
@@ -803,8 +1118,15 @@ void dyad_shutdown(void) {
     dyad_close(dyad_streams);
     dyad_destroyStream(dyad_streams);
   }
+  dyad_writtenStreams = NULL;
+  dyad_closedStreams = NULL;
   /* Clear up everything */
+#ifdef DYAD_EPOLL
+  close(dyad_epollFd);
+  dyad_epollFd = -1;
+#else
   dyad_selectDeinit(&dyad_selectSet);
+#endif
 #ifdef _WIN32
   WSACleanup();
 #endif
@@ -851,6 +1173,15 @@ dyad_PanicCallback dyad_atPanic(dyad_PanicCallback func) {
 }
 
 
+int dyad_getEventFd(void) {
+#ifdef DYAD_EPOLL
+  return dyad_epollFd;
+#else
+  return -1;
+#endif
+}
+
+
 /*---------------------------------------------------------------------------*/
 /* Stream                                                                    */
 /*---------------------------------------------------------------------------*/
@@ -863,8 +1194,11 @@ dyad_Stream *dyad_newStream(void) {
   stream->lastActivity = dyad_getTime();
   /* Add to list and increment count */
   stream->next = dyad_streams;
+  if (dyad_streams) dyad_streams->prev = stream;
   dyad_streams = stream;
   dyad_streamCount++;
+  /* Destroyed on the next update unless it's opened before then */
+  dyad_markClosed(stream);
   return stream;
 }
 
@@ -913,16 +1247,18 @@ void dyad_close(dyad_Stream *stream) {
   stream->state = DYAD_STATE_CLOSED;
   /* Close socket */
   if (stream->sockfd != -1) {
+    dyad_unwatchSocket(stream);
     close(stream->sockfd);
     stream->sockfd = -1;
   }
+  dyad_markClosed(stream);
   /* Emit event */
   e = dyad_createEvent(DYAD_EVENT_CLOSE);
   e.msg = "stream closed";
   dyad_emitEvent(stream, &e);
   /* Clear buffers */
-  dyad_vectorClear(&stream->lineBuffer);
-  dyad_vectorClear(&stream->writeBuffer);
+  dyad_lineBufferClear(&stream->lineBuffer);
+  dyad_writeBufferClear(&stream->writeBuffer);
 }
 
 
@@ -976,6 +1312,17 @@ int dyad_listenEx(
   stream->state = DYAD_STATE_LISTENING;
   stream->port = port;
   dyad_initAddress(stream);
+#ifdef DYAD_EPOLL
+  {
+    /* Level triggered: an accept that fails for want of descriptors leaves
+     * the rest pending, and they raise no new edge */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = stream;
+    epoll_ctl(dyad_epollFd, EPOLL_CTL_MOD, stream->sockfd, &ev);
+  }
+#endif
   /* Emit listening event */
   e = dyad_createEvent(DYAD_EVENT_LISTEN);
   e.msg = "socket is listening";
@@ -1021,11 +1368,8 @@ int dyad_connect(dyad_Stream *stream, const char *host, int port) {
 
 
 void dyad_write(dyad_Stream *stream, void *data, int size) {
-  char *p = data;
-  while (size--) {
-    dyad_vectorPush(&stream->writeBuffer, *p++);
-  }
-  stream->flags |= DYAD_FLAG_WRITTEN;
+  dyad_writeBufferPush(&stream->writeBuffer, data, size);
+  dyad_markWritten(stream);
 }
 
 
@@ -1045,27 +1389,23 @@ void dyad_vwritef(dyad_Stream *stream, const char *fmt, va_list args) {
             str = "(null)";
             goto writeStr;
           }
-          while ((c = fgetc(fp)) != EOF) {
-            dyad_vectorPush(&stream->writeBuffer, c);
+          while ((c = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            dyad_writeBufferPush(&stream->writeBuffer, buf, c);
           }
           break;
         case 'c':
-          dyad_vectorPush(&stream->writeBuffer, va_arg(args, int));
+          dyad_writeBufferPushChar(&stream->writeBuffer, va_arg(args, int));
           break;
         case 's':
           str = va_arg(args, char*);
           if (str == NULL) str = "(null)";
           writeStr:
-          while (*str) {
-            dyad_vectorPush(&stream->writeBuffer, *str++);
-          }
+          dyad_writeBufferPush(&stream->writeBuffer, str, strlen(str));
           break;
         case 'b':
           str = va_arg(args, char*);
           c = va_arg(args, int);
-          while (c--) {
-            dyad_vectorPush(&stream->writeBuffer, *str++);
-          }
+          dyad_writeBufferPush(&stream->writeBuffer, str, c);
           break;
         default:
           f[1] = *fmt;
@@ -1083,11 +1423,16 @@ void dyad_vwritef(dyad_Stream *stream, const char *fmt, va_list args) {
           goto writeStr;
       }
     } else {
-      dyad_vectorPush(&stream->writeBuffer, *fmt);
+      /* Plain text up to the next directive goes in at once */
+      const char *end = strchr(fmt, '%');
+      int n = end ? end - fmt : (int) strlen(fmt);
+      dyad_writeBufferPush(&stream->writeBuffer, fmt, n);
+      fmt += n;
+      continue;
     }
     fmt++;
   }
-  stream->flags |= DYAD_FLAG_WRITTEN;
+  dyad_markWritten(stream);
 }
 
 
@@ -60,6 +60,7 @@ int  dyad_getStreamCount(void);
 void dyad_setTickInterval(double seconds);
 void dyad_setUpdateTimeout(double seconds);
 dyad_PanicCallback dyad_atPanic(dyad_PanicCallback func);
+int  dyad_getEventFd(void);
 
 dyad_Stream *dyad_newStream(void);
 int  dyad_listen(dyad_Stream *stream, int port);
@@ -0,0 +1,371 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Runs a Unicast on a thread of its own.
+**/
+
+#include "iothread.h"
+#include "reactor.h"
+#include "Timer.hpp"
+#include "Debug.hpp"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+const int IoThread::RING_SLOTS;
+
+// room every slot starts out with, larger messages grow theirs once
+const size_t SLOT_RESERVE_BYTES = 2048;
+
+// ms of cpu a clock has counted
+static double clockMs(clockid_t clock)
+{
+    struct timespec ts;
+    if(clock_gettime(clock, &ts) == -1)
+        return 0;
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+IoThread::IoThread(Unicast& com, int recvBudget, int statsIntervalMs)
+:_com(com),
+_recvBudget(recvBudget),
+_inbound(RING_SLOTS),
+_outbound(RING_SLOTS),
+_running(false),
+_receiveBlocked(false),
+_protocolThread(pthread_self()),
+_handedOut(0),
+_unflushed(0),
+_statsIntervalMs(statsIntervalMs),
+_lastStatsMs(0),
+_lastIoCpuMs(0),
+_lastProtocolCpuMs(0)
+{
+    for(size_t i = 0; i < _inbound.capacity(); i++)
+        _inbound.slot(i).data.reserve(SLOT_RESERVE_BYTES);
+    for(size_t i = 0; i < _outbound.capacity(); i++)
+        _outbound.slot(i).data.reserve(SLOT_RESERVE_BYTES);
+
+    _inboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _outboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(_inboundFd == -1 || _outboundFd == -1)
+        log(ERROR, "eventfd: %s\n", strerror(errno));
+
+    _stats.messagesIn = 0;
+    _stats.messagesOut = 0;
+    _stats.inboundFull = 0;
+    _stats.outboundFull = 0;
+    _stats.wakeupsIn = 0;
+    _stats.wakeupsOut = 0;
+}
+
+IoThread::~IoThread()
+{
+    stop();
+    close(_inboundFd);
+    close(_outboundFd);
+}
+
+bool IoThread::pin(pthread_t thread, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int err = pthread_setaffinity_np(thread, sizeof set, &set);
+    if(err)
+    {
+        log(WARN, "could not pin a thread to cpu %d: %s\n", cpu, strerror(err));
+        return false;
+    }
+    return true;
+}
+
+void IoThread::start(int cpu)
+{
+    _running = true;
+    _thread = std::thread(&IoThread::run, this);
+
+    if(cpu >= 0)
+        pin(_thread.native_handle(), cpu);
+}
+
+void IoThread::stop()
+{
+    if(! _running.exchange(false))
+        return;
+
+    signal(_outboundFd);
+    _thread.join();
+}
+
+void IoThread::signal(int fd)
+{
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof one) == -1 && errno != EAGAIN)
+        log(WARN, "eventfd write: %s\n", strerror(errno));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Protocol thread
+
+void IoThread::queue(const int node, const std::vector<char> &message, const uint32_t replaces)
+{
+    Outbound* slot = _outbound.claim();
+    if(slot == NULL)
+    {
+        // the I/O thread is behind, make sure it's awake and wait it out
+        _stats.outboundFull++;
+        _stats.wakeupsOut++;
+        signal(_outboundFd);
+
+        while((slot = _outbound.claim()) == NULL)
+            std::this_thread::yield();
+    }
+
+    slot->node = node;
+    slot->replaces = replaces;
+    slot->data.assign(message.begin(), message.end());
+    _outbound.publish();
+    _unflushed++;
+}
+
+void IoThread::reliableSend(const uint32_t node, const std::vector<char> &message, const uint32_t replaces)
+{
+    queue(node, message, replaces);
+}
+
+void IoThread::sendMessage(const std::vector<char> &message, const uint32_t replaces)
+{
+    queue(-1, message, replaces);
+}
+
+void IoThread::flush()
+{
+    if(! _unflushed)
+        return;
+
+    _unflushed = 0;
+    _stats.wakeupsOut++;
+    signal(_outboundFd);
+}
+
+int IoThread::readBatch(Unicast::Datagram* batch, int budget)
+{
+    if(_handedOut)
+    {
+        _inbound.release(_handedOut);
+        _handedOut = 0;
+
+        // pairs with the fence in run(), one of us sees the other's write
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(_receiveBlocked.load())
+        {
+            _stats.wakeupsOut++;
+            signal(_outboundFd);
+        }
+    }
+
+    // with every slot handed out the I/O thread could publish nothing to
+    // wake us with, and it waits on us for a free slot
+    if(budget >= (int) _inbound.capacity())
+        budget = _inbound.capacity() - 1;
+
+    int count = 0;
+    bool cleared = false;
+    while(count < budget)
+    {
+        Inbound* slot = _inbound.peek(count);
+        if(slot == NULL)
+        {
+            // clear the eventfd before looking again, anything published
+            // after that look signals it anew.
+            if(cleared)
+                break;
+
+            uint64_t signals;
+            if(read(_inboundFd, &signals, sizeof signals) == -1 && errno != EAGAIN)
+                log(WARN, "eventfd read: %s\n", strerror(errno));
+            cleared = true;
+            continue;
+        }
+
+        batch[count].sender = slot->sender;
+        batch[count].data = &slot->data[0];
+        batch[count].length = slot->data.size();
+        count++;
+    }
+
+    _handedOut = count;
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// I/O thread
+
+void IoThread::drainOutbound()
+{
+    Outbound* slot;
+    while((slot = _outbound.peek()) != NULL)
+    {
+        if(slot->node < 0)
+            _com.sendMessage(slot->data, slot->replaces);
+        else
+            _com.reliableSend(slot->node, slot->data, slot->replaces);
+
+        _outbound.release();
+        _stats.messagesOut++;
+    }
+}
+
+bool IoThread::receive()
+{
+    int drained = 0;
+    bool room = true;
+
+    while(drained < _recvBudget)
+    {
+        int space = _inbound.capacity() - _inbound.size();
+        if(space == 0)
+        {
+            room = false;
+            break;
+        }
+
+        int wanted = _recvBudget - drained;
+        int count = _com.readBatch(_batch, (wanted < space)? wanted : space, 0);
+        if(count <= 0)
+            break;
+
+        for(int i = 0; i < count; i++)
+        {
+            Inbound* slot = _inbound.claim(); // there was space for count
+            slot->sender = _batch[i].sender;
+            slot->data.assign(_batch[i].data, _batch[i].data + _batch[i].length);
+            _inbound.publish();
+        }
+
+        drained += count;
+    }
+
+    if(drained)
+    {
+        _stats.messagesIn += drained;
+        _stats.wakeupsIn++;
+        signal(_inboundFd);
+    }
+
+    return room;
+}
+
+void IoThread::logStats()
+{
+    double nowMs = clockMs(CLOCK_MONOTONIC);
+    double ioCpuMs = clockMs(CLOCK_THREAD_CPUTIME_ID);
+    double protocolCpuMs = 0;
+
+    clockid_t protocolClock;
+    if(pthread_getcpuclockid(_protocolThread, &protocolClock) == 0)
+        protocolCpuMs = clockMs(protocolClock);
+
+    double wallMs = nowMs - _lastStatsMs;
+    if(wallMs > 0)
+        log(INFO, "iothread: cpu utilization io %.1f%% protocol %.1f%% over %.0f ms\n",
+            100.0 * (ioCpuMs - _lastIoCpuMs) / wallMs,
+            100.0 * (protocolCpuMs - _lastProtocolCpuMs) / wallMs,
+            wallMs);
+
+    log(INFO, "iothread: %llu messages in, %llu out, %llu wakeups in, %llu out, inbound full %llu times, outbound full %llu times\n",
+        (unsigned long long) _stats.messagesIn,
+        (unsigned long long) _stats.messagesOut,
+        (unsigned long long) _stats.wakeupsIn,
+        (unsigned long long) _stats.wakeupsOut,
+        (unsigned long long) _stats.inboundFull,
+        (unsigned long long) _stats.outboundFull);
+
+    _com.logStats();
+
+    _lastStatsMs = nowMs;
+    _lastIoCpuMs = ioCpuMs;
+    _lastProtocolCpuMs = protocolCpuMs;
+}
+
+void IoThread::run()
+{
+    Reactor reactor;
+    int socket = _com.getSocket();
+    bool watching = true;
+
+    // only has to wake us, the loop drains whatever was queued.
+    int outboundFd = _outboundFd;
+    reactor.add(outboundFd, EPOLLIN, [outboundFd](uint32_t) {
+        uint64_t signals;
+        if(read(outboundFd, &signals, sizeof signals) == -1 && errno != EAGAIN)
+            log(WARN, "eventfd read: %s\n", strerror(errno));
+    });
+
+    auto onReadable = [&](uint32_t) {
+        if(receive())
+            return;
+
+        // stop reading until the protocol thread frees a slot
+        _stats.inboundFull++;
+        reactor.remove(socket);
+        watching = false;
+        _receiveBlocked = true;
+    };
+    reactor.add(socket, EPOLLIN, onReadable);
+
+    _lastStatsMs = clockMs(CLOCK_MONOTONIC);
+    Timer statsTimer;
+
+    while(_running)
+    {
+        drainOutbound();
+
+        if(! watching)
+        {
+            // pairs with the fence in readBatch()
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(_inbound.size() < _inbound.capacity())
+            {
+                _receiveBlocked = false;
+                reactor.add(socket, EPOLLIN, onReadable);
+                watching = true;
+            }
+        }
+
+        // what we sent ourselves, or what was read off a stream already,
+        // never makes the socket readable
+        if(watching && _com.receivePending())
+            onReadable(0);
+
+        _com.flushMessages(); // everything the protocol queued, coalesced
+        _com.retransmit();
+        _com.flushAcks(); // the replies to the last batch had their chance
+
+        if(statsTimer.getMsSinceInit() >= _statsIntervalMs)
+        {
+            logStats();
+            statsTimer.set_start_time();
+        }
+
+        // with the inbound ring full what's left to receive can wait, the
+        // protocol thread wakes us once it frees a slot
+        long next = _com.msUntilNextEvent(watching);
+        long stats = _statsIntervalMs - statsTimer.getMsSinceInit();
+        if(next < 0 || stats < next)
+            next = stats;
+
+        reactor.setDeadline((next < 0)? 0 : next);
+        reactor.wait();
+    }
+}
@@ -0,0 +1,121 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Runs a Unicast on a thread of its own. The I/O thread does every syscall
+the replicas' traffic needs, receiving, acking and retransmitting, and
+trades messages with the protocol thread through a pair of lock-free rings
+so the protocol never waits on the network.
+**/
+
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+
+#include "unicast.h"
+#include "spscring.h"
+
+class IoThread
+{
+public:
+    // com belongs to the I/O thread once start() is called. recvBudget is
+    // the most datagrams taken off the socket per wakeup, the I/O thread
+    // logs its stats every statsIntervalMs.
+    IoThread(Unicast& com, int recvBudget, int statsIntervalMs);
+    ~IoThread();
+
+    // starts the I/O thread, pinned to cpu unless it is negative.
+    void start(int cpu = -1);
+    void stop();
+
+    // pins thread to cpu, false if it couldn't be.
+    static bool pin(pthread_t thread, int cpu);
+
+    // Protocol thread side, none of these make a syscall except flush().
+
+    int localhost() {return _com.localhost();}
+    int getNumberOfHosts() {return _com.getNumberOfHosts();}
+
+    // the same as Unicast's, queued for the I/O thread to send.
+    void reliableSend(const uint32_t node, const std::vector<char> &message, const uint32_t replaces = 0);
+    void sendMessage(const std::vector<char> &message, const uint32_t replaces = 0);
+
+    // wakes the I/O thread if anything was queued since the last flush.
+    void flush();
+
+    // readable while received messages may be waiting for readBatch.
+    int getEventFd() const {return _inboundFd;}
+
+    // the next received messages, at most budget of them and never the
+    // whole ring. They stay valid until the next call, which gives their
+    // slots back to the I/O thread.
+    int readBatch(Unicast::Datagram* batch, int budget);
+
+    static const int RING_SLOTS = 1024;
+
+private:
+    struct Inbound
+    {
+        int sender;
+        std::vector<char> data;
+    };
+
+    struct Outbound
+    {
+        int node; // -1 for every host
+        uint32_t replaces;
+        std::vector<char> data;
+    };
+
+    // ring counters, each written by one thread only
+    struct Stats
+    {
+        std::atomic<uint64_t> messagesIn;       // handed to the protocol
+        std::atomic<uint64_t> messagesOut;      // handed to the Unicast
+        std::atomic<uint64_t> inboundFull;      // times reading stopped, protocol behind
+        std::atomic<uint64_t> outboundFull;     // times the protocol waited for a slot
+        std::atomic<uint64_t> wakeupsIn;        // eventfd writes to the protocol thread
+        std::atomic<uint64_t> wakeupsOut;       // eventfd writes to the I/O thread
+    };
+
+    void run();
+    void queue(const int node, const std::vector<char> &message, const uint32_t replaces);
+    void drainOutbound();
+    bool receive(); // false once the inbound ring is full
+    // the Unicast's stats plus the rings' and the cpu each thread used
+    void logStats();
+    static void signal(int fd);
+
+    Unicast& _com;
+    int _recvBudget;
+    SpscRing<Inbound> _inbound;
+    SpscRing<Outbound> _outbound;
+    int _inboundFd;     // I/O -> protocol, messages arrived
+    int _outboundFd;    // protocol -> I/O, messages queued or slots freed
+    std::atomic<bool> _running;
+    std::atomic<bool> _receiveBlocked; // inbound was full, socket not watched
+    std::thread _thread;
+
+    Stats _stats;
+    pthread_t _protocolThread; // whoever constructed us
+
+    // protocol thread only
+    int _handedOut;     // slots returned by the last readBatch
+    int _unflushed;     // messages queued since the last flush
+
+    // I/O thread only
+    Unicast::Datagram _batch[Unicast::RECV_BATCH_SIZE];
+    int _statsIntervalMs;
+    double _lastStatsMs;        // wall clock, cpu time of each thread
+    double _lastIoCpuMs;        // at the last logStats()
+    double _lastProtocolCpuMs;
+};
+
+#endif
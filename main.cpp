@@ -16,8 +16,11 @@ All Rights Reserved
 #include <queue>
 #include <map>
 #include <cstring>
+#include <sys/epoll.h>
 
 #include "unicast.h"
+#include "iothread.h"
+#include "reactor.h"
 #include "Timer.hpp"
 #include "Debug.hpp"
 #include "psb.h"
@@ -32,12 +35,17 @@ extern "C" {
 const int MAX_UDP_PACKET_SIZE_BYTES = 65507;
 const int UDP_PORT_MIN = 1024;
 const int UDP_PORT_MAX = 65536;
-const int READ_TIMEOUT_MS = 20;
 const int RETRANSMIT_TIME_MS = 1000;
+const int DEFAULT_ACK_DELAY_MS = 1;
+const int STATS_INTERVAL_MS = 10000;
+const int DYAD_HOUSEKEEPING_MS = 1000; // dyad's tick and stream timeouts
+const int DEFAULT_RECV_BUDGET = 256;
 
 #define IS_VALID_UDP(port) ((port >= UDP_PORT_MIN) && (port <= UDP_PORT_MAX))
 
-void Paxos(const char* hostfile, const int paxosport, const int serverport);
+void Paxos(const char* hostfile, const int paxosport, const int serverport, const int recvBudget, const int ackDelay,
+           const int coalesceBytes, const int coalesceMs, const int ioCpu, const int protocolCpu,
+           const Unicast::Transport transport, const bool uring, const int recvShards);
 void sync(const char* hostfile, const int port);
 
 
@@ -66,15 +74,24 @@ static option::ArgStatus Numeric(const option::Option& option, bool msg)
     return option::ARG_ILLEGAL;
 }
 
-enum  optionIndex { UNKNOWN, HELP, PORT, HOST, SERVER, DBG };
+enum  optionIndex { UNKNOWN, HELP, PORT, HOST, SERVER, BUDGET, ACKDELAY, COALESCEBYTES, COALESCEMS, TRANSPORT, URING, RECVSHARDS, IOCPU, PROTOCPU, DBG };
 const option::Descriptor usage[] =
 {
     {UNKNOWN, 0,"" , ""    ,    option::Arg::None,  "USAGE: proj2 -p port -h hostfile -c count [--debug]\n\n"
                                                     "Options:" },
     {HELP,    0, "" , "help",   option::Arg::None,  "  --help  \tPrint usage and exit." },
     {HOST,    0, "h", "",       NonEmpty,           "  -h  \tPath to a file containing a list of hostnames for each process." },
-    {PORT,    0, "p", "",       Numeric,            "  -p  \tpaxos port (udp) 1024 to 65535." },
+    {PORT,    0, "p", "",       Numeric,            "  -p  \tpaxos port (udp, or tcp with --transport tcp) 1024 to 65535." },
     {SERVER,   0, "s", "",       Numeric,            "  -s  \tserver port (tcp) 1024 to 65535" },
+    {BUDGET,  0, "b", "",       Numeric,            "  -b  \tdatagrams drained per pass before timers run (default 256)" },
+    {ACKDELAY, 0, "a", "",      Numeric,            "  -a  \tms an ack may wait to be coalesced or piggybacked (default 1)" },
+    {COALESCEBYTES, 0, "", "coalesce-bytes", Numeric, "  --coalesce-bytes \tlargest datagram messages to a replica are coalesced into (default 1472)" },
+    {COALESCEMS, 0, "", "coalesce-ms", Numeric,     "  --coalesce-ms \tms a message may wait for others to the same replica (default 0)" },
+    {TRANSPORT, 0, "", "transport", NonEmpty,       "  --transport \tudp (default), tcp or shm, what the replicas talk over unless a host's line in the hostfile names one." },
+    {URING,   0, "" , "uring",  option::Arg::None,  "  --uring \tsend and receive datagrams through io_uring, or sendmmsg/recvmmsg if the kernel can't." },
+    {RECVSHARDS, 0, "", "recv-shards", Numeric,     "  --recv-shards \tsockets opened on the paxos port with SO_REUSEPORT, each drained by a thread of its own (default 1)." },
+    {IOCPU,   0, "" , "io-cpu", Numeric,            "  --io-cpu \tpin the network I/O thread to this cpu." },
+    {PROTOCPU, 0, "", "protocol-cpu", Numeric,      "  --protocol-cpu \tpin the protocol thread to this cpu." },
     {DBG,     0, "" , "debug",  option::Arg::None,  "  --debug \tTurns on debugging for this process." },
     {UNKNOWN, 0, "" , "",       option::Arg::None,  "\nExamples:\n"
                                                     "  Normal:     proj3 -p 1024 -h hosts.txt -s 1025\n"
@@ -115,6 +132,14 @@ int main(int argc, char* argv[])
     int server_port = atoi(options[SERVER].arg);
     int paxos_port = atoi(options[PORT].arg);
     const char* hostfile = options[HOST].arg;
+    int recv_budget = (options[BUDGET])? atoi(options[BUDGET].arg) : DEFAULT_RECV_BUDGET;
+    int ack_delay = (options[ACKDELAY])? atoi(options[ACKDELAY].arg) : DEFAULT_ACK_DELAY_MS;
+    int coalesce_bytes = (options[COALESCEBYTES])? atoi(options[COALESCEBYTES].arg) : Unicast::DEFAULT_COALESCE_BYTES;
+    int coalesce_ms = (options[COALESCEMS])? atoi(options[COALESCEMS].arg) : 0;
+    const char* transport = (options[TRANSPORT])? options[TRANSPORT].arg : "udp";
+    int recv_shards = (options[RECVSHARDS])? atoi(options[RECVSHARDS].arg) : 1;
+    int io_cpu = (options[IOCPU])? atoi(options[IOCPU].arg) : -1;
+    int protocol_cpu = (options[PROTOCPU])? atoi(options[PROTOCPU].arg) : -1;
 
     // turn on/off logging if needed
     setLoggingLevel((options[DBG])? TRACE : OFF);
@@ -125,10 +150,47 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    if( recv_budget < 1 )
+    {
+        std::cerr << "Invalid receive budget, must be at least 1!" << std::endl;
+        exit(1);
+    }
+
+    if( ack_delay < 0 )
+    {
+        std::cerr << "Invalid ack delay, must not be negative!" << std::endl;
+        exit(1);
+    }
+
+    if( coalesce_bytes < 0 || coalesce_bytes > MAX_UDP_PACKET_SIZE_BYTES || coalesce_ms < 0 )
+    {
+        std::cerr << "Invalid coalescing budget, must be 0 to " << MAX_UDP_PACKET_SIZE_BYTES << " bytes and not negative ms!" << std::endl;
+        exit(1);
+    }
+
+    if( recv_shards < 1 )
+    {
+        std::cerr << "Invalid number of receive shards, must be at least 1!" << std::endl;
+        exit(1);
+    }
+
+    Unicast::Transport transports[] = {Unicast::TRANSPORT_UDP, Unicast::TRANSPORT_TCP, Unicast::TRANSPORT_SHM};
+    const char* transportNames[] = {"udp", "tcp", "shm"};
+    int transport_index = 0;
+    while( transport_index < 3 && strcmp(transport, transportNames[transport_index]) != 0 )
+        transport_index++;
+
+    if( transport_index == 3 )
+    {
+        std::cerr << "Invalid transport, must be udp, tcp or shm!" << std::endl;
+        exit(1);
+    }
+
 
     //sync(hostfile, paxos_port);
     LOG(INFO, "Starting Paxos Protocol");
-    Paxos(hostfile, paxos_port, server_port);
+    Paxos(hostfile, paxos_port, server_port, recv_budget, ack_delay, coalesce_bytes, coalesce_ms, io_cpu, protocol_cpu,
+          transports[transport_index], options[URING], recv_shards);
 }
 
 
@@ -156,6 +218,7 @@ void sync(const char* hostfile, const int port)
     message.push_back('k');
 
     com.sendMessage(message);
+    com.flushMessages();
 
     int timeout = 10;
 
@@ -200,7 +263,9 @@ public:
     {}
 };
 
-std::map<int, paxos::Client_Update_t> updates;
+std::map<int, paxos::Client_Update_t> updates; // replies for clients we have no stream for yet
+std::map<int, dyad_Stream*> clientStreams; // clients waiting on their reply
+bool dyadReady = false; // dyad has sockets to service or output to flush
 
 
 static void onData(dyad_Event *e) {
@@ -215,11 +280,12 @@ static void onData(dyad_Event *e) {
 
         dyad_setTimeout(e->stream, 0);
 
-        Handle_New_Message(clientid, updateno);
-
         auto cli = (Client*) e->udata;
         cli->id = clientid;
         cli->updateno = updateno;
+        clientStreams[clientid] = e->stream;
+
+        Handle_New_Message(clientid, updateno);
     }
 }
 
@@ -235,73 +301,101 @@ static void onTick(dyad_Event *e) {
         dyad_writef(e->stream, "%d\n", updates[cli->id].timestamp);
         updates.erase(cli->id);
 
-        delete (Client*) e->udata;
         dyad_end(e->stream);
     }
 }
 
+static void onDestroy(dyad_Event *e) {
+    auto cli = (Client*) e->udata;
+
+    auto it = clientStreams.find(cli->id);
+    if(it != clientStreams.end() && it->second == e->stream)
+        clientStreams.erase(it);
+
+    delete cli;
+}
+
 static void onAccept(dyad_Event *e) {
     Client* client = new Client();
 
   dyad_addListener(e->remote, DYAD_EVENT_DATA, onData, client);
   dyad_addListener(e->remote, DYAD_EVENT_TICK, onTick, client);
+  dyad_addListener(e->remote, DYAD_EVENT_DESTROY, onDestroy, client);
+}
+
+// the soonest of two ms-from-now deadlines, -1 meaning none
+static long soonest(long a, long b) {
+    if(a < 0)
+        return b;
+    if(b < 0)
+        return a;
+    return (a < b)? a : b;
 }
 
 
 
 
-void Paxos( const char* hostfile, const int paxosport, const int serverport)
+void Paxos( const char* hostfile, const int paxosport, const int serverport, const int recvBudget, const int ackDelay,
+            const int coalesceBytes, const int coalesceMs, const int ioCpu, const int protocolCpu,
+            const Unicast::Transport transport, const bool uring, const int recvShards)
 {
 
-    Unicast com(hostfile, paxosport, RETRANSMIT_TIME_MS);
-    char buffer[MAX_UDP_PACKET_SIZE_BYTES];
-    int length;
+    Unicast com(hostfile, paxosport, RETRANSMIT_TIME_MS, ackDelay, coalesceBytes, coalesceMs, transport, uring, recvShards);
+    IoThread io(com, recvBudget, STATS_INTERVAL_MS);
+    std::vector<Unicast::Datagram> batch(recvBudget);
+    Reactor reactor;
 
     myserverid = com.localhost();
 
-    initPaxos(com);
+    if(protocolCpu >= 0)
+        IoThread::pin(pthread_self(), protocolCpu);
+
+    initPaxos(io); // anything sent goes out once the I/O thread starts
+    io.start(ioCpu);
+
+    // the I/O thread signals when messages arrive, up to the budget are
+    // handled per wakeup and anything left wakes us again.
+    reactor.add(io.getEventFd(), EPOLLIN, [&](uint32_t) {
+        int count = io.readBatch(&batch[0], recvBudget);
+        parse_messages(&batch[0], count);
+    });
 
     // start TCP
     dyad_init();
+    dyad_setUpdateTimeout(0); // the reactor does the waiting
+
+    // dyad keeps its sockets in an epoll set of its own, which reads as
+    // ready for as long as any of them has something for dyad_update.
+    reactor.add(dyad_getEventFd(), EPOLLIN, [](uint32_t) {
+        dyadReady = true;
+    });
     dyad_Stream *serv = dyad_newStream();
     dyad_setTimeout(serv, 0);
     dyad_addListener(serv, DYAD_EVENT_ACCEPT, onAccept, NULL);
     dyad_listen(serv, serverport);
 
+    Timer dyadTimer;
+
     while( true )
     {
-        while(true)
-        {
-            int id = com.readOrTimeout(buffer, length, 20);
-            setLastSender(id);
-
-            if(id < 0)
-                break;
-
-
-            if(Conflict(buffer))
-            {
-                // ignore conflicting messages
-
-                log(DEBUG, "-------------------------------------------------------\n");
-                log(DEBUG, "Ignoring message %d from %d (of length: %d)\n", ((uint32_t*)buffer)[0], id, length);
-                prettyPrint(buffer);
-
-                continue;
-            }
-
-            log(TRACE, "-------------------------------------------------------\n");
-            log(TRACE, "Recvd message %d from %d (of length: %d)\n", ((uint32_t*)buffer)[0], id, length);
-            prettyPrint(buffer);
-
+        Check_Timers(); // update paxos
 
-            parse_message(buffer, length);
+        if(dyadReady || dyadTimer.getMsSinceInit() >= DYAD_HOUSEKEEPING_MS)
+        {
+            dyadReady = false;
+            dyad_update(); // update our TCP client stuff
+            dyadTimer.set_start_time();
         }
 
+        io.flush(); // hand everything we sent to the I/O thread at once
 
-        //com.retransmit(); // provide reliability functions
-        Check_Timers(); // update paxos
-        dyad_update(); // update our TCP client stuff
+        // sleep until something is ready or the next thing is due
+        long next = soonest(Ms_Until_Next_Timer(), DYAD_HOUSEKEEPING_MS - dyadTimer.getMsSinceInit());
+        if(dyadReady)
+            next = 0;
+
+        reactor.setDeadline((next < 0)? 0 : next);
+        reactor.wait();
     }
 
     dyad_shutdown();
@@ -314,5 +408,17 @@ void Paxos( const char* hostfile, const int paxosport, const int serverport)
 void reply_to_client(paxos::Client_Update_t update)
 {
     log(DEBUG, "replying to client %d\n", update.client_id);
-    updates[update.client_id] = update;
+
+    auto it = clientStreams.find(update.client_id);
+    if(it == clientStreams.end())
+    {
+        // handed over when the client shows up
+        updates[update.client_id] = update;
+        return;
+    }
+
+    dyad_writef(it->second, "%d\n", update.timestamp);
+    dyad_end(it->second);
+    clientStreams.erase(it);
+    dyadReady = true; // flush it on this pass
 }
@@ -5,6 +5,8 @@
 #include <deque>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <vector>
 
 #include "paxos.h"
@@ -16,41 +18,33 @@ namespace paxos
 
 
 
-std::deque<char> _buffer;
-
-int _state = 0;
-View_Change_t _View_Change_t_working;
-prefix_t _prefix_t_working;
-UnivAck_t _UnivAck_t_working;
-Client_Update_t _Client_Update_t_working;
-Accept_t _Accept_t_working;
-VC_Proof_t _VC_Proof_t_working;
-Prepare_OK_t _Prepare_OK_t_working;
-Proposal_t _Proposal_t_working;
-Globally_Ordered_Update_t _Globally_Ordered_Update_t_working;
-Prepare_t _Prepare_t_working;
+Parser::Parser()
+:_state(0),
+_push_front_amt(0)
+{
+    _reset();
+}
 
-void _reset()
+void Parser::_reset()
 {
     _state = 0;
-    _Client_Update_t_working = (const struct Client_Update_t){ 0 };
-_View_Change_t_working = (const struct View_Change_t){ 0 };
-_VC_Proof_t_working = (const struct VC_Proof_t){ 0 };
-_Prepare_t_working = (const struct Prepare_t){ 0 };
-_Proposal_t_working = (const struct Proposal_t){ 0 };
-_Accept_t_working = (const struct Accept_t){ 0 };
-_Globally_Ordered_Update_t_working = (const struct Globally_Ordered_Update_t){ 0 };
-_Prepare_OK_t_working = (const struct Prepare_OK_t){ 0 };
-_UnivAck_t_working = (const struct UnivAck_t){ 0 };
+    _Client_Update_t_working = Client_Update_t();
+_View_Change_t_working = View_Change_t();
+_VC_Proof_t_working = VC_Proof_t();
+_Prepare_t_working = Prepare_t();
+_Proposal_t_working = Proposal_t();
+_Accept_t_working = Accept_t();
+_Globally_Ordered_Update_t_working = Globally_Ordered_Update_t();
+_Prepare_OK_t_working = Prepare_OK_t();
 }
 
-void _die(const char* message)
+void Parser::_die(const char* message)
 {
     _reset();
     handle_invalid_message(message);
 }
 
-void _push_back(int length, char* buffer)
+void Parser::_push_back(int length, char* buffer)
 {
     for(int i = 0; i < length; i++)
     {
@@ -59,16 +53,15 @@ void _push_back(int length, char* buffer)
 }
 
 
-void _push_back_generic(int length, char* buffer, std::vector<char> &outputbuf)
+// copies length bytes of value to out and moves past them, packers size
+// the buffer up front so there is no check.
+void _put(char*& out, const char* value, size_t length)
 {
-    for(int i = 0; i < length; i++)
-    {
-        outputbuf.push_back(buffer[i]);
-    }
+    memcpy(out, value, length);
+    out += length;
 }
 
-int _push_front_amt = 0;
-void _push_front(int length, char* buffer)
+void Parser::_push_front(int length, char* buffer)
 {
     _push_front_amt += length;
     for(int i = length - 1; i >= 0; i--)
@@ -77,7 +70,7 @@ void _push_front(int length, char* buffer)
     }
 }
 
-bool _read_front(int length, char* outbuffer)
+bool Parser::_read_front(int length, char* outbuffer)
 {
     if(_buffer.size() < (uint32_t) length)
         return false;
@@ -97,7 +90,7 @@ bool _read_front(int length, char* outbuffer)
     return true;
 }
 
-void _process()
+void Parser::_process()
 {
     // do cleanup of a possible remaining useless variables.
     char a;
@@ -313,7 +306,14 @@ case 34:
 }
 case 35:
 {
-	if (!_read_front(_Prepare_OK_t_working.total_proposals, ((char*) & _Prepare_OK_t_working.proposals))) break;
+	if (_Prepare_OK_t_working.total_proposals > (MAX_PAXOS_MESSAGE_BYTES / sizeof(Proposal_t)))
+	{
+		_die("proposals has too many entries");
+		break;
+	}
+	if (_buffer.size() < _Prepare_OK_t_working.total_proposals * sizeof(Proposal_t)) break;
+	_Prepare_OK_t_working.proposals.allocate(_Prepare_OK_t_working.total_proposals);
+	if (!_read_front(_Prepare_OK_t_working.total_proposals * sizeof(Proposal_t), ((char*) _Prepare_OK_t_working.proposals.data()))) break;
 	_state = 36;
 	break;
 }
@@ -325,29 +325,17 @@ case 36:
 }
 case 37:
 {
-	if (!_read_front(_Prepare_OK_t_working.total_globally_ordered_updates, ((char*) & _Prepare_OK_t_working.globally_ordered_updates))) break;
+	if (_Prepare_OK_t_working.total_globally_ordered_updates > (MAX_PAXOS_MESSAGE_BYTES / sizeof(Globally_Ordered_Update_t)))
+	{
+		_die("globally_ordered_updates has too many entries");
+		break;
+	}
+	if (_buffer.size() < _Prepare_OK_t_working.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t)) break;
+	_Prepare_OK_t_working.globally_ordered_updates.allocate(_Prepare_OK_t_working.total_globally_ordered_updates);
+	if (!_read_front(_Prepare_OK_t_working.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t), ((char*) _Prepare_OK_t_working.globally_ordered_updates.data()))) break;
 	_state = 31;
 	break;
 }
-case 38:
-{
-	_UnivAck_t_working.type = _prefix_t_working.type;
-	handle_UnivAck(_UnivAck_t_working);
-	_reset();
-	break;
-}
-case 39:
-{
-	if (!_read_front((sizeof(uint32_t)), ((char*) & _UnivAck_t_working.size))) break;
-	_state = 40;
-	break;
-}
-case 40:
-{
-	if (!_read_front(_UnivAck_t_working.size, ((char*) & _UnivAck_t_working.packet))) break;
-	_state = 38;
-	break;
-}
 case 1:
 {
 	_state = 4;
@@ -367,8 +355,6 @@ case 1:
 		_state = 28;
 	if(_prefix_t_working.type == 8)
 		_state = 32;
-	if(_prefix_t_working.type == 1024)
-		_state = 39;
 	break;
 }
 case 2:
@@ -385,7 +371,7 @@ case 2:
     }
 }
 
-void update(int length, char* buffer)
+void Parser::update(int length, char* buffer)
 {
     _push_back(length, buffer);
 
@@ -398,92 +384,427 @@ void update(int length, char* buffer)
     } while(laststate != _state);
 }
 
-void clear()
+void Parser::clear()
 {
     _push_front_amt = 0;
     _buffer.clear();
     _reset();
 }
 
-void pack_Client_Update(Client_Update_t input, std::vector<char> &message)
+// the parser behind update() and clear(), for programs with one stream
+Parser _parser;
+
+void update(int length, char* buffer)
+{
+    _parser.update(length, buffer);
+}
+
+void clear()
+{
+    _parser.clear();
+}
+
+// a non-owning view of the bytes of a message still to be decoded
+struct _span
+{
+    const char* data;
+    size_t length;
+};
+
+// copies the next length bytes of in to outbuffer and moves past them,
+// false if in is shorter.
+bool _take(_span& in, size_t length, char* outbuffer)
+{
+    if(in.length < length)
+        return false;
+
+    memcpy(outbuffer, in.data, length);
+    in.data += length;
+    in.length -= length;
+    return true;
+}
+
+bool _decode_prefix(_span& in, prefix_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.client_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.timestamp), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.update), message);
+    if (in.length < (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.type)) return false;
+    return true;
 }
 
-void pack_View_Change(View_Change_t input, std::vector<char> &message)
+bool _decode_Client_Update(_span& in, Client_Update_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.attempted), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.client_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.timestamp)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.update)) return false;
+    return true;
 }
 
-void pack_VC_Proof(VC_Proof_t input, std::vector<char> &message)
+bool _decode_View_Change(_span& in, View_Change_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.installed), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.attempted)) return false;
+    return true;
 }
 
-void pack_Prepare(Prepare_t input, std::vector<char> &message)
+bool _decode_VC_Proof(_span& in, VC_Proof_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.view), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.local_aru), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.installed)) return false;
+    return true;
 }
 
-void pack_Proposal(Proposal_t input, std::vector<char> &message)
+bool _decode_Prepare(_span& in, Prepare_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.view), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.seq), message);
-	_push_back_generic((sizeof(Client_Update_t)), ((char*) & input.update), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.view)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.local_aru)) return false;
+    return true;
 }
 
-void pack_Accept(Accept_t input, std::vector<char> &message)
+bool _decode_Proposal(_span& in, Proposal_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.view), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.seq), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(Client_Update_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.view)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.seq)) return false;
+    if (!_take(in, (sizeof(Client_Update_t)), (char*) & target.update)) return false;
+    return true;
 }
 
-void pack_Globally_Ordered_Update(Globally_Ordered_Update_t input, std::vector<char> &message)
+bool _decode_Accept(_span& in, Accept_t& target)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.seq), message);
-	_push_back_generic((sizeof(Client_Update_t)), ((char*) & input.update), message);
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.view)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.seq)) return false;
+    return true;
 }
 
-void pack_Prepare_OK(Prepare_OK_t input, std::vector<char> &message)
+bool _decode_Globally_Ordered_Update(_span& in, Globally_Ordered_Update_t& target)
 {
+    if (in.length != (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(Client_Update_t))) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.seq)) return false;
+    if (!_take(in, (sizeof(Client_Update_t)), (char*) & target.update)) return false;
+    return true;
+}
 
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.server_id), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.view), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.total_proposals), message);
-	for(int i = 0; i < input.total_proposals; i++)
-	{
-	    pack_Proposal(input.proposals[i], message);
-	}
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.total_globally_ordered_updates), message);
-	for(int i = 0; i < input.total_globally_ordered_updates; i++)
-	{
-	    pack_Globally_Ordered_Update(input.globally_ordered_updates[i], message);
-	}
+bool _decode_Prepare_OK(_span& in, Prepare_OK_t& target)
+{
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.server_id)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.view)) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.total_proposals)) return false;
+    if (target.total_proposals > (MAX_PAXOS_MESSAGE_BYTES / sizeof(Proposal_t))) return false;
+    if (in.length < target.total_proposals * sizeof(Proposal_t)) return false;
+    target.proposals.allocate(target.total_proposals);
+    if (!_take(in, target.total_proposals * sizeof(Proposal_t), (char*) target.proposals.data())) return false;
+    if (!_take(in, (sizeof(uint32_t)), (char*) & target.total_globally_ordered_updates)) return false;
+    if (target.total_globally_ordered_updates > (MAX_PAXOS_MESSAGE_BYTES / sizeof(Globally_Ordered_Update_t))) return false;
+    if (in.length < target.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t)) return false;
+    target.globally_ordered_updates.allocate(target.total_globally_ordered_updates);
+    if (!_take(in, target.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t), (char*) target.globally_ordered_updates.data())) return false;
+    return in.length == 0;
+}
+
+
+// Decodes the one message in data, fields are read in place rather than
+// through the stream parser, and calls its handler. Unlike update() the
+// whole message has to be there and nothing else; anything else goes to
+// handle_invalid_message and false is returned.
+bool decode(const char* data, size_t length)
+{
+    _span in = {data, length};
+    prefix_t prefix;
+    if (!_decode_prefix(in, prefix))
+    {
+        handle_invalid_message("message shorter than its header");
+        return false;
+    }
+    if(prefix.type == 1)
+    {
+        Client_Update_t message;
+        message.type = prefix.type;
+        if (!_decode_Client_Update(in, message))
+        {
+            handle_invalid_message("Client_Update has the wrong length");
+            return false;
+        }
+        handle_Client_Update(message);
+        return true;
+    }
+    if(prefix.type == 2)
+    {
+        View_Change_t message;
+        message.type = prefix.type;
+        if (!_decode_View_Change(in, message))
+        {
+            handle_invalid_message("View_Change has the wrong length");
+            return false;
+        }
+        handle_View_Change(message);
+        return true;
+    }
+    if(prefix.type == 3)
+    {
+        VC_Proof_t message;
+        message.type = prefix.type;
+        if (!_decode_VC_Proof(in, message))
+        {
+            handle_invalid_message("VC_Proof has the wrong length");
+            return false;
+        }
+        handle_VC_Proof(message);
+        return true;
+    }
+    if(prefix.type == 4)
+    {
+        Prepare_t message;
+        message.type = prefix.type;
+        if (!_decode_Prepare(in, message))
+        {
+            handle_invalid_message("Prepare has the wrong length");
+            return false;
+        }
+        handle_Prepare(message);
+        return true;
+    }
+    if(prefix.type == 5)
+    {
+        Proposal_t message;
+        message.type = prefix.type;
+        if (!_decode_Proposal(in, message))
+        {
+            handle_invalid_message("Proposal has the wrong length");
+            return false;
+        }
+        handle_Proposal(message);
+        return true;
+    }
+    if(prefix.type == 6)
+    {
+        Accept_t message;
+        message.type = prefix.type;
+        if (!_decode_Accept(in, message))
+        {
+            handle_invalid_message("Accept has the wrong length");
+            return false;
+        }
+        handle_Accept(message);
+        return true;
+    }
+    if(prefix.type == 7)
+    {
+        Globally_Ordered_Update_t message;
+        message.type = prefix.type;
+        if (!_decode_Globally_Ordered_Update(in, message))
+        {
+            handle_invalid_message("Globally_Ordered_Update has the wrong length");
+            return false;
+        }
+        handle_Globally_Ordered_Update(message);
+        return true;
+    }
+    if(prefix.type == 8)
+    {
+        Prepare_OK_t message;
+        message.type = prefix.type;
+        if (!_decode_Prepare_OK(in, message))
+        {
+            handle_invalid_message("Prepare_OK has the wrong length");
+            return false;
+        }
+        handle_Prepare_OK(message);
+        return true;
+    }
+    handle_invalid_message("could not parse the given message, unknown type");
+    return false;
+}
+
+
+size_t wire_bytes(const Client_Update_t& input)
+{
+	return Client_Update_WIRE_BYTES;
+}
+
+size_t pack_Client_Update(const Client_Update_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.client_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.timestamp, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.update, (sizeof(uint32_t)));
+	return out - buffer;
+}
+
+void pack_Client_Update(const Client_Update_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Client_Update(input, &message[at]);
+}
+
+size_t wire_bytes(const View_Change_t& input)
+{
+	return View_Change_WIRE_BYTES;
+}
+
+size_t pack_View_Change(const View_Change_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.attempted, (sizeof(uint32_t)));
+	return out - buffer;
+}
+
+void pack_View_Change(const View_Change_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_View_Change(input, &message[at]);
+}
+
+size_t wire_bytes(const VC_Proof_t& input)
+{
+	return VC_Proof_WIRE_BYTES;
+}
+
+size_t pack_VC_Proof(const VC_Proof_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.installed, (sizeof(uint32_t)));
+	return out - buffer;
+}
+
+void pack_VC_Proof(const VC_Proof_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_VC_Proof(input, &message[at]);
+}
+
+size_t wire_bytes(const Prepare_t& input)
+{
+	return Prepare_WIRE_BYTES;
+}
+
+size_t pack_Prepare(const Prepare_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.view, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.local_aru, (sizeof(uint32_t)));
+	return out - buffer;
+}
+
+void pack_Prepare(const Prepare_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Prepare(input, &message[at]);
+}
+
+size_t wire_bytes(const Proposal_t& input)
+{
+	return Proposal_WIRE_BYTES;
+}
+
+size_t pack_Proposal(const Proposal_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.view, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.seq, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.update, (sizeof(Client_Update_t)));
+	return out - buffer;
+}
+
+void pack_Proposal(const Proposal_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Proposal(input, &message[at]);
+}
+
+size_t wire_bytes(const Accept_t& input)
+{
+	return Accept_WIRE_BYTES;
+}
+
+size_t pack_Accept(const Accept_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.view, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.seq, (sizeof(uint32_t)));
+	return out - buffer;
+}
+
+void pack_Accept(const Accept_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Accept(input, &message[at]);
+}
+
+size_t wire_bytes(const Globally_Ordered_Update_t& input)
+{
+	return Globally_Ordered_Update_WIRE_BYTES;
+}
+
+size_t pack_Globally_Ordered_Update(const Globally_Ordered_Update_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.seq, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.update, (sizeof(Client_Update_t)));
+	return out - buffer;
+}
+
+void pack_Globally_Ordered_Update(const Globally_Ordered_Update_t& input, std::vector<char> &message)
+{
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Globally_Ordered_Update(input, &message[at]);
+}
+
+size_t wire_bytes(const Prepare_OK_t& input)
+{
+	return (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + input.total_proposals * sizeof(Proposal_t) + (sizeof(uint32_t)) + input.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t);
+}
+
+size_t pack_Prepare_OK(const Prepare_OK_t& input, char* buffer)
+{
+	char* out = buffer;
+	_put(out, (const char*) & input.type, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.server_id, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.view, (sizeof(uint32_t)));
+	_put(out, (const char*) & input.total_proposals, (sizeof(uint32_t)));
+	if (input.total_proposals != 0)
+		_put(out, (const char*) input.proposals.data(), input.total_proposals * sizeof(Proposal_t));
+	_put(out, (const char*) & input.total_globally_ordered_updates, (sizeof(uint32_t)));
+	if (input.total_globally_ordered_updates != 0)
+		_put(out, (const char*) input.globally_ordered_updates.data(), input.total_globally_ordered_updates * sizeof(Globally_Ordered_Update_t));
+	return out - buffer;
 }
 
-void pack_UnivAck(UnivAck_t input, std::vector<char> &message)
+void pack_Prepare_OK(const Prepare_OK_t& input, std::vector<char> &message)
 {
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.type), message);
-	_push_back_generic((sizeof(uint32_t)), ((char*) & input.size), message);
-	_push_back_generic((input.size * sizeof(char) ), ((char*) & input.packet), message);
+	size_t at = message.size();
+	message.resize(at + wire_bytes(input));
+	pack_Prepare_OK(input, &message[at]);
 }
 
 
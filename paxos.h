@@ -4,14 +4,37 @@
 #include <deque>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
 #include <vector>
 
 // user supplied typedefs
 #define UDP_PACKET_SIZE_BYTES 65535
+// the largest message the transport puts back together, Unicast::MAX_MESSAGE_BYTES
+#define MAX_PAXOS_MESSAGE_BYTES (32 * 1024 * 1024)
 
 
 namespace paxos
 {
+    // The entries of a buffer, allocated to fit how many there are. They are
+    // shared by every copy of the message they belong to, so copying a message
+    // copies none of them; a message is filled in once and only read after.
+    template<typename T>
+    class entries_t
+    {
+    public:
+        // room for count zeroed entries, the ones held before are let go
+        void allocate(size_t count)
+        {
+            _entries = std::shared_ptr<T>(new T[count](), std::default_delete<T[]>());
+        }
+
+        T* data() const {return _entries.get();}
+        T& operator[](size_t i) const {return _entries.get()[i];}
+
+    private:
+        std::shared_ptr<T> _entries;
+    };
+
     // Message definitions
 
 
@@ -69,21 +92,39 @@ namespace paxos
         uint32_t server_id;
         uint32_t view;
         uint32_t total_proposals;
-        Proposal_t proposals[(UDP_PACKET_SIZE_BYTES / sizeof(Proposal_t))];
+        entries_t<Proposal_t> proposals;
         uint32_t total_globally_ordered_updates;
-        Globally_Ordered_Update_t globally_ordered_updates[(UDP_PACKET_SIZE_BYTES / sizeof(Globally_Ordered_Update_t))];
-    };
-
-    struct UnivAck_t {
-        uint32_t type;
-        uint32_t size;
-        char packet[UDP_PACKET_SIZE_BYTES];
+        entries_t<Globally_Ordered_Update_t> globally_ordered_updates;
     };
 
     struct prefix_t {
         uint32_t type;
     };
 
+    // Packed sizes, fixed ones are known at compile time
+    constexpr size_t Client_Update_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t));
+    size_t wire_bytes(const Client_Update_t& input);
+
+    constexpr size_t View_Change_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t));
+    size_t wire_bytes(const View_Change_t& input);
+
+    constexpr size_t VC_Proof_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t));
+    size_t wire_bytes(const VC_Proof_t& input);
+
+    constexpr size_t Prepare_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t));
+    size_t wire_bytes(const Prepare_t& input);
+
+    constexpr size_t Proposal_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(Client_Update_t));
+    size_t wire_bytes(const Proposal_t& input);
+
+    constexpr size_t Accept_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t));
+    size_t wire_bytes(const Accept_t& input);
+
+    constexpr size_t Globally_Ordered_Update_WIRE_BYTES = (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(uint32_t)) + (sizeof(Client_Update_t));
+    size_t wire_bytes(const Globally_Ordered_Update_t& input);
+
+    size_t wire_bytes(const Prepare_OK_t& input);
+
 
     // Forward declarations
     void handle_Client_Update(Client_Update_t var); // User supplied
@@ -94,21 +135,63 @@ namespace paxos
     void handle_Accept(Accept_t var); // User supplied
     void handle_Globally_Ordered_Update(Globally_Ordered_Update_t var); // User supplied
     void handle_Prepare_OK(Prepare_OK_t var); // User supplied
-    void handle_UnivAck(UnivAck_t var); // User supplied
     void handle_invalid_message(const char* message); // usesupplied, when the parser encounters an error
 
+    // Parses a stream, update() takes bytes as they arrive and the handler of
+    // each message is called once it is complete. Everything it keeps is its
+    // own, so there can be one per connection or thread.
+    class Parser
+    {
+    public:
+        Parser();
+
+        void update(int length, char* buffer);
+        void clear();
+
+    private:
+        void _reset();
+        void _die(const char* message);
+        void _push_back(int length, char* buffer);
+        void _push_front(int length, char* buffer);
+        bool _read_front(int length, char* outbuffer);
+        void _process();
+
+        std::deque<char> _buffer;
+        int _state;
+        int _push_front_amt;
+        View_Change_t _View_Change_t_working;
+        prefix_t _prefix_t_working;
+        Client_Update_t _Client_Update_t_working;
+        Accept_t _Accept_t_working;
+        VC_Proof_t _VC_Proof_t_working;
+        Prepare_OK_t _Prepare_OK_t_working;
+        Proposal_t _Proposal_t_working;
+        Globally_Ordered_Update_t _Globally_Ordered_Update_t_working;
+        Prepare_t _Prepare_t_working;
+    };
+
     void update(int length, char* buffer);
     void clear();
-
-    void pack_Client_Update(Client_Update_t input, std::vector<char> &message);
-    void pack_View_Change(View_Change_t input, std::vector<char> &message);
-    void pack_VC_Proof(VC_Proof_t input, std::vector<char> &message);
-    void pack_Prepare(Prepare_t input, std::vector<char> &message);
-    void pack_Proposal(Proposal_t input, std::vector<char> &message);
-    void pack_Accept(Accept_t input, std::vector<char> &message);
-    void pack_Globally_Ordered_Update(Globally_Ordered_Update_t input, std::vector<char> &message);
-    void pack_Prepare_OK(Prepare_OK_t input, std::vector<char> &message);
-    void pack_UnivAck(UnivAck_t input, std::vector<char> &message);
+    bool decode(const char* data, size_t length);
+
+    // the buffer ones need room for wire_bytes(input) and return what they
+    // wrote, the vector ones append to message
+    size_t pack_Client_Update(const Client_Update_t& input, char* buffer);
+    void pack_Client_Update(const Client_Update_t& input, std::vector<char> &message);
+    size_t pack_View_Change(const View_Change_t& input, char* buffer);
+    void pack_View_Change(const View_Change_t& input, std::vector<char> &message);
+    size_t pack_VC_Proof(const VC_Proof_t& input, char* buffer);
+    void pack_VC_Proof(const VC_Proof_t& input, std::vector<char> &message);
+    size_t pack_Prepare(const Prepare_t& input, char* buffer);
+    void pack_Prepare(const Prepare_t& input, std::vector<char> &message);
+    size_t pack_Proposal(const Proposal_t& input, char* buffer);
+    void pack_Proposal(const Proposal_t& input, std::vector<char> &message);
+    size_t pack_Accept(const Accept_t& input, char* buffer);
+    void pack_Accept(const Accept_t& input, std::vector<char> &message);
+    size_t pack_Globally_Ordered_Update(const Globally_Ordered_Update_t& input, char* buffer);
+    void pack_Globally_Ordered_Update(const Globally_Ordered_Update_t& input, std::vector<char> &message);
+    size_t pack_Prepare_OK(const Prepare_OK_t& input, char* buffer);
+    void pack_Prepare_OK(const Prepare_OK_t& input, std::vector<char> &message);
 }
 
 #endif
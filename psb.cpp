@@ -23,7 +23,7 @@
 #include "paxos.h"
 #include "psb.h"
 #include "Timer.hpp"
-#include "unicast.h"
+#include "iothread.h"
 
 #define MSG_TYPE(message) (((uint32_t*)message)[0])
 
@@ -74,11 +74,13 @@ const char *STATENAMES[3] = {"leader election", "reg leader", "reg nonleader"};
 
 // STRUCTS
 
+// entries are sized to what the list holds and handed to the Prepare_OK
+// built from it as they are, see paxos::entries_t
 struct datalist_t {
     uint32_t total_proposals;
-    Proposal_t proposals[(UDP_PACKET_SIZE_BYTES / sizeof(Proposal_t))];
+    paxos::entries_t<Proposal_t> proposals;
     uint32_t total_globally_ordered_updates;
-    Globally_Ordered_Update_t globally_ordered_updates[(UDP_PACKET_SIZE_BYTES / sizeof(Globally_Ordered_Update_t))];
+    paxos::entries_t<Globally_Ordered_Update_t> globally_ordered_updates;
 } datalist_t;
 
 uint32_t num_servers;
@@ -150,7 +152,7 @@ struct global_slot
 
 // VARIABLES
 
-Unicast* unicast; // an instance of unicast to do our transmitting.
+IoThread* unicast; // queues our messages for the I/O thread to transmit.
 
 Client_Update_t Pending_Updates[MAX_CLIENTS];
 bool Pending_Updates_Set[MAX_CLIENTS];
@@ -173,6 +175,12 @@ Timer prepare_timer;
 std::deque<Proposal_t> Proposal_Retransmit_Queue;
 Timer proposal_timer;
 
+// Accepts that got here ahead of their Proposal, by seq. Another server's
+// Accept can overtake the leader's Proposal when the two come over
+// different links, and it isn't sent again.
+std::map<uint32_t, std::vector<Accept_t> > Early_Accepts;
+const size_t MAX_EARLY_ACCEPTS = 1024; // seqs held at most, oldest go first
+
 uint32_t my_server_id;
 uint32_t last_attempted;
 uint32_t last_installed;
@@ -293,6 +301,18 @@ bool inProposalQueue(const Client_Update_t& cut)
     return false;
 }
 
+// the buffer every message is packed in before it goes to unicast, which
+// copies what it is given, so it keeps its capacity from send to send;
+// short of what a large Prepare_OK grew it to
+std::vector<char>& Packing_Buffer()
+{
+    static std::vector<char> buffer;
+    buffer.clear();
+    if(buffer.capacity() > UDP_PACKET_SIZE_BYTES)
+        std::vector<char>().swap(buffer);
+    return buffer;
+}
+
 View_Change_t Construct_VC(int attempted)
 {
     View_Change_t vc = {};
@@ -320,25 +340,15 @@ Prepare_OK_t Construct_Prepare_OK(const int last_installed, const struct datalis
     p.type = PREPARE_OK;
     p.server_id = my_server_id;
     p.view = last_installed;
-    p.total_proposals = datalist.total_proposals;
 
     LOG(TRACE, "Constructing Prepare OK");
-    log(TRACE, "Datalist: proposals %d, updates %d\n", datalist.proposals, datalist.total_globally_ordered_updates);
+    log(TRACE, "Datalist: proposals %d, updates %d\n", datalist.total_proposals, datalist.total_globally_ordered_updates);
 
-    for(uint32_t i = 0; i < datalist.total_proposals; i++)
-    {
-        log(TRACE, "Updating proposal %dth element\n", i);
-        prettyPrint((char*) &datalist.proposals[i]);
-        //assert(datalist.proposals[i].type != 0);
-        p.proposals[i] = datalist.proposals[i];
-    }
+    // the entries are shared, not copied
+    p.total_proposals = datalist.total_proposals;
+    p.proposals = datalist.proposals;
     p.total_globally_ordered_updates = datalist.total_globally_ordered_updates;
-
-    for(uint32_t i = 0; i < p.total_globally_ordered_updates; i++)
-    {
-        log(TRACE, "Updating global %dth element\n", i);
-        p.globally_ordered_updates[i] = datalist.globally_ordered_updates[i];
-    }
+    p.globally_ordered_updates = datalist.globally_ordered_updates;
     return p;
 }
 
@@ -681,6 +691,7 @@ void Shift_To_Leader_Election(int view)
     prepare_is_set = false;
     prepare_timer.stopAlarm();
     Proposal_Retransmit_Queue.clear();
+    Early_Accepts.clear();
     oks.clear();
 
     for(int i = 0; i < MAX_CLIENTS; i++)
@@ -693,10 +704,10 @@ void Shift_To_Leader_Election(int view)
     //     E4. vc ← Construct VC(Last Attempted)
     View_Change_t vct = Construct_VC(last_attempted);
     //     E5. SEND to all servers: vc
-    std::vector<char> viewchange;
+    std::vector<char>& viewchange = Packing_Buffer();
     paxos::pack_View_Change(vct, viewchange);
     //unicast->sendMessage(viewchange);
-    unicast->sendMessage(viewchange);
+    unicast->sendMessage(viewchange, VIEW_CHANGE); // a newer view change replaces it
 
     progress_timer.stopAlarm(); // we're in leader election
 
@@ -736,10 +747,10 @@ void Shift_To_Prepare_Phase()
     // A9. **Sync to disk
     LOG(DEBUG, "syncing to disk");
     // A10. SEND to all servers: prepare
-    std::vector<char> packed_msg;
+    std::vector<char>& packed_msg = Packing_Buffer();
     paxos::pack_Prepare(prepare, packed_msg);
     //unicast->sendMessage(packed_msg);
-    unicast->sendMessage(packed_msg);
+    unicast->sendMessage(packed_msg, PREPARE);
 }
 
 // B1. Upon receiving Prepare(server id, view, aru)
@@ -748,18 +759,30 @@ void Upon_Receiving_Prepare(Prepare_t p)
 // B2. if State = leader election /* Install the view */
     if(State == LEADER_ELECTION)
     {
-//        B3. Apply Prepare to data structures
-        Update_Data_Structures((char*) &p);
 //        B4. data list ← Construct DataList(aru)
         auto data_list = Construct_Data_List(p.local_aru);
 //        B5. prepare ok ← Construct Prepare OK(view, data list)
         auto prepare_ok = Construct_Prepare_OK(p.view, data_list);
+
+        // the leader could never put it back together, so rather than send
+        // it a partial history we stay out of this view
+        size_t bytes = paxos::wire_bytes(prepare_ok);
+        if(bytes > Unicast::MAX_MESSAGE_BYTES)
+        {
+            log(ERROR, "refusing view %d: our prepare ok for aru %d is %zu bytes (%u proposals, %u updates), "
+                "more than the %u a message can carry\n", p.view, p.local_aru, bytes,
+                prepare_ok.total_proposals, prepare_ok.total_globally_ordered_updates, Unicast::MAX_MESSAGE_BYTES);
+            return;
+        }
+
+//        B3. Apply Prepare to data structures
+        Update_Data_Structures((char*) &p);
 //        B6. Prepare OK[My server id] ← prepare ok
         oks.insert(std::make_pair(my_server_id, prepare_ok));
 //        B7. Shift to Reg Non Leader()
         Shift_To_Reg_Non_Leader();
 //        B8. SEND to leader: prepare ok
-        std::vector<char> packed_msg;
+        std::vector<char>& packed_msg = Packing_Buffer();
         paxos::pack_Prepare_OK(prepare_ok, packed_msg);
         unicast->reliableSend(Get_Leader(), packed_msg);
 
@@ -768,7 +791,7 @@ void Upon_Receiving_Prepare(Prepare_t p)
     {
 //    B9. else /* Already installed the view */
 //        B10. SEND to leader: Prepare OK[My server id]
-        std::vector<char> packed_msg;
+        std::vector<char>& packed_msg = Packing_Buffer();
         paxos::pack_Prepare_OK(oks[my_server_id], packed_msg);
         unicast->reliableSend(Get_Leader(), packed_msg);
 
@@ -801,34 +824,40 @@ struct datalist_t Construct_Data_List(int aru)
     datalist.total_proposals = 0;
 
 //        A3. for each sequence number i, i > aru, where Global History[i] is not empty
-
-    for(auto iter : global_history)
+    // counted first, so the entries get exactly the room they need
+    auto first = global_history.upper_bound(aru);
+    for(auto iter = first; iter != global_history.end(); ++iter)
     {
-        auto i = iter.first;
+        const global_slot& hist = iter->second;
 
-        if(i <= aru)
-            continue;
+        if(hist.has_update)
+            datalist.total_globally_ordered_updates++;
+        else if(hist.has_proposal)
+            datalist.total_proposals++;
+    }
 
-        log(TRACE, "Sequence: %d\n", i);
+    datalist.globally_ordered_updates.allocate(datalist.total_globally_ordered_updates);
+    datalist.proposals.allocate(datalist.total_proposals);
 
-        auto hist = iter.second;
+    uint32_t updates = 0;
+    uint32_t proposals = 0;
+    for(auto iter = first; iter != global_history.end(); ++iter)
+    {
+        log(TRACE, "Sequence: %d\n", iter->first);
+
+        const global_slot& hist = iter->second;
 
 //            A4. if Global History[i].Ordered contains a Globally Ordered Update, G
 //                A5. datalist ← datalist ∪ G
         if(hist.has_update)
         {
-            datalist.globally_ordered_updates[datalist.total_globally_ordered_updates] = hist.update;
-            datalist.total_globally_ordered_updates++;
+            datalist.globally_ordered_updates[updates++] = hist.update;
         }
 //            A6. else
 //                A7. datalist ← datalist ∪ Global History[i].Proposal
-        else
+        else if(hist.has_proposal)
         {
-            if(hist.has_proposal)
-            {
-                datalist.proposals[datalist.total_proposals] = hist.prop;
-                datalist.total_proposals++;
-            }
+            datalist.proposals[proposals++] = hist.prop;
         }
     }
 //    A8. return datalist
@@ -903,6 +932,58 @@ void Upon_Receiving_Client_Update(Client_Update_t U)
     Client_Update_Handler(U);
 }
 
+// holds on to an Accept that conflicts only because its Proposal hasn't
+// arrived yet, true if it was held.
+bool Hold_Early_Accept(const char* message, int length)
+{
+    if(MSG_TYPE(message) != ACCEPT || length < (int) sizeof(Accept_t))
+        return false;
+
+    Accept_t accept;
+    memcpy(&accept, message, sizeof accept);
+    if(accept.server_id == my_server_id || accept.server_id >= num_servers ||
+       accept.view != last_installed || accept.seq <= local_aru)
+        return false;
+
+    auto slot = global_history.find(accept.seq);
+    if(slot != global_history.end() &&
+       (slot->second.has_update || (slot->second.has_proposal && slot->second.prop.view == accept.view)))
+        return false;
+
+    // one per server, a repeat is already held
+    auto held = Early_Accepts.find(accept.seq);
+    if(held != Early_Accepts.end())
+    {
+        for(auto& h : held->second)
+        {
+            if(h.server_id == accept.server_id)
+                return true;
+        }
+    }
+    else if(Early_Accepts.size() >= MAX_EARLY_ACCEPTS)
+    {
+        Early_Accepts.erase(Early_Accepts.begin());
+    }
+
+    Early_Accepts[accept.seq].push_back(accept);
+    return true;
+}
+
+// handles the Accepts held for seq now that its Proposal is here.
+void Replay_Early_Accepts(uint32_t seq)
+{
+    auto found = Early_Accepts.find(seq);
+    if(found == Early_Accepts.end())
+        return;
+
+    std::vector<Accept_t> held;
+    held.swap(found->second);
+    Early_Accepts.erase(found);
+
+    for(auto& accept : held)
+        paxos::handle_Accept(accept);
+}
+
 //
 // B1. Upon receiving Proposal(server id, view, seq, update):
 void Upon_Receiving_Proposal(Proposal_t p)
@@ -914,10 +995,12 @@ void Upon_Receiving_Proposal(Proposal_t p)
 //     B4. **Sync to disk
         LOG(DEBUG, "Syncing to disk");
 //     B5. SEND to all servers: accept
-        std::vector<char> packed_msg;
+        std::vector<char>& packed_msg = Packing_Buffer();
         paxos::pack_Accept(accept, packed_msg);
         //unicast->sendMessage(packed_msg);
         unicast->sendMessage(packed_msg);
+//     and count the Accepts that beat the Proposal here
+        Replay_Early_Accepts(p.seq);
 }
 
 
@@ -1063,7 +1146,7 @@ void Send_Proposal()
 //     A15. **Sync to disk
         LOG(DEBUG, "Syncing to disk");
 //     A16. SEND to all servers: proposal
-        std::vector<char> packed_msg;
+        std::vector<char>& packed_msg = Packing_Buffer();
         paxos::pack_Proposal(proposal, packed_msg);
         //unicast->sendMessage(packed_msg);
         unicast->sendMessage(packed_msg);
@@ -1160,7 +1243,7 @@ void Client_Update_Handler(Client_Update_t U)
 //         A8. Add to Pending Updates(U)
             Add_To_Pending_Updates(U);
 //         A9. SEND to leader: U
-            std::vector<char> packed_msg;
+            std::vector<char>& packed_msg = Packing_Buffer();
             paxos::pack_Client_Update(U, packed_msg);
             unicast->reliableSend(Get_Leader(), packed_msg);
         }
@@ -1198,7 +1281,7 @@ void Upon_Expiration_Of_Update_Timer(uint32_t client_id)
         if(State == REG_NONLEADER)
         {
 //         B4. SEND to leader: Pending Updates[client id]
-            std::vector<char> packed_msg;
+            std::vector<char>& packed_msg = Packing_Buffer();
             paxos::pack_Client_Update(Pending_Updates[client_id], packed_msg);
             unicast->reliableSend(Get_Leader(), packed_msg);
         }
@@ -1452,10 +1535,10 @@ void Check_Timers()
             vcp.server_id = my_server_id;
             vcp.installed = last_installed;
 
-            std::vector<char> packed_msg;
+            std::vector<char>& packed_msg = Packing_Buffer();
             paxos::pack_VC_Proof(vcp, packed_msg);
             //unicast->sendMessage(packed_msg);
-            unicast->sendMessage(packed_msg);
+            unicast->sendMessage(packed_msg, VC_PROOF);
         }
     }
 
@@ -1479,10 +1562,10 @@ void Check_Timers()
     {
         prepare_timer.setAlarm(DEFAULT_PREPARE_TIMER_MS);
 
-        std::vector<char> packed_msg;
+        std::vector<char>& packed_msg = Packing_Buffer();
         paxos::pack_Prepare(Prepare, packed_msg);
         //unicast->sendMessage(packed_msg);
-        unicast->sendMessage(packed_msg);
+        unicast->sendMessage(packed_msg, PREPARE);
     }
 
     if(proposal_timer.alarmSet() && proposal_timer.alarmIsRinging())
@@ -1492,7 +1575,7 @@ void Check_Timers()
         for(auto proposal : Proposal_Retransmit_Queue)
         {
             log(DEBUG, "retransmitting proposals\n");
-            std::vector<char> packed;
+            std::vector<char>& packed = Packing_Buffer();
             paxos::pack_Proposal(proposal, packed);
             unicast->sendMessage(packed);
         }
@@ -1501,6 +1584,36 @@ void Check_Timers()
 
 
 
+long Ms_Until_Next_Timer()
+{
+    long next = -1;
+
+    auto consider = [&next](Timer& timer)
+    {
+        if(! timer.alarmSet())
+            return;
+
+        // rounded up so we don't wake just short of the alarm
+        long us = timer.getUsUntilAlarm();
+        long ms = (us <= 0)? 0 : (us + 999) / 1000;
+
+        if(next == -1 || ms < next)
+            next = ms;
+    };
+
+    consider(proof_timer);
+    consider(progress_timer);
+    consider(prepare_timer);
+    consider(proposal_timer);
+
+    for(int i = 0; i < MAX_CLIENTS; i++)
+        consider(update_timer[i]);
+
+    return next;
+}
+
+
+
 // Definitions from Paxos that we need:
 
 void paxos::handle_Client_Update(Client_Update_t var) // User supplied
@@ -1574,7 +1687,22 @@ void paxos::handle_Globally_Ordered_Update(Globally_Ordered_Update_t var)
 } // User supplied
 void paxos::handle_Prepare_OK(Prepare_OK_t var)
 {
-    LOG(TRACE, "Got Prepare Ok");
+    log(TRACE, "Got Prepare Ok: #prop: %d #glob: %d\n", var.total_proposals, var.total_globally_ordered_updates);
+
+#ifndef NDEBUG
+    // decode() only checked the counts, not what the entries claim to be
+    for(uint32_t i = 0; i < var.total_proposals; i++)
+    {
+        if(var.proposals[i].type != PROPOSAL)
+            log(WARN, "Prepare OK from %d has a proposal of type %d\n", var.server_id, var.proposals[i].type);
+    }
+    for(uint32_t i = 0; i < var.total_globally_ordered_updates; i++)
+    {
+        if(var.globally_ordered_updates[i].type != GLOBALLY_ORDERED_UPDATE)
+            log(WARN, "Prepare OK from %d has an update of type %d\n", var.server_id, var.globally_ordered_updates[i].type);
+    }
+#endif
+
     Upon_Receiving_Prepare_Ok(var);
 } // User supplied
 void paxos::handle_invalid_message(const char* message)
@@ -1582,148 +1710,95 @@ void paxos::handle_invalid_message(const char* message)
     log(ERROR, "Could not parse message: '%s'\n", message);
 } // usesupplied, when the parser encounters an error
 
-int lastSender = 0;
-void paxos::handle_UnivAck(paxos::UnivAck_t var)
-{
-    unicast->handleAck(&var, lastSender);
-}
-
 
 // Client interaction things.
-void initPaxos(Unicast& caster)
+void initPaxos(IoThread& io)
 {
-    unicast = &caster;
-    my_server_id = caster.localhost();
-    num_servers = caster.getNumberOfHosts();
+    unicast = &io;
+    my_server_id = io.localhost();
+    num_servers = io.getNumberOfHosts();
 
     log(INFO, "Number of hosts: %d\n", num_servers);
 
     Recovery();
 }
 
-void setLastSender(int ls)
+
+void parse_message(char* buffer, int bufsize)
 {
-    lastSender = ls;
+    // decode() checks every length and count against bufsize as it reads,
+    // and reports anything that doesn't add up through handle_invalid_message
+    paxos::decode(buffer, bufsize);
 }
 
 
-void parse_message(char* buffer, int bufsize)
+
+
+
+
+
+
+
+
+
+
+
+
+
+void parse_frame(char* buffer, int length, int id)
 {
-    switch(MSG_TYPE(buffer))
+    if(Conflict(buffer))
     {
-    case VIEW_CHANGE:
-        {
-            View_Change_t message;
-            memcpy(&message, (void *) buffer, sizeof(View_Change_t));
-            
-            paxos::handle_View_Change(message);
-        }
-        break;
-    case CLIENT_UPDATE:
-        {
-            Client_Update_t message;
-            memcpy(&message, (void *) buffer, sizeof(Client_Update_t));
-            
-            paxos::handle_Client_Update(message);
-        }
-        break;
-    case VC_PROOF:
+        if(Hold_Early_Accept(buffer, length))
         {
-            VC_Proof_t message;
-            memcpy(&message, (void *) buffer, sizeof(VC_Proof_t));
-            
-            paxos::handle_VC_Proof(message);
-        }
-        break;
-    case PREPARE:
-        {
-            Prepare_t message;
-            memcpy(&message, (void *) buffer, sizeof(Prepare_t));
-            
-            paxos::handle_Prepare(message);
-        }
-        break;
-    case PROPOSAL:
-        {
-            Proposal_t message;
-            memcpy(&message, (void *) buffer, sizeof(Proposal_t));
-            
-            paxos::handle_Proposal(message);
-        }
-        break;
-    case ACCEPT:
-        {
-            Accept_t message;
-            memcpy(&message, (void *) buffer, sizeof(Accept_t));
-            
-            paxos::handle_Accept(message);
-        }
-        break;
-    case GLOBALLY_ORDERED_UPDATE:
-        {
-            // This should never come up
-            LOG(ERROR, "this message globally ordered update should never cross a wire");
-        }
-        break;
-    case PREPARE_OK:
-        {
-            Prepare_OK_t message;
-            Prepare_OK_t *working = (Prepare_OK_t*) buffer;
-            message.type = working->type;
-            message.server_id = working->server_id;
-            message.view = working->view;
-            message.total_proposals = working->total_proposals;
-            memcpy(&message.proposals[0], (void *) &working->proposals, sizeof(Proposal_t) * message.total_proposals);
-            
-            uint32_t* global_updates = (uint32_t*) &buffer[sizeof(uint32_t) * 4 + sizeof(Proposal_t) * message.total_proposals];
-            message.total_globally_ordered_updates = global_updates[0];
-            log(TRACE, "parsing prepare OK");
-            log(TRACE, "PrepareOK: server: %d view: %d #prop: %d #glob: %d\n", message.server_id, message.view, message.total_proposals, message.total_globally_ordered_updates);
-            
-            int global_bytes = sizeof(Globally_Ordered_Update_t) * message.total_globally_ordered_updates;
-            
-            if(bufsize - global_bytes > 0)
-                memcpy(&message.globally_ordered_updates[0], (void *) &buffer[bufsize - global_bytes], global_bytes);
-            else
-            {
-                LOG(ERROR, "buffsize < global updates");
-                
-                uint32_t* msg = (uint32_t*) buffer;
-                for(int i = 0; i < bufsize / sizeof(uint32_t); i++)
-                    std::cerr << "\t" << msg[i] << std::endl;
-            }
-            
-            
-            
-            std::vector<char> preppack;
-            
-            paxos::pack_Prepare_OK(message, preppack);
-            
-            log(WARN, "PREPARE OK correct size? %d, expecting %d got %d\n", preppack.size() == bufsize, bufsize, preppack.size());
-            
-            paxos::handle_Prepare_OK(message);
-        }
-        break;
-    default:
-        {
-            LOG(ERROR, "This should be unreachable!");
+            log(TRACE, "Holding accept from %d until its proposal arrives\n", id);
+            return;
         }
-        break;
-    }
-}
-
-
-
 
+        // ignore conflicting messages
 
+        log(DEBUG, "-------------------------------------------------------\n");
+        log(DEBUG, "Ignoring message %d from %d (of length: %d)\n", MSG_TYPE(buffer), id, length);
+        prettyPrint(buffer);
 
+        return;
+    }
 
+    log(TRACE, "-------------------------------------------------------\n");
+    log(TRACE, "Recvd message %d from %d (of length: %d)\n", MSG_TYPE(buffer), id, length);
+    prettyPrint(buffer);
 
 
+    parse_message(buffer, length);
+}
 
+void parse_messages(Unicast::Datagram* batch, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        char* data = batch[i].data;
+        int id = batch[i].sender;
+        int offset = 0;
 
+        // a datagram carries one or more messages, each behind its frame
+        while(batch[i].length - offset >= (int) sizeof(Unicast::Frame))
+        {
+            Unicast::Frame frame;
+            memcpy(&frame, data + offset, sizeof frame);
+            offset += sizeof frame;
 
+            if(frame.length < sizeof(uint32_t) || frame.length > (uint32_t) (batch[i].length - offset))
+            {
+                log(WARN, "dropping the rest of a datagram from %d, frame of %u bytes with %d left\n",
+                    id, frame.length, batch[i].length - offset);
+                break;
+            }
 
+            parse_frame(data + offset, frame.length, id);
+            offset += frame.length;
+        }
+    }
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1753,8 +1828,9 @@ void prettyPrint(const char* message)
 
         case PREPARE_OK:
             {
+                // only the fields before the entries are where the struct has them
                 auto m = (Prepare_OK_t*) message;
-                log(TRACE, "PrepareOK: server: %d view: %d #prop: %d #glob: %d\n", m->server_id, m->view, m->total_proposals, m->total_globally_ordered_updates);
+                log(TRACE, "PrepareOK: server: %d view: %d #prop: %d\n", m->server_id, m->view, m->total_proposals);
             }
             break;
 
@@ -1,12 +1,10 @@
-#include "unicast.h"
+#include "iothread.h"
 #include "paxos.h"
 
 #ifndef psb_h
 #define psb_h
 
-void initPaxos(Unicast& unicast);
-
-void setLastSender(int ls);
+void initPaxos(IoThread& io);
 
 void reply_to_client(paxos::Client_Update_t update);
 
@@ -14,10 +12,16 @@ void Handle_New_Message(int clientid, int updateno); // handle cilent requests
 
 void Check_Timers(); // check that the timers are still valid
 
+long Ms_Until_Next_Timer(); // when Check_Timers next has work, -1 if no timer is set
+
 bool Conflict(const char* message);
 
 void prettyPrint(const char* message);
 
 void parse_message(char* buffer, int bufsize);
 
+void parse_frame(char* buffer, int length, int id); // parse one message from host id
+
+void parse_messages(Unicast::Datagram* batch, int count); // parse every message in a batch from IoThread::readBatch
+
 #endif
@@ -0,0 +1,124 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+A single epoll event loop for the server.
+**/
+
+#include "reactor.h"
+#include "Debug.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+const int Reactor::MAX_EVENTS;
+
+Reactor::Reactor()
+{
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(_epoll == -1)
+        log(ERROR, "epoll_create1: %s\n", strerror(errno));
+
+    _timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(_timer == -1)
+        log(ERROR, "timerfd_create: %s\n", strerror(errno));
+
+    // the deadline only has to wake epoll_wait, reading it re-arms it.
+    int timer = _timer;
+    add(_timer, EPOLLIN, [timer](uint32_t) {
+        uint64_t expirations;
+        if(read(timer, &expirations, sizeof expirations) == -1 && errno != EAGAIN)
+            log(WARN, "timerfd read: %s\n", strerror(errno));
+    });
+}
+
+Reactor::~Reactor()
+{
+    close(_timer);
+    close(_epoll);
+}
+
+bool Reactor::add(int fd, uint32_t events, const Handler& handler)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof ev);
+    ev.events = events;
+    ev.data.fd = fd;
+
+    int op = (_handlers.count(fd))? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if(epoll_ctl(_epoll, op, fd, &ev) == -1)
+    {
+        log(ERROR, "epoll_ctl on %d: %s\n", fd, strerror(errno));
+        return false;
+    }
+
+    _handlers[fd] = handler;
+    return true;
+}
+
+void Reactor::remove(int fd)
+{
+    if(! _handlers.erase(fd))
+        return;
+
+    // a closed fd already left the set on its own
+    if(epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, NULL) == -1 && errno != EBADF && errno != ENOENT)
+        log(WARN, "epoll_ctl del %d: %s\n", fd, strerror(errno));
+}
+
+void Reactor::setDeadline(long ms)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+
+    if(ms >= 0)
+    {
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+
+        // all zero would disarm it, due now means as soon as possible
+        if(ms == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    if(timerfd_settime(_timer, 0, &spec, NULL) == -1)
+        log(ERROR, "timerfd_settime: %s\n", strerror(errno));
+}
+
+int Reactor::wait()
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int ready = epoll_wait(_epoll, events, MAX_EVENTS, -1);
+    if(ready == -1)
+    {
+        if(errno != EINTR)
+            log(ERROR, "epoll_wait: %s\n", strerror(errno));
+        return 0;
+    }
+
+    int handled = 0;
+    for(int i = 0; i < ready; i++)
+    {
+        int fd = events[i].data.fd;
+
+        // an earlier handler may have removed it
+        auto it = _handlers.find(fd);
+        if(it == _handlers.end())
+            continue;
+
+        if(fd != _timer)
+            handled++;
+
+        // copied, the handler may remove itself
+        Handler handler = it->second;
+        handler(events[i].events);
+    }
+
+    return handled;
+}
@@ -0,0 +1,47 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+A single epoll event loop for the server: sockets register a handler and
+a timerfd wakes the loop for the next timer deadline, so the server only
+wakes when there is work to do.
+**/
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+class Reactor
+{
+public:
+    // called with the epoll events that were ready on the fd
+    typedef std::function<void(uint32_t events)> Handler;
+
+    Reactor();
+    ~Reactor();
+
+    // watches fd for the given epoll events, replacing any earlier handler.
+    bool add(int fd, uint32_t events, const Handler& handler);
+    void remove(int fd);
+
+    // wakes the next wait() this many ms from now, -1 for no deadline.
+    void setDeadline(long ms);
+
+    // waits for a ready fd or the deadline and runs the handlers of
+    // everything ready. Returns the number of fds handled, 0 on the deadline.
+    int wait();
+
+    static const int MAX_EVENTS = 64;
+
+private:
+    int _epoll;
+    int _timer;
+    std::unordered_map<int, Handler> _handlers;
+};
+
+#endif
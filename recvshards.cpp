@@ -0,0 +1,438 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Receive workers for Unicast, one per SO_REUSEPORT socket.
+**/
+
+#include "recvshards.h"
+#include "unicast.h"
+#include "udp.h"
+#include "Debug.hpp"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+const int RecvShards::RING_SLOTS;
+
+// most datagrams a worker takes off its socket per recvmmsg
+const int SHARD_BATCH = 64;
+// room every slot starts out with, larger datagrams grow theirs once
+const size_t SHARD_SLOT_RESERVE_BYTES = 2048;
+// room for the receive timestamp of a datagram
+const size_t SHARD_CONTROL_BYTES = CMSG_SPACE(sizeof(struct timespec));
+
+// the kernel's receive timestamp of a datagram, now if it gave none
+static uint64_t arrivedNs(struct msghdr& msg)
+{
+    struct timespec ts;
+    struct cmsghdr* cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            break;
+    }
+
+    if(cmsg != NULL)
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+    else
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the key IPLookup finds an address by
+static uint64_t addressKey(const struct sockaddr_in& address)
+{
+    return ((uint64_t) address.sin_addr.s_addr << 16) | address.sin_port;
+}
+
+// true if a payload is nothing, a fragment alone, or frames that fill it
+// exactly; what Unicast and the protocol would otherwise walk into.
+static bool framed(const char* payload, int length)
+{
+    int offset = 0;
+    while(offset < length)
+    {
+        Unicast::Frame frame;
+        if(length - offset < (int) sizeof frame)
+            return false;
+
+        memcpy(&frame, payload + offset, sizeof frame);
+        offset += sizeof frame;
+
+        if(frame.length & Unicast::FRAME_FRAGMENT)
+        {
+            uint32_t bytes = frame.length & ~Unicast::FRAME_FRAGMENT;
+            return offset == (int) sizeof frame && bytes >= sizeof(Unicast::Fragment) &&
+                   bytes == (uint32_t) (length - offset);
+        }
+
+        if(frame.length > (uint32_t) (length - offset))
+            return false;
+        offset += frame.length;
+    }
+    return true;
+}
+
+RecvShards::RecvShards(int socket, int count, uint16_t port, const struct sockaddr_in* addresses, int hosts,
+                       size_t datagramBytes)
+:_ownSocketsFrom(1),
+_datagramBytes(datagramBytes),
+_running(true),
+_usable(true)
+{
+    for(int i = 0; i < hosts; i++)
+    {
+        if(addresses[i].sin_family == AF_INET)
+            _senders.insert(std::make_pair(addressKey(addresses[i]), i));
+    }
+
+    _ready = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(_ready == -1)
+    {
+        log(ERROR, "eventfd: %s\n", strerror(errno));
+        _usable = false;
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        _shards.push_back(std::unique_ptr<Shard>(new Shard()));
+        Shard& shard = *_shards.back();
+
+        shard.socket = (i == 0)? socket : UDP::server(port, true);
+        shard.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        int one = 1;
+        if(shard.socket < 0 || shard.wake == -1 ||
+           setsockopt(shard.socket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one) == -1)
+        {
+            log(ERROR, "could not open receive shard %d on port %u\n", i, port);
+            _usable = false;
+        }
+
+        for(size_t j = 0; j < shard.ring.capacity(); j++)
+            shard.ring.slot(j).data.reserve(SHARD_SLOT_RESERVE_BYTES);
+
+        struct pollfd fd;
+        fd.fd = shard.socket;
+        fd.events = POLLIN;
+        _sockets.push_back(fd);
+    }
+
+    if(! _usable)
+        return;
+
+    for(auto& shard : _shards)
+        shard->thread = std::thread(&RecvShards::run, this, std::ref(*shard));
+
+    log(INFO, "recvshards: %d sockets on port %u\n", count, port);
+}
+
+RecvShards::~RecvShards()
+{
+    _running = false;
+    for(size_t i = 0; i < _shards.size(); i++)
+    {
+        Shard& shard = *_shards[i];
+        if(shard.thread.joinable())
+        {
+            signal(shard.wake);
+            shard.thread.join();
+        }
+
+        if(shard.wake != -1)
+            close(shard.wake);
+        if((int) i >= _ownSocketsFrom && shard.socket >= 0)
+            close(shard.socket);
+    }
+
+    if(_ready != -1)
+        close(_ready);
+}
+
+void RecvShards::signal(int fd)
+{
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof one) == -1 && errno != EAGAIN)
+        log(WARN, "eventfd write: %s\n", strerror(errno));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Workers
+
+bool RecvShards::decode(Shard& shard, Slot& slot, const char* data, int length)
+{
+    Unicast::Header header;
+    if(length < (int) sizeof header)
+    {
+        shard.dropped++;
+        return false;
+    }
+
+    memcpy(&header, data, sizeof header);
+    if(header.kind != Unicast::DATAGRAM_DATA && header.kind != Unicast::DATAGRAM_ACK &&
+       header.kind != Unicast::DATAGRAM_UNRELIABLE)
+    {
+        shard.dropped++;
+        return false;
+    }
+
+    slot.sender = -1;
+    if(slot.from.ss_family == AF_INET)
+    {
+        auto found = _senders.find(addressKey(*(struct sockaddr_in*) &slot.from));
+        if(found != _senders.end())
+            slot.sender = found->second;
+    }
+
+    // the header alone still gets the datagram acked and its seq
+    // accounted for, the sender would retransmit it forever otherwise
+    if(! framed(data + sizeof header, length - sizeof header))
+    {
+        shard.malformed++;
+        length = sizeof header;
+    }
+
+    slot.data.assign(data, data + length);
+    return true;
+}
+
+void RecvShards::run(Shard& shard)
+{
+    std::vector<char> buffers(SHARD_BATCH * _datagramBytes);
+    struct mmsghdr msgs[SHARD_BATCH];
+    struct iovec iov[SHARD_BATCH];
+    struct sockaddr_storage addrs[SHARD_BATCH];
+    std::vector<char> control(SHARD_BATCH * SHARD_CONTROL_BYTES);
+
+    struct pollfd fds[2];
+    fds[0].fd = shard.socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = shard.wake;
+    fds[1].events = POLLIN;
+
+    while(_running)
+    {
+        size_t space = shard.ring.capacity() - shard.ring.size();
+        if(space == 0)
+        {
+            // wait for read() to free a slot, pairs with the fence there
+            shard.full++;
+            shard.blocked = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(shard.ring.size() == shard.ring.capacity() && _running)
+                poll(&fds[1], 1, -1);
+
+            uint64_t signals;
+            if(::read(shard.wake, &signals, sizeof signals) == -1 && errno != EAGAIN)
+                log(WARN, "eventfd read: %s\n", strerror(errno));
+            shard.blocked = false;
+            continue;
+        }
+
+        int vlen = (space < (size_t) SHARD_BATCH)? space : SHARD_BATCH;
+        for(int i = 0; i < vlen; i++)
+        {
+            iov[i].iov_base = &buffers[i * _datagramBytes];
+            iov[i].iov_len = _datagramBytes;
+
+            memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = &control[i * SHARD_CONTROL_BYTES];
+            msgs[i].msg_hdr.msg_controllen = SHARD_CONTROL_BYTES;
+        }
+
+        // set before the socket is emptied, settle() looks the other way
+        shard.receiving = true;
+        shard.syscalls++;
+        int ret = recvmmsg(shard.socket, msgs, vlen, MSG_DONTWAIT, NULL);
+        if(ret <= 0)
+        {
+            shard.receiving = false;
+
+            if(ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log(WARN, "recvmmsg: %s\n", strerror(errno));
+
+            // drained, sleep until there is more or we are stopped
+            if(poll(fds, 2, -1) == -1 && errno != EINTR)
+                log(WARN, "poll: %s\n", strerror(errno));
+
+            if(fds[1].revents & POLLIN)
+            {
+                uint64_t signals;
+                if(::read(shard.wake, &signals, sizeof signals) == -1 && errno != EAGAIN)
+                    log(WARN, "eventfd read: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        shard.datagrams += ret;
+
+        for(int i = 0; i < ret; i++)
+        {
+            Slot* slot = shard.ring.claim(); // there was space for vlen
+            slot->arrivedNs = arrivedNs(msgs[i].msg_hdr);
+            memcpy(&slot->from, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+            slot->fromLen = msgs[i].msg_hdr.msg_namelen;
+
+            if(decode(shard, *slot, (const char*) iov[i].iov_base, msgs[i].msg_len))
+                shard.ring.publish();
+        }
+        shard.receiving = false;
+
+        // even with nothing published: read() may be holding the other
+        // rings back until this worker stopped receiving
+        signal(_ready);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Consumer
+
+int RecvShards::read(Datagram* datagrams, int budget)
+{
+    for(auto& shard : _shards)
+    {
+        if(! shard->handedOut)
+            continue;
+
+        shard->ring.release(shard->handedOut);
+        shard->handedOut = 0;
+
+        // pairs with the fence in run(), one of us sees the other's write
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(shard->blocked.load())
+            signal(shard->wake);
+    }
+
+    int count = 0;
+    bool cleared = false;
+    settle();
+    while(count < budget)
+    {
+        Shard* shard = next();
+        if(shard == NULL)
+        {
+            // clear the eventfd before looking again, anything handed over
+            // after that look signals it anew.
+            if(cleared)
+                break;
+
+            uint64_t signals;
+            if(::read(_ready, &signals, sizeof signals) == -1 && errno != EAGAIN)
+                log(WARN, "eventfd read: %s\n", strerror(errno));
+            cleared = true;
+            settle();
+            continue;
+        }
+
+        Slot* slot = shard->ring.peek(shard->handedOut);
+        datagrams[count].sender = slot->sender;
+        datagrams[count].data = &slot->data[0];
+        datagrams[count].length = slot->data.size();
+        datagrams[count].from = (struct sockaddr*) &slot->from;
+        datagrams[count].fromLen = slot->fromLen;
+        shard->handedOut++;
+        count++;
+    }
+
+    return count;
+}
+
+void RecvShards::settle()
+{
+    // with nothing to hand over, or one ring to take it from, there is no
+    // order to keep and no need to ask the sockets
+    int waiting = 0;
+    for(auto& shard : _shards)
+    {
+        shard->settled = shard->ring.size();
+        shard->unsettled = false;
+        if(shard->settled > shard->handedOut)
+            waiting++;
+    }
+    if(waiting == 0 || _shards.size() == 1)
+        return;
+
+    // the socket next: a worker that empties it after this is still
+    // receiving below, or its ring has grown past what we noted
+    if(poll(&_sockets[0], _sockets.size(), 0) == -1 && errno != EINTR)
+        log(WARN, "poll: %s\n", strerror(errno));
+
+    for(size_t i = 0; i < _shards.size(); i++)
+    {
+        Shard& shard = *_shards[i];
+        shard.unsettled = (_sockets[i].revents & POLLIN) || shard.receiving.load() ||
+                          shard.ring.size() > shard.settled;
+    }
+}
+
+RecvShards::Shard* RecvShards::next()
+{
+    Shard* oldest = NULL;
+    uint64_t oldestNs = 0;
+
+    for(auto& shard : _shards)
+    {
+        // published since settle(), a quiet worker may have something older
+        if(shard->handedOut >= shard->settled)
+        {
+            if(shard->unsettled)
+                return NULL;
+            continue;
+        }
+
+        Slot* slot = shard->ring.peek(shard->handedOut);
+        if(oldest == NULL || slot->arrivedNs < oldestNs)
+        {
+            oldest = shard.get();
+            oldestNs = slot->arrivedNs;
+        }
+    }
+
+    return oldest;
+}
+
+bool RecvShards::pending() const
+{
+    for(auto& shard : _shards)
+    {
+        if(shard->ring.size() > shard->handedOut)
+            return true;
+    }
+    return false;
+}
+
+void RecvShards::wait(int timeoutMs)
+{
+    struct pollfd fd;
+    fd.fd = _ready;
+    fd.events = POLLIN;
+    if(poll(&fd, 1, timeoutMs) == -1 && errno != EINTR)
+        log(WARN, "poll: %s\n", strerror(errno));
+}
+
+void RecvShards::logStats()
+{
+    for(size_t i = 0; i < _shards.size(); i++)
+    {
+        const Shard& shard = *_shards[i];
+        log(INFO, "recvshards: socket %zu: %llu datagrams in %llu syscalls, %llu dropped, %llu malformed, ring full %llu times\n",
+            i,
+            (unsigned long long) shard.datagrams,
+            (unsigned long long) shard.syscalls,
+            (unsigned long long) shard.dropped,
+            (unsigned long long) shard.malformed,
+            (unsigned long long) shard.full);
+    }
+}
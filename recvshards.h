@@ -0,0 +1,164 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Spreads the datagrams arriving on Unicast's port over several sockets bound
+to it with SO_REUSEPORT, each drained by a worker thread of its own. The
+kernel picks a socket by hashing the sender's address, so every peer's
+datagrams land on the same one and keep their order. Workers resolve the
+sender and check the header and framing, then hand each datagram over an
+SpscRing to whoever drives the Unicast; acks, duplicates and reassembly stay
+with it. The kernel stamps every datagram as it arrives and read() merges
+the rings by those stamps, holding a datagram back while another worker may
+still hand over an older one, so the protocol sees datagrams from different
+peers in the order they came in, as it would off one socket. Stamps are only
+compared with each other, never with a clock of ours.
+**/
+
+#ifndef RECVSHARDS_H
+#define RECVSHARDS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "spscring.h"
+
+class RecvShards
+{
+public:
+    // drains socket, already bound to port with SO_REUSEPORT, and count - 1
+    // more sockets it binds there itself. Senders are resolved against the
+    // hosts addresses; datagrams are at most datagramBytes.
+    RecvShards(int socket, int count, uint16_t port, const struct sockaddr_in* addresses, int hosts,
+               size_t datagramBytes);
+    ~RecvShards();
+
+    // every socket got bound, nothing else may be called if one didn't.
+    bool usable() const {return _usable;}
+
+    // readable while a worker has handed something over, for event loops.
+    int getFd() const {return _ready;}
+
+    // a datagram a worker took off its socket, valid until the next call
+    // to read(). sender is -1 if the worker couldn't tell who sent it, from
+    // has the address to look up then.
+    struct Datagram
+    {
+        int sender;
+        char* data;
+        int length;
+        struct sockaddr* from;
+        socklen_t fromLen;
+    };
+
+    // gives back what the last call handed out and stores at most budget
+    // datagrams, oldest first over every worker. Never waits, but stops
+    // short while a worker is behind. Returns the number stored.
+    int read(Datagram* datagrams, int budget);
+
+    // workers have handed over datagrams read() hasn't, perhaps held back
+    // for order. Only for whoever calls read().
+    bool pending() const;
+
+    // waits up to timeoutMs for a worker to hand something over.
+    void wait(int timeoutMs);
+
+    void logStats();
+
+    static const int RING_SLOTS = 1024;
+
+private:
+    struct Slot
+    {
+        uint64_t arrivedNs;     // the kernel's receive timestamp
+        int sender;
+        struct sockaddr_storage from;
+        socklen_t fromLen;
+        std::vector<char> data;
+    };
+
+    // one socket and the worker draining it
+    struct Shard
+    {
+        int socket;
+        int wake;       // eventfd, the ring has room again or we are stopping
+        SpscRing<Slot> ring;
+        std::atomic<bool> blocked; // the ring was full, the worker waits on wake
+        std::atomic<bool> receiving; // between taking datagrams and publishing them
+        std::thread thread;
+        size_t handedOut;   // consumer: slots the last read() handed out
+        size_t settled;     // consumer: slots published when settle() looked
+        bool unsettled;     // consumer: may still hand over something older than those
+
+        // written by the worker
+        std::atomic<uint64_t> syscalls;
+        std::atomic<uint64_t> datagrams;
+        std::atomic<uint64_t> dropped;     // runts and unknown kinds
+        std::atomic<uint64_t> malformed;   // framing didn't add up, payload cut off
+        std::atomic<uint64_t> full;        // times the ring was full
+
+        Shard()
+        :socket(-1),
+        wake(-1),
+        ring(RING_SLOTS),
+        blocked(false),
+        receiving(false),
+        handedOut(0),
+        settled(0),
+        unsettled(false),
+        syscalls(0),
+        datagrams(0),
+        dropped(0),
+        malformed(0),
+        full(0)
+        {}
+
+        // the ring's indices are 64 byte aligned, which plain new only
+        // honours from C++17 on
+        static void* operator new(size_t bytes)
+        {
+            void* memory = NULL;
+            if(posix_memalign(&memory, 64, bytes) != 0)
+                throw std::bad_alloc();
+            return memory;
+        }
+
+        static void operator delete(void* memory) {free(memory);}
+    };
+
+    void run(Shard& shard);
+    // notes what every ring holds and which workers have something coming
+    // that isn't in their ring yet; whatever a quiet worker hands over
+    // later arrived after all of it
+    void settle();
+    // the shard whose next slot settle() saw arrived first, NULL if there
+    // is none or a worker settle() found behind may still hand over an
+    // older one
+    Shard* next();
+    // fills in a slot for a datagram, false if it isn't worth handing over
+    bool decode(Shard& shard, Slot& slot, const char* data, int length);
+    static void signal(int fd);
+
+    std::vector<std::unique_ptr<Shard> > _shards;
+    int _ownSocketsFrom;    // _shards[0] drains the socket we were given
+    std::unordered_map<uint64_t, int> _senders; // (ipv4 address, port) -> id, read only once started
+    size_t _datagramBytes;
+    int _ready;             // eventfd, workers -> consumer
+    std::atomic<bool> _running;
+    bool _usable;
+    std::vector<struct pollfd> _sockets; // consumer: every shard's, for settle()
+};
+
+#endif
@@ -0,0 +1,731 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Shared-memory rings between replicas on the same machine.
+**/
+
+#include "shmmesh.h"
+#include "Debug.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+const size_t ShmMesh::DEFAULT_RING_BYTES;
+
+// starts every hello, so strays that happen to dial the socket are turned away
+const uint32_t HELLO_MAGIC = 0x50415852;
+
+// the unix sockets links are set up over live in a directory only we can
+// get into, under XDG_RUNTIME_DIR if there is one
+const char* SOCKET_PARENT = "/tmp";
+
+// bytes held back for one peer before new messages are dropped
+const size_t MAX_HELD_BYTES = 64 * 1024 * 1024;
+// the largest ring a peer may hand us
+const uint64_t MAX_RING_BYTES = 1ULL << 30;
+
+// between dials of a peer that isn't there
+const uint64_t MIN_BACKOFF_MS = 10;
+const uint64_t MAX_BACKOFF_MS = 1000;
+
+const int MAX_EVENTS = 64;
+
+ShmMesh::ShmMesh(const std::vector<bool>& linked, int self, uint16_t port, size_t ringBytes)
+:_links(linked.size()),
+_self(self),
+_port(port),
+_listener(-1),
+_stats()
+{
+    _pageBytes = sysconf(_SC_PAGESIZE);
+
+    // a power of two so positions wrap with a mask, and whole pages so the
+    // second mapping can follow the first
+    _ringBytes = _pageBytes;
+    while(_ringBytes < ringBytes)
+        _ringBytes <<= 1;
+
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(_epoll == -1)
+        log(ERROR, "shmmesh: epoll_create1: %s\n", strerror(errno));
+
+    if(! privateDir())
+    {
+        log(ERROR, "shmmesh: no private directory for the sockets, not linking\n");
+        return;
+    }
+
+    std::string ours = path(_self);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, ours.c_str(), sizeof address.sun_path - 1);
+
+    // left over from our last run
+    unlink(ours.c_str());
+
+    _listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(_listener == -1 ||
+       bind(_listener, (struct sockaddr*) &address, sizeof address) == -1 ||
+       listen(_listener, SOMAXCONN) == -1)
+    {
+        log(ERROR, "shmmesh: could not listen on %s: %s\n", ours.c_str(), strerror(errno));
+    }
+    else
+    {
+        watch(_listener, EPOLLIN, TAG_LISTENER, 0);
+    }
+
+    for(uint32_t node = 0; node < _links.size(); node++)
+        _links[node].linked = linked[node] && node != _self;
+
+    // the higher id of each pair dials
+    for(uint32_t node = 0; node < _self; node++)
+    {
+        if(_links[node].linked)
+            dial(node);
+    }
+}
+
+ShmMesh::~ShmMesh()
+{
+    for(auto& link : _links)
+    {
+        if(link.socket == -1)
+            continue;
+
+        close(link.socket);
+        close(link.wakePeer);
+        close(link.wakeUs);
+        _retired.push_back(link.out);
+        _retired.push_back(link.in);
+    }
+
+    for(auto& ring : _retired)
+        munmap(ring.mapping, ring.mappingBytes);
+
+    for(int fd : _accepted)
+        close(fd);
+
+    if(_listener != -1)
+    {
+        close(_listener);
+        unlink(path(_self).c_str());
+    }
+    close(_epoll);
+}
+
+uint64_t ShmMesh::nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool ShmMesh::privateDir()
+{
+    const char* parent = getenv("XDG_RUNTIME_DIR");
+    if(parent == NULL || *parent == '\0')
+        parent = SOCKET_PARENT;
+
+    char buffer[64];
+    snprintf(buffer, sizeof buffer, "/paxos-shm-%u", (unsigned) getuid());
+    _socketDir = std::string(parent) + buffer;
+
+    if(mkdir(_socketDir.c_str(), 0700) == -1 && errno != EEXIST)
+    {
+        log(ERROR, "shmmesh: mkdir %s: %s\n", _socketDir.c_str(), strerror(errno));
+        return false;
+    }
+
+    // somebody else's, or one they could plant a socket in
+    struct stat st;
+    if(lstat(_socketDir.c_str(), &st) == -1 || ! S_ISDIR(st.st_mode) ||
+       st.st_uid != getuid() || (st.st_mode & 077) != 0)
+    {
+        log(ERROR, "shmmesh: %s isn't a directory only we can use\n", _socketDir.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string ShmMesh::path(const uint32_t node) const
+{
+    char buffer[32];
+    snprintf(buffer, sizeof buffer, "/%u-%u.sock", _port, node);
+    return _socketDir + buffer;
+}
+
+void ShmMesh::watch(int fd, uint32_t events, Tag tag, uint32_t value)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = ((uint64_t) tag << 32) | value;
+
+    if(epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+        log(WARN, "shmmesh: epoll_ctl: %s\n", strerror(errno));
+}
+
+void ShmMesh::signal(int fd)
+{
+    uint64_t one = 1;
+    if(write(fd, &one, sizeof one) == -1 && errno != EAGAIN)
+        log(WARN, "shmmesh: eventfd write: %s\n", strerror(errno));
+}
+
+bool ShmMesh::map(Ring& ring, int memfd, off_t offset, size_t bytes)
+{
+    // reserve room for the control page and the data twice, then put the
+    // memfd's pages over it
+    size_t total = _pageBytes + 2 * bytes;
+    char* reserved = (char*) mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(reserved == MAP_FAILED)
+        return false;
+
+    if(mmap(reserved, _pageBytes + bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            memfd, offset) == MAP_FAILED ||
+       mmap(reserved + _pageBytes + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            memfd, offset + _pageBytes) == MAP_FAILED)
+    {
+        munmap(reserved, total);
+        return false;
+    }
+
+    ring.control = (Control*) reserved;
+    ring.data = reserved + _pageBytes;
+    ring.bytes = bytes;
+    ring.mapping = reserved;
+    ring.mappingBytes = total;
+    return true;
+}
+
+bool ShmMesh::sized(int memfd, size_t ringBytes) const
+{
+    // touching a page past the end of the memfd is a SIGBUS, check the size
+    // now and that the seals keep it that way
+    struct stat st;
+    if(fstat(memfd, &st) == -1 || ! S_ISREG(st.st_mode) ||
+       (uint64_t) st.st_size < 2 * (_pageBytes + ringBytes))
+    {
+        return false;
+    }
+
+    int seals = fcntl(memfd, F_GET_SEALS);
+    return seals != -1 && (seals & F_SEAL_SHRINK);
+}
+
+void ShmMesh::dial(const uint32_t node)
+{
+    Link& link = _links[node];
+    link.dialDueUs = 0;
+
+    std::string theirs = path(node);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, theirs.c_str(), sizeof address.sun_path - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1 || connect(sock, (struct sockaddr*) &address, sizeof address) == -1)
+    {
+        log(DEBUG, "shmmesh: could not dial %u: %s\n", node, strerror(errno));
+        if(sock != -1)
+            close(sock);
+        scheduleDial(node);
+        return;
+    }
+
+    // the first ring is ours to write, the second theirs
+    int memfd = memfd_create("paxos-rings", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    int wakePeer = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int wakeUs = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    bool ok = memfd != -1 && wakePeer != -1 && wakeUs != -1 &&
+              ftruncate(memfd, 2 * (_pageBytes + _ringBytes)) == 0 &&
+              fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0;
+
+    if(ok)
+    {
+        Hello hello = {HELLO_MAGIC, _self, _ringBytes};
+        int fds[3] = {memfd, wakePeer, wakeUs};
+
+        struct iovec iov = {&hello, sizeof hello};
+        union
+        {
+            char buffer[CMSG_SPACE(sizeof fds)];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof control);
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof control.buffer;
+
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+        ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof hello;
+    }
+
+    if(! ok)
+    {
+        log(WARN, "shmmesh: could not set up rings with %u: %s\n", node, strerror(errno));
+        close(sock);
+        if(memfd != -1)
+            close(memfd);
+        if(wakePeer != -1)
+            close(wakePeer);
+        if(wakeUs != -1)
+            close(wakeUs);
+        scheduleDial(node);
+        return;
+    }
+
+    linkUp(node, sock, memfd, true, wakePeer, wakeUs, _ringBytes);
+}
+
+void ShmMesh::scheduleDial(const uint32_t node)
+{
+    if(node >= _self)
+        return;
+
+    Link& link = _links[node];
+    link.backoffMs = (link.backoffMs == 0)? MIN_BACKOFF_MS : std::min(link.backoffMs * 2, MAX_BACKOFF_MS);
+    link.dialDueUs = nowUs() + link.backoffMs * 1000;
+}
+
+void ShmMesh::accept()
+{
+    while(true)
+    {
+        int fd = accept4(_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log(WARN, "shmmesh: accept: %s\n", strerror(errno));
+            return;
+        }
+
+        _accepted.insert(fd);
+        watch(fd, EPOLLIN, TAG_ACCEPTED, fd);
+    }
+}
+
+void ShmMesh::readHello(int fd)
+{
+    if(! _accepted.count(fd))
+        return;
+
+    Hello hello;
+    struct iovec iov = {&hello, sizeof hello};
+    union
+    {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof control.buffer;
+
+    ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    _accepted.erase(fd);
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, NULL);
+
+    // whatever else is wrong, the fds that came along are ours to close
+    int fds[3];
+    int received = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if(n > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), std::min(received, 3) * sizeof(int));
+    }
+
+    bool ok = n == (ssize_t) sizeof hello && received == 3 &&
+              hello.magic == HELLO_MAGIC &&
+              hello.node > _self && hello.node < _links.size() && _links[hello.node].linked &&
+              hello.ringBytes >= _pageBytes && hello.ringBytes <= MAX_RING_BYTES &&
+              (hello.ringBytes & (hello.ringBytes - 1)) == 0 &&
+              sized(fds[0], hello.ringBytes);
+
+    if(! ok)
+    {
+        if(n != 0)
+            log(WARN, "shmmesh: turning away a link with a bad hello\n");
+        for(int i = 0; i < std::min(received, 3); i++)
+            close(fds[i]);
+        close(fd);
+        return;
+    }
+
+    // they dialed, so the eventfd they wait on comes last
+    linkUp(hello.node, fd, fds[0], false, fds[2], fds[1], hello.ringBytes);
+}
+
+void ShmMesh::linkUp(const uint32_t node, int socket, int memfd, bool dialed, int wakePeer, int wakeUs, size_t ringBytes)
+{
+    Link& link = _links[node];
+
+    // the peer restarted, its old link is dead even if we hadn't noticed
+    if(link.socket != -1)
+        linkDown(node, "it linked again");
+
+    // the side that dialed writes the first ring
+    off_t span = _pageBytes + ringBytes;
+    bool mapped = map(link.out, memfd, dialed? 0 : span, ringBytes);
+    if(mapped && ! map(link.in, memfd, dialed? span : 0, ringBytes))
+    {
+        munmap(link.out.mapping, link.out.mappingBytes);
+        link.out = Ring();
+        mapped = false;
+    }
+    close(memfd);
+
+    if(! mapped)
+    {
+        log(WARN, "shmmesh: could not map the rings shared with %u: %s\n", node, strerror(errno));
+        close(socket);
+        close(wakePeer);
+        close(wakeUs);
+        scheduleDial(node);
+        return;
+    }
+
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+    link.socket = socket;
+    link.wakePeer = wakePeer;
+    link.wakeUs = wakeUs;
+    link.backoffMs = 0;
+    watch(socket, EPOLLIN | EPOLLRDHUP, TAG_SOCKET, node);
+    watch(wakeUs, EPOLLIN, TAG_WAKE, node);
+
+    _stats.links++;
+    log(INFO, "shmmesh: linked with %u over %u byte rings\n", node, (uint32_t) ringBytes);
+
+    // whatever was sent before the link was up
+    release(link);
+}
+
+void ShmMesh::linkDown(const uint32_t node, const char* why)
+{
+    Link& link = _links[node];
+
+    log(WARN, "shmmesh: lost %u (%s), dropping %u held back bytes\n",
+        node, why, (uint32_t) link.held.size());
+
+    close(link.socket);
+    close(link.wakePeer);
+    close(link.wakeUs);
+    link.socket = link.wakePeer = link.wakeUs = -1;
+
+    // what the last read() handed out may still be in use
+    _retired.push_back(link.out);
+    _retired.push_back(link.in);
+    link.out = Ring();
+    link.in = Ring();
+
+    link.handedOut = 0;
+    link.unsignaled = false;
+    link.held.clear();
+
+    _stats.unlinks++;
+    scheduleDial(node);
+}
+
+bool ShmMesh::fits(const std::vector<char> &message) const
+{
+    return sizeof(uint32_t) + message.size() <= _ringBytes;
+}
+
+bool ShmMesh::push(Link& link, const char* message, uint32_t length)
+{
+    Ring& ring = link.out;
+    uint64_t tail = ring.control->tail.load(std::memory_order_relaxed);
+    uint64_t head = ring.control->head.load(std::memory_order_acquire);
+    size_t bytes = sizeof length + length;
+
+    if(ring.bytes - (tail - head) < bytes)
+        return false;
+
+    // the second mapping catches whatever runs past the end
+    char* at = ring.data + (tail & (ring.bytes - 1));
+    memcpy(at, &length, sizeof length);
+    memcpy(at + sizeof length, message, length);
+    ring.control->tail.store(tail + bytes, std::memory_order_release);
+
+    link.unsignaled = true;
+    _stats.bytesWritten += bytes;
+    return true;
+}
+
+void ShmMesh::release(Link& link)
+{
+    size_t pos = 0;
+    while(link.held.size() - pos >= sizeof(uint32_t))
+    {
+        uint32_t length;
+        memcpy(&length, &link.held[pos], sizeof length);
+        if(! push(link, &link.held[pos + sizeof length], length))
+            break;
+        pos += sizeof length + length;
+    }
+    link.held.erase(link.held.begin(), link.held.begin() + pos);
+
+    // the reader wakes us when it makes room
+    if(! link.held.empty())
+        link.out.control->blocked.store(1);
+}
+
+void ShmMesh::queue(const uint32_t node, const std::vector<char> &message)
+{
+    Link& link = _links[node];
+    uint32_t length = message.size();
+    _stats.messagesQueued++;
+
+    if(link.socket != -1 && link.held.empty() && push(link, message.data(), length))
+        return;
+
+    if(link.held.size() + sizeof length + length > MAX_HELD_BYTES)
+    {
+        log(WARN, "shmmesh: %u is too far behind, dropping a message of %u bytes\n", node, length);
+        _stats.messagesDropped++;
+        return;
+    }
+
+    const char* l = (const char*) &length;
+    link.held.insert(link.held.end(), l, l + sizeof length);
+    link.held.insert(link.held.end(), message.begin(), message.end());
+    _stats.messagesHeld++;
+
+    if(link.socket != -1)
+        link.out.control->blocked.store(1);
+}
+
+void ShmMesh::flush()
+{
+    uint64_t now = nowUs();
+
+    for(uint32_t node = 0; node < _links.size(); node++)
+    {
+        Link& link = _links[node];
+        if(! link.linked)
+            continue;
+
+        if(link.dialDueUs != 0 && link.dialDueUs <= now)
+            dial(node);
+
+        if(link.socket == -1)
+            continue;
+
+        if(! link.held.empty())
+            release(link);
+
+        if(link.unsignaled)
+        {
+            link.unsignaled = false;
+            signal(link.wakePeer);
+            _stats.wakeupsSent++;
+        }
+    }
+}
+
+void ShmMesh::handle(const struct epoll_event& event)
+{
+    Tag tag = (Tag) (event.data.u64 >> 32);
+    uint32_t value = (uint32_t) event.data.u64;
+
+    switch(tag)
+    {
+        case TAG_LISTENER:
+            accept();
+            return;
+        case TAG_ACCEPTED:
+            readHello((int) value);
+            return;
+        case TAG_WAKE:
+        {
+            uint64_t signals;
+            if(::read(_links[value].wakeUs, &signals, sizeof signals) == -1 && errno != EAGAIN)
+                log(WARN, "shmmesh: eventfd read: %s\n", strerror(errno));
+            _stats.wakeupsReceived++;
+            return;
+        }
+        case TAG_SOCKET:
+        {
+            // nothing comes over the socket after the hello, it only
+            // becomes readable when the peer goes away
+            char c;
+            ssize_t n = recv(_links[value].socket, &c, 1, MSG_DONTWAIT);
+            if(n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) ||
+               (event.events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)))
+                linkDown(value, "it went away");
+            return;
+        }
+    }
+}
+
+int ShmMesh::read(Chunk* chunks, int budget, int timeoutMs)
+{
+    for(auto& ring : _retired)
+        munmap(ring.mapping, ring.mappingBytes);
+    _retired.clear();
+
+    // the last call's chunks have been handled, their room goes back
+    for(auto& link : _links)
+    {
+        if(link.handedOut == 0)
+            continue;
+
+        Control* control = link.in.control;
+        control->head.store(control->head.load(std::memory_order_relaxed) + link.handedOut,
+                            std::memory_order_release);
+        link.handedOut = 0;
+
+        if(control->blocked.exchange(0))
+        {
+            signal(link.wakePeer);
+            _stats.wakeupsSent++;
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(_epoll, events, MAX_EVENTS, pending()? 0 : timeoutMs);
+    if(ready == -1 && errno != EINTR)
+        log(WARN, "shmmesh: epoll_wait: %s\n", strerror(errno));
+
+    for(int i = 0; i < ready; i++)
+        handle(events[i]);
+
+    int count = 0;
+    for(uint32_t node = 0; node < _links.size() && count < budget; node++)
+    {
+        Link& link = _links[node];
+        if(link.socket == -1)
+            continue;
+
+        Control* control = link.in.control;
+        uint64_t head = control->head.load(std::memory_order_relaxed);
+        uint64_t tail = control->tail.load(std::memory_order_acquire);
+        if(tail == head)
+            continue;
+
+        // the peer writes tail, a corrupt one would have us read past the mapping
+        if(tail - head > link.in.bytes)
+        {
+            linkDown(node, "its ring holds more than fits");
+            continue;
+        }
+
+        // the writer only publishes whole frames
+        chunks[count].sender = node;
+        chunks[count].data = link.in.data + (head & (link.in.bytes - 1));
+        chunks[count].length = tail - head;
+        count++;
+
+        link.handedOut = tail - head;
+        _stats.bytesRead += tail - head;
+    }
+
+    return count;
+}
+
+bool ShmMesh::pending() const
+{
+    for(auto& link : _links)
+    {
+        if(link.socket == -1)
+            continue;
+
+        const Control* control = link.in.control;
+        if(control->tail.load(std::memory_order_acquire) - control->head.load(std::memory_order_relaxed) > link.handedOut)
+            return true;
+    }
+    return false;
+}
+
+long ShmMesh::msUntilNextEvent(bool receiving)
+{
+    if(receiving && pending())
+        return 0;
+
+    uint64_t now = nowUs();
+    long next = -1;
+
+    for(auto& link : _links)
+    {
+        // the reader wakes us when it makes room, this is in case that
+        // raced with us holding back
+        if(link.socket != -1 && ! link.held.empty())
+            next = 1;
+
+        if(link.dialDueUs == 0)
+            continue;
+
+        long ms = (link.dialDueUs <= now)? 0 : (long) ((link.dialDueUs - now + 999) / 1000);
+        if(next == -1 || ms < next)
+            next = ms;
+    }
+
+    return next;
+}
+
+bool ShmMesh::allWritten() const
+{
+    for(auto& link : _links)
+    {
+        if(! link.held.empty())
+            return false;
+    }
+    return true;
+}
+
+void ShmMesh::logStats()
+{
+    log(INFO, "shmmesh: %llu messages queued (%llu held back, %llu dropped), %llu bytes written, %llu read\n",
+        (unsigned long long) _stats.messagesQueued,
+        (unsigned long long) _stats.messagesHeld,
+        (unsigned long long) _stats.messagesDropped,
+        (unsigned long long) _stats.bytesWritten,
+        (unsigned long long) _stats.bytesRead);
+    log(INFO, "shmmesh: %llu wakeups sent, %llu received, %llu links up, %llu down\n",
+        (unsigned long long) _stats.wakeupsSent,
+        (unsigned long long) _stats.wakeupsReceived,
+        (unsigned long long) _stats.links,
+        (unsigned long long) _stats.unlinks);
+
+    for(uint32_t node = 0; node < _links.size(); node++)
+    {
+        const Link& link = _links[node];
+        if(! link.linked)
+            continue;
+
+        log(INFO, "shmmesh: peer %u %s, %u bytes held back\n", node,
+            (link.socket == -1)? "not linked" : "linked", (uint32_t) link.held.size());
+    }
+}
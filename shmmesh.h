@@ -0,0 +1,200 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+Shared-memory rings between replicas on the same machine, for Unicast to
+use instead of the network. Every pair shares a memfd holding one ring per
+direction; a message is copied into the ring once and read in place, and
+an eventfd per direction wakes the reader. The higher id of a pair creates
+the memfd and eventfds and hands them over a unix socket, which stays open
+so either side notices when the other goes away.
+**/
+
+#ifndef SHMMESH_H
+#define SHMMESH_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/epoll.h>
+
+class ShmMesh
+{
+public:
+    // links us (host self) with every node whose entry in linked is set,
+    // meeting them at unix sockets named after port and their id. Each
+    // direction of a link gets a ring of ringBytes.
+    ShmMesh(const std::vector<bool>& linked, int self, uint16_t port, size_t ringBytes = DEFAULT_RING_BYTES);
+    ~ShmMesh();
+
+    static const size_t DEFAULT_RING_BYTES = 4 * 1024 * 1024;
+
+    // readable while read() has something to do, for event loops.
+    int getFd() const {return _epoll;}
+
+    // true if a message can go through a ring at all, bigger ones have to
+    // take another way.
+    bool fits(const std::vector<char> &message) const;
+
+    // copies a framed message into node's ring, or holds it back while
+    // the ring is full or node isn't linked up yet. flush() wakes node.
+    void queue(const uint32_t node, const std::vector<char> &message);
+
+    // wakes whoever was sent something since the last call, moves what
+    // was held back into rings with room and dials whoever is due.
+    void flush();
+
+    // every message waiting in one peer's ring, each a Frame followed by
+    // the message; data is valid until the next call to read().
+    struct Chunk
+    {
+        int sender;
+        char* data;
+        int length;
+    };
+
+    // handles whatever is ready, waiting up to timeoutMs for it unless
+    // something is already waiting, and stores at most budget chunks, one
+    // per peer. Returns the number stored.
+    int read(Chunk* chunks, int budget, int timeoutMs);
+
+    // a ring holds messages read() hasn't handed out.
+    bool pending() const;
+
+    // ms until a peer is due to be dialed or held back messages should be
+    // retried, 0 while something is pending and receiving, -1 if nothing is
+    // waiting.
+    long msUntilNextEvent(bool receiving = true);
+
+    // nothing is held back that isn't in a ring yet.
+    bool allWritten() const;
+
+    void logStats();
+
+private:
+    // the first page of every ring, the data follows it
+    struct Control
+    {
+        alignas(64) std::atomic<uint64_t> head;    // written by the reader
+        alignas(64) std::atomic<uint64_t> tail;    // written by the writer
+        alignas(64) std::atomic<uint32_t> blocked; // the writer is holding messages back for room
+    };
+
+    // one direction, its data mapped twice in a row so a run of messages
+    // that wraps around the end still reads as one piece
+    struct Ring
+    {
+        Control* control;
+        char* data;
+        size_t bytes;       // a power of two
+        char* mapping;      // the whole reservation, for munmap
+        size_t mappingBytes;
+
+        Ring()
+        :control(NULL),
+        data(NULL),
+        bytes(0),
+        mapping(NULL),
+        mappingBytes(0)
+        {}
+    };
+
+    // sent by the side that dials, with the memfd and eventfds attached
+    struct Hello
+    {
+        uint32_t magic;
+        uint32_t node;
+        uint64_t ringBytes;
+    };
+
+    struct Link
+    {
+        bool linked;            // we share memory with this node at all
+        int socket;             // the unix socket the link was set up over, -1 while down
+        Ring out;               // we write, the peer reads
+        Ring in;                // the peer writes, we read
+        int wakePeer;           // eventfd the peer waits on
+        int wakeUs;             // eventfd we wait on
+        bool unsignaled;        // wrote to out since the last wakeup
+        std::vector<char> held; // frames out had no room for
+        size_t handedOut;       // bytes of in the last read() handed out
+        uint64_t dialDueUs;     // when to dial again, 0 if we don't dial
+        uint64_t backoffMs;
+
+        Link()
+        :linked(false),
+        socket(-1),
+        wakePeer(-1),
+        wakeUs(-1),
+        unsignaled(false),
+        handedOut(0),
+        dialDueUs(0),
+        backoffMs(0)
+        {}
+    };
+
+    // what an epoll event is about, in its upper 32 bits
+    enum Tag
+    {
+        TAG_LISTENER = 0,
+        TAG_SOCKET = 1,     // lower bits: the node
+        TAG_WAKE = 2,       // lower bits: the node
+        TAG_ACCEPTED = 3    // lower bits: the fd
+    };
+
+    struct Stats
+    {
+        uint64_t messagesQueued;
+        uint64_t messagesHeld;      // waited for room or for the link
+        uint64_t messagesDropped;   // too much was held back
+        uint64_t bytesWritten;
+        uint64_t bytesRead;
+        uint64_t wakeupsSent;
+        uint64_t wakeupsReceived;
+        uint64_t links;
+        uint64_t unlinks;
+    };
+
+    static uint64_t nowUs();
+    // makes or checks the directory the sockets live in, false if it
+    // isn't ours alone
+    bool privateDir();
+    std::string path(const uint32_t node) const;
+    void watch(int fd, uint32_t events, Tag tag, uint32_t value);
+    // maps one ring of a memfd at offset, false if it couldn't be
+    bool map(Ring& ring, int memfd, off_t offset, size_t bytes);
+    // a memfd a peer handed us holds both rings and can't shrink under them
+    bool sized(int memfd, size_t ringBytes) const;
+    void dial(const uint32_t node);
+    void scheduleDial(const uint32_t node);
+    void accept();
+    void readHello(int fd);
+    // takes the link up over socket with the rings and eventfds given
+    void linkUp(const uint32_t node, int socket, int memfd, bool dialed, int wakePeer, int wakeUs, size_t ringBytes);
+    void linkDown(const uint32_t node, const char* why);
+    // copies a message into node's ring, false if there's no room
+    bool push(Link& link, const char* message, uint32_t length);
+    // moves held back frames into the ring while it has room
+    void release(Link& link);
+    static void signal(int fd);
+    void handle(const struct epoll_event& event);
+
+    std::vector<Link> _links;
+    std::set<int> _accepted;      // connections waiting for their hello
+    std::vector<Ring> _retired;   // mappings of links that went down, unmapped by read()
+    uint32_t _self;
+    uint16_t _port;
+    std::string _socketDir;
+    size_t _ringBytes;
+    size_t _pageBytes;
+    int _listener;
+    int _epoll;
+    Stats _stats;
+};
+
+#endif
@@ -0,0 +1,102 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+A lock-free ring between exactly one producer thread and one consumer
+thread. Slots are allocated once and reused, the producer fills a slot in
+place and publishes it, the consumer reads it in place and releases it.
+**/
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+template <typename T>
+class SpscRing
+{
+public:
+    // capacity is rounded up to a power of two.
+    explicit SpscRing(size_t capacity)
+    :_head(0),
+    _tailCache(0),
+    _tail(0),
+    _headCache(0)
+    {
+        size_t size = 1;
+        while(size < capacity)
+            size <<= 1;
+
+        _slots.resize(size);
+        _mask = size - 1;
+    }
+
+    size_t capacity() const {return _slots.size();}
+
+    // every slot, for setting them up before either thread starts.
+    T& slot(size_t i) {return _slots[i];}
+
+    // producer: the next free slot, NULL if the ring is full. Nothing is
+    // visible to the consumer until publish().
+    T* claim()
+    {
+        size_t tail = _tail.load(std::memory_order_relaxed);
+        if(tail - _headCache == _slots.size())
+        {
+            _headCache = _head.load(std::memory_order_acquire);
+            if(tail - _headCache == _slots.size())
+                return NULL;
+        }
+        return &_slots[tail & _mask];
+    }
+
+    // producer: hands the claimed slot to the consumer.
+    void publish()
+    {
+        _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: the i-th published slot from the front, NULL if there are
+    // not that many.
+    T* peek(size_t i = 0)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+        if(_tailCache - head <= i)
+        {
+            _tailCache = _tail.load(std::memory_order_acquire);
+            if(_tailCache - head <= i)
+                return NULL;
+        }
+        return &_slots[(head + i) & _mask];
+    }
+
+    // consumer: gives the first count slots back to the producer.
+    void release(size_t count = 1)
+    {
+        _head.store(_head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    // either side: how many slots are published, may be stale by the time
+    // it is returned.
+    size_t size() const
+    {
+        return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> _slots;
+    size_t _mask;
+
+    // each side's index and its cached copy of the other's share a cache
+    // line, apart from the other side's.
+    alignas(64) std::atomic<size_t> _head;  // written by the consumer
+    size_t _tailCache;
+    alignas(64) std::atomic<size_t> _tail;  // written by the producer
+    size_t _headCache;
+};
+
+#endif
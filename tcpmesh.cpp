@@ -0,0 +1,678 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+One TCP connection between every pair of replicas.
+**/
+
+#include "tcpmesh.h"
+#include "Debug.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// starts every hello, so strays that happen to dial the port are turned away
+const uint32_t HELLO_MAGIC = 0x50415853;
+
+// bytes queued for one peer before new messages are dropped
+const size_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+// the longest frame we take from a peer, anything longer means the stream is broken
+const uint32_t MAX_FRAME_BYTES = 32 * 1024 * 1024;
+
+// the receive buffer grows by this much, and one peer's stream gives up its
+// turn after this much so it can't keep the others waiting
+const size_t READ_CHUNK_BYTES = 256 * 1024;
+const size_t MAX_READ_BYTES = 4 * 1024 * 1024;
+
+// between dials of a peer that isn't there
+const uint64_t MIN_BACKOFF_MS = 10;
+const uint64_t MAX_BACKOFF_MS = 1000;
+
+// a connection whose peer vanished without a FIN or RST is given up on
+// after unacked data sits this long, or keepalive probes go unanswered
+// this long once it has been idle. Unicast gives a silent peer up as dead
+// on the same scale.
+const unsigned int USER_TIMEOUT_MS = 10000;
+const int KEEPALIVE_IDLE_S = 5;
+const int KEEPALIVE_INTERVAL_S = 1;
+const int KEEPALIVE_PROBES = 5;
+
+// an accepted connection has this long to send its hello
+const uint64_t HELLO_TIMEOUT_US = 5000000;
+
+const int MAX_EVENTS = 64;
+
+TcpMesh::TcpMesh(const struct sockaddr_in* addresses, const std::vector<bool>& linked, int self, uint16_t port)
+:_addresses(addresses, addresses + linked.size()),
+_linked(linked),
+_links(linked.size()),
+_self(self),
+_listener(-1),
+_pending(0),
+_stats()
+{
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(_epoll == -1)
+        log(ERROR, "tcpmesh: epoll_create1: %s\n", strerror(errno));
+
+    struct sockaddr_in any;
+    memset(&any, 0, sizeof any);
+    any.sin_family = AF_INET;
+    any.sin_addr.s_addr = htonl(INADDR_ANY);
+    any.sin_port = htons(port);
+
+    int one = 1;
+    _listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(_listener == -1 ||
+       setsockopt(_listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1 ||
+       bind(_listener, (struct sockaddr*) &any, sizeof any) == -1 ||
+       listen(_listener, SOMAXCONN) == -1)
+    {
+        log(ERROR, "tcpmesh: could not listen on port %u: %s\n", port, strerror(errno));
+    }
+    else
+    {
+        watch(_listener, EPOLLIN, TAG_LISTENER, 0, false);
+    }
+
+    // the higher id of each pair dials
+    for(uint32_t node = 0; node < _self; node++)
+    {
+        if(_linked[node])
+            dial(node);
+    }
+}
+
+TcpMesh::~TcpMesh()
+{
+    for(auto& link : _links)
+    {
+        if(link.fd != -1)
+            close(link.fd);
+    }
+
+    for(auto& accepted : _accepted)
+        close(accepted.first);
+
+    if(_listener != -1)
+        close(_listener);
+    close(_epoll);
+}
+
+uint64_t TcpMesh::nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TcpMesh::configure(int fd)
+{
+    // we batch our own writes, don't hold them back any longer
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    int idle = KEEPALIVE_IDLE_S;
+    int interval = KEEPALIVE_INTERVAL_S;
+    int probes = KEEPALIVE_PROBES;
+    unsigned int timeout = USER_TIMEOUT_MS;
+    if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof probes) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof timeout) == -1)
+    {
+        log(WARN, "tcpmesh: could not set keepalive: %s\n", strerror(errno));
+    }
+}
+
+void TcpMesh::watch(int fd, uint32_t events, Tag tag, uint32_t value, bool modify)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = ((uint64_t) tag << 32) | value;
+
+    if(epoll_ctl(_epoll, modify? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) == -1)
+        log(WARN, "tcpmesh: epoll_ctl: %s\n", strerror(errno));
+}
+
+void TcpMesh::dial(const uint32_t node)
+{
+    Link& link = _links[node];
+    link.dialDueUs = 0;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        log(WARN, "tcpmesh: socket: %s\n", strerror(errno));
+        scheduleDial(node);
+        return;
+    }
+
+    configure(fd);
+
+    if(connect(fd, (const struct sockaddr*) &_addresses[node], sizeof(struct sockaddr_in)) == -1 &&
+       errno != EINPROGRESS)
+    {
+        log(DEBUG, "tcpmesh: could not dial %u: %s\n", node, strerror(errno));
+        close(fd);
+        scheduleDial(node);
+        return;
+    }
+
+    link.fd = fd;
+    link.connecting = true;
+    watch(fd, EPOLLOUT, TAG_LINK, node, false);
+}
+
+void TcpMesh::scheduleDial(const uint32_t node)
+{
+    if(node >= _self)
+        return;
+
+    Link& link = _links[node];
+    link.backoffMs = (link.backoffMs == 0)? MIN_BACKOFF_MS : std::min(link.backoffMs * 2, MAX_BACKOFF_MS);
+    link.dialDueUs = nowUs() + link.backoffMs * 1000;
+}
+
+void TcpMesh::connected(const uint32_t node)
+{
+    Link& link = _links[node];
+    link.connecting = false;
+    link.backoffMs = 0;
+    watch(link.fd, EPOLLIN, TAG_LINK, node, true);
+
+    // ahead of whatever was queued while we weren't connected, nothing of
+    // which went out yet
+    Hello hello = {HELLO_MAGIC, _self};
+    const char* h = (const char*) &hello;
+    link.out.insert(link.out.begin() + link.outSent, h, h + sizeof hello);
+    link.outHello = sizeof hello;
+
+    _stats.connects++;
+    log(INFO, "tcpmesh: connected to %u\n", node);
+    write(node);
+}
+
+void TcpMesh::disconnect(const uint32_t node, const char* why)
+{
+    Link& link = _links[node];
+
+    // TCP did the retransmitting for these, nothing else will
+    uint32_t lost = 0;
+    for(size_t pos = link.outFrame + link.outHello; link.out.size() - pos >= sizeof(uint32_t); lost++)
+    {
+        uint32_t length;
+        memcpy(&length, &link.out[pos], sizeof length);
+        pos += sizeof length + length;
+    }
+    link.messagesLost += lost;
+    _stats.messagesLost += lost;
+
+    log(WARN, "tcpmesh: lost %u (%s), dropping %u unwritten messages (%u bytes), %llu lost to it so far\n",
+        node, why, lost, (uint32_t) (link.out.size() - link.outSent),
+        (unsigned long long) link.messagesLost);
+
+    close(link.fd);
+    link.fd = -1;
+    link.connecting = false;
+    link.watchingOut = false;
+
+    // a frame cut off on the old connection can't be finished on a new one
+    link.out.clear();
+    link.outSent = 0;
+    link.outFrame = 0;
+    link.outHello = 0;
+    link.inEnd = link.inStart + link.handedOut + link.complete;
+
+    _stats.disconnects++;
+    scheduleDial(node);
+}
+
+void TcpMesh::accept()
+{
+    while(true)
+    {
+        int fd = accept4(_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd == -1)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log(WARN, "tcpmesh: accept: %s\n", strerror(errno));
+            return;
+        }
+
+        configure(fd);
+
+        Accepted& accepted = _accepted[fd];
+        accepted.received = 0;
+        accepted.helloDueUs = nowUs() + HELLO_TIMEOUT_US;
+        watch(fd, EPOLLIN, TAG_ACCEPTED, fd, false);
+    }
+}
+
+void TcpMesh::readHello(int fd)
+{
+    auto found = _accepted.find(fd);
+    if(found == _accepted.end())
+        return;
+
+    Accepted& accepted = found->second;
+    ssize_t n = recv(fd, (char*) &accepted.hello + accepted.received,
+                     sizeof(Hello) - accepted.received, MSG_DONTWAIT);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    if(n <= 0)
+    {
+        close(fd);
+        _accepted.erase(found);
+        return;
+    }
+
+    accepted.received += n;
+    if(accepted.received < sizeof(Hello))
+        return;
+
+    Hello hello = accepted.hello;
+    _accepted.erase(found);
+
+    if(hello.magic != HELLO_MAGIC || hello.node >= _links.size() || hello.node <= _self ||
+       ! _linked[hello.node])
+    {
+        log(WARN, "tcpmesh: turning away a connection with a bad hello\n");
+        close(fd);
+        return;
+    }
+
+    // the peer restarted, its old connection is dead even if we hadn't noticed
+    Link& link = _links[hello.node];
+    if(link.fd != -1)
+        disconnect(hello.node, "it connected again");
+
+    link.fd = fd;
+    watch(fd, EPOLLIN, TAG_LINK, hello.node, true);
+
+    _stats.connects++;
+    log(INFO, "tcpmesh: %u connected\n", hello.node);
+    write(hello.node);
+}
+
+void TcpMesh::expireHellos(uint64_t now)
+{
+    for(auto it = _accepted.begin(); it != _accepted.end();)
+    {
+        if(it->second.helloDueUs > now)
+        {
+            ++it;
+            continue;
+        }
+
+        log(WARN, "tcpmesh: turning away a connection that never said hello\n");
+        close(it->first);
+        _stats.helloTimeouts++;
+        it = _accepted.erase(it);
+    }
+}
+
+void TcpMesh::queue(const uint32_t node, const std::vector<char> &message)
+{
+    Link& link = _links[node];
+    uint32_t length = message.size();
+
+    if(link.out.size() - link.outSent + sizeof length + length > MAX_QUEUED_BYTES)
+    {
+        log(WARN, "tcpmesh: %u is too far behind, dropping a message of %u bytes\n", node, length);
+        _stats.messagesDropped++;
+        return;
+    }
+
+    const char* l = (const char*) &length;
+    link.out.insert(link.out.end(), l, l + sizeof length);
+    link.out.insert(link.out.end(), message.begin(), message.end());
+    _stats.messagesQueued++;
+}
+
+void TcpMesh::write(const uint32_t node)
+{
+    Link& link = _links[node];
+    if(link.fd == -1 || link.connecting)
+        return;
+
+    while(link.outSent < link.out.size())
+    {
+        ssize_t n = send(link.fd, &link.out[link.outSent], link.out.size() - link.outSent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        _stats.writeSyscalls++;
+
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                disconnect(node, strerror(errno));
+                return;
+            }
+
+            // the socket is full, pick up where we left off once it drains
+            if(! link.watchingOut)
+            {
+                watch(link.fd, EPOLLIN | EPOLLOUT, TAG_LINK, node, true);
+                link.watchingOut = true;
+            }
+            break;
+        }
+
+        link.outSent += n;
+        _stats.bytesWritten += n;
+    }
+
+    advanceFrames(link);
+
+    if(link.outSent == link.out.size())
+    {
+        link.out.clear();
+        link.outSent = 0;
+        link.outFrame = 0;
+
+        if(link.watchingOut)
+        {
+            watch(link.fd, EPOLLIN, TAG_LINK, node, true);
+            link.watchingOut = false;
+        }
+    }
+    else if(link.outFrame > link.out.size() / 2)
+    {
+        link.out.erase(link.out.begin(), link.out.begin() + link.outFrame);
+        link.outSent -= link.outFrame;
+        link.outFrame = 0;
+    }
+}
+
+void TcpMesh::advanceFrames(Link& link)
+{
+    // the hello has no length in front, it goes first and alone
+    if(link.outHello)
+    {
+        if(link.outSent - link.outFrame < link.outHello)
+            return;
+        link.outFrame += link.outHello;
+        link.outHello = 0;
+    }
+
+    while(link.out.size() - link.outFrame >= sizeof(uint32_t))
+    {
+        uint32_t length;
+        memcpy(&length, &link.out[link.outFrame], sizeof length);
+
+        size_t end = link.outFrame + sizeof length + length;
+        if(end > link.outSent)
+            break;
+        link.outFrame = end;
+    }
+}
+
+void TcpMesh::flush()
+{
+    uint64_t now = nowUs();
+
+    if(! _accepted.empty())
+        expireHellos(now);
+
+    for(uint32_t node = 0; node < _links.size(); node++)
+    {
+        Link& link = _links[node];
+
+        if(link.dialDueUs != 0 && link.dialDueUs <= now)
+            dial(node);
+
+        if(link.outSent < link.out.size() && ! link.watchingOut)
+            write(node);
+    }
+}
+
+bool TcpMesh::receive(const uint32_t node)
+{
+    Link& link = _links[node];
+    size_t read = 0;
+    bool open = true;
+
+    while(read < MAX_READ_BYTES)
+    {
+        // nothing is handed out while we read, so the buffer may move
+        if(link.in.size() - link.inEnd < READ_CHUNK_BYTES)
+        {
+            if(link.inStart > 0)
+            {
+                memmove(&link.in[0], &link.in[link.inStart], link.inEnd - link.inStart);
+                link.inEnd -= link.inStart;
+                link.inStart = 0;
+            }
+
+            if(link.in.size() - link.inEnd < READ_CHUNK_BYTES)
+                link.in.resize(link.inEnd + READ_CHUNK_BYTES);
+        }
+
+        size_t space = link.in.size() - link.inEnd;
+        ssize_t n = recv(link.fd, &link.in[link.inEnd], space, MSG_DONTWAIT);
+        _stats.readSyscalls++;
+
+        if(n == 0)
+        {
+            open = false;
+            break;
+        }
+
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                open = false;
+            break;
+        }
+
+        link.inEnd += n;
+        read += n;
+        _stats.bytesRead += n;
+
+        if((size_t) n < space)
+            break; // drained
+    }
+
+    // whole frames that made it before the connection closed still count
+    return scan(link) && open;
+}
+
+bool TcpMesh::scan(Link& link)
+{
+    size_t before = link.complete;
+    size_t pos = link.inStart + link.handedOut + link.complete;
+
+    while(link.inEnd - pos >= sizeof(uint32_t))
+    {
+        uint32_t length;
+        memcpy(&length, &link.in[pos], sizeof length);
+
+        if(length > MAX_FRAME_BYTES)
+        {
+            log(WARN, "tcpmesh: frame of %u bytes, the stream is broken\n", length);
+            return false;
+        }
+
+        if(link.inEnd - pos - sizeof length < length)
+            break;
+
+        pos += sizeof length + length;
+    }
+
+    link.complete = pos - link.inStart - link.handedOut;
+    if(before == 0 && link.complete > 0)
+        _pending++;
+
+    return true;
+}
+
+void TcpMesh::handle(const struct epoll_event& event)
+{
+    Tag tag = (Tag) (event.data.u64 >> 32);
+    uint32_t value = (uint32_t) event.data.u64;
+
+    switch(tag)
+    {
+        case TAG_LISTENER:
+            accept();
+            return;
+        case TAG_ACCEPTED:
+            readHello((int) value);
+            return;
+        case TAG_LINK:
+            break;
+    }
+
+    Link& link = _links[value];
+    if(link.fd == -1)
+        return;
+
+    if(link.connecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof err;
+        if(getsockopt(link.fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+
+        if(err)
+        {
+            log(DEBUG, "tcpmesh: could not dial %u: %s\n", value, strerror(err));
+            close(link.fd);
+            link.fd = -1;
+            link.connecting = false;
+            scheduleDial(value);
+            return;
+        }
+
+        connected(value);
+        return;
+    }
+
+    if((event.events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && ! receive(value))
+    {
+        disconnect(value, "connection closed");
+        return;
+    }
+
+    if(event.events & EPOLLOUT)
+        write(value);
+}
+
+int TcpMesh::read(Chunk* chunks, int budget, int timeoutMs)
+{
+    // the last call's chunks have been handled
+    for(auto& link : _links)
+    {
+        link.inStart += link.handedOut;
+        link.handedOut = 0;
+        if(link.inStart == link.inEnd)
+            link.inStart = link.inEnd = 0;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(_epoll, events, MAX_EVENTS, (_pending > 0)? 0 : timeoutMs);
+    if(ready == -1 && errno != EINTR)
+        log(WARN, "tcpmesh: epoll_wait: %s\n", strerror(errno));
+
+    for(int i = 0; i < ready; i++)
+        handle(events[i]);
+
+    int count = 0;
+    for(uint32_t node = 0; node < _links.size() && count < budget; node++)
+    {
+        Link& link = _links[node];
+        if(link.complete == 0)
+            continue;
+
+        chunks[count].sender = node;
+        chunks[count].data = &link.in[link.inStart];
+        chunks[count].length = link.complete;
+        count++;
+
+        link.handedOut = link.complete;
+        link.complete = 0;
+        _pending--;
+    }
+
+    return count;
+}
+
+long TcpMesh::msUntilNextEvent(bool receiving)
+{
+    if(receiving && _pending > 0)
+        return 0;
+
+    uint64_t now = nowUs();
+    long next = -1;
+
+    for(auto& link : _links)
+    {
+        if(link.dialDueUs == 0)
+            continue;
+
+        long ms = (link.dialDueUs <= now)? 0 : (long) ((link.dialDueUs - now + 999) / 1000);
+        if(next == -1 || ms < next)
+            next = ms;
+    }
+
+    for(auto& accepted : _accepted)
+    {
+        uint64_t due = accepted.second.helloDueUs;
+        long ms = (due <= now)? 0 : (long) ((due - now + 999) / 1000);
+        if(next == -1 || ms < next)
+            next = ms;
+    }
+
+    return next;
+}
+
+bool TcpMesh::allWritten() const
+{
+    for(auto& link : _links)
+    {
+        if(link.outSent < link.out.size())
+            return false;
+    }
+    return true;
+}
+
+void TcpMesh::logStats()
+{
+    log(INFO, "tcpmesh: %llu messages queued (%llu dropped), %llu bytes written in %llu syscalls, %llu read in %llu\n",
+        (unsigned long long) _stats.messagesQueued,
+        (unsigned long long) _stats.messagesDropped,
+        (unsigned long long) _stats.bytesWritten,
+        (unsigned long long) _stats.writeSyscalls,
+        (unsigned long long) _stats.bytesRead,
+        (unsigned long long) _stats.readSyscalls);
+    log(INFO, "tcpmesh: %llu connects, %llu disconnects (%llu messages lost), %llu hellos timed out\n",
+        (unsigned long long) _stats.connects,
+        (unsigned long long) _stats.disconnects,
+        (unsigned long long) _stats.messagesLost,
+        (unsigned long long) _stats.helloTimeouts);
+
+    for(uint32_t node = 0; node < _links.size(); node++)
+    {
+        if(node == _self || ! _linked[node])
+            continue;
+
+        log(INFO, "tcpmesh: peer %u %s, %u bytes unwritten, %llu messages lost\n", node,
+            (_links[node].fd == -1 || _links[node].connecting)? "not connected" : "connected",
+            (uint32_t) (_links[node].out.size() - _links[node].outSent),
+            (unsigned long long) _links[node].messagesLost);
+    }
+}
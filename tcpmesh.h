@@ -0,0 +1,175 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+One TCP connection between every pair of replicas, for Unicast to run
+over instead of UDP. Messages are framed with a length prefix, queued per
+peer and written in one go per flush; TCP does the acking and
+retransmitting. The higher id of a pair dials, the lower one accepts and
+learns who dialed from a hello that starts every connection.
+**/
+
+#ifndef TCPMESH_H
+#define TCPMESH_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+
+class TcpMesh
+{
+public:
+    // addresses has one entry per host, indexed by id; we are host self
+    // and listen on port, which every host dials the others on. Only
+    // hosts whose entry in linked is set are dialed or accepted.
+    TcpMesh(const struct sockaddr_in* addresses, const std::vector<bool>& linked, int self, uint16_t port);
+    ~TcpMesh();
+
+    // readable while read() or flush() has something to do, for event loops.
+    int getFd() const {return _epoll;}
+
+    // appends a message to node's stream, it is written by flush(). While
+    // node isn't connected messages wait, up to a cap.
+    void queue(const uint32_t node, const std::vector<char> &message);
+
+    // writes what every stream has queued, dials whoever is due and turns
+    // away connections whose hello is overdue.
+    void flush();
+
+    // complete messages read from one peer's stream, each a Frame followed
+    // by the message; data is valid until the next call to read().
+    struct Chunk
+    {
+        int sender;
+        char* data;
+        int length;
+    };
+
+    // handles whatever is ready, waiting up to timeoutMs for it unless
+    // something is already buffered, and stores at most budget chunks,
+    // one per peer. Returns the number stored.
+    int read(Chunk* chunks, int budget, int timeoutMs);
+
+    // complete messages are buffered that read() hasn't handed out.
+    bool pending() const {return _pending > 0;}
+
+    // ms until a peer is due to be dialed again or a hello is overdue, 0
+    // while something is pending and receiving, -1 if nothing is waiting.
+    long msUntilNextEvent(bool receiving = true);
+
+    // nothing is left queued that hasn't been written to its socket.
+    bool allWritten() const;
+
+    void logStats();
+
+private:
+    // every connection starts with this, sent by the side that dialed
+    struct Hello
+    {
+        uint32_t magic;
+        uint32_t node;
+    };
+
+    struct Link
+    {
+        int fd;                 // -1 while there's no connection
+        bool connecting;        // dialed, waiting to hear if it worked
+        bool watchingOut;       // the socket was full, epoll tells us when it isn't
+        std::vector<char> out;  // frames not written yet
+        size_t outSent;         // bytes of out already written
+        size_t outFrame;        // where the first frame not wholly written starts in out
+        size_t outHello;        // bytes at outFrame that are our unframed hello, until it's written
+        uint64_t messagesLost;  // queued but unwritten when a connection went away
+        std::vector<char> in;   // read but not consumed, from inStart to inEnd
+        size_t inStart;
+        size_t inEnd;
+        size_t handedOut;       // bytes from inStart the last read() handed out
+        size_t complete;        // bytes from inStart that are whole frames, not handed out
+        uint64_t dialDueUs;     // when to dial again, 0 if we don't dial
+        uint64_t backoffMs;
+
+        Link()
+        :fd(-1),
+        connecting(false),
+        watchingOut(false),
+        outSent(0),
+        outFrame(0),
+        outHello(0),
+        messagesLost(0),
+        inStart(0),
+        inEnd(0),
+        handedOut(0),
+        complete(0),
+        dialDueUs(0),
+        backoffMs(0)
+        {}
+    };
+
+    // a connection accepted before its hello has arrived
+    struct Accepted
+    {
+        Hello hello;
+        size_t received;
+        uint64_t helloDueUs;    // turned away if the hello isn't in by then
+    };
+
+    // what an epoll event is about, in its upper 32 bits
+    enum Tag
+    {
+        TAG_LISTENER = 0,
+        TAG_LINK = 1,       // lower bits: the node
+        TAG_ACCEPTED = 2    // lower bits: the fd
+    };
+
+    struct Stats
+    {
+        uint64_t messagesQueued;
+        uint64_t messagesDropped;   // the queue was full
+        uint64_t messagesLost;      // unwritten when a connection went away
+        uint64_t helloTimeouts;     // accepted connections that never said hello
+        uint64_t bytesWritten;
+        uint64_t writeSyscalls;
+        uint64_t bytesRead;
+        uint64_t readSyscalls;
+        uint64_t connects;
+        uint64_t disconnects;
+    };
+
+    static uint64_t nowUs();
+    // the socket options every connection gets, dialed or accepted
+    static void configure(int fd);
+    void watch(int fd, uint32_t events, Tag tag, uint32_t value, bool modify);
+    void dial(const uint32_t node);
+    // dials node again after a backoff, if we are the one who dials
+    void scheduleDial(const uint32_t node);
+    void connected(const uint32_t node);
+    void disconnect(const uint32_t node, const char* why);
+    void accept();
+    void readHello(int fd);
+    // closes accepted connections that haven't sent their hello in time
+    void expireHellos(uint64_t now);
+    void write(const uint32_t node);
+    // moves outFrame past the frames written in full
+    static void advanceFrames(Link& link);
+    // reads what the socket has, false if the connection went away
+    bool receive(const uint32_t node);
+    // counts the whole frames buffered, false on one too big to be ours
+    bool scan(Link& link);
+    void handle(const struct epoll_event& event);
+
+    std::vector<struct sockaddr_in> _addresses;
+    std::vector<bool> _linked;
+    std::vector<Link> _links;
+    std::map<int, Accepted> _accepted;
+    uint32_t _self;
+    int _listener;
+    int _epoll;
+    int _pending;   // links with complete frames
+    Stats _stats;
+};
+
+#endif
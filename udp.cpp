@@ -21,6 +21,7 @@ All Rights Reserved
 #include <signal.h>
 
 #include <string>
+#include <vector>
 
 
 // get sockaddr, IPv4 or IPv6:
@@ -46,20 +47,20 @@ std::string UDP::getHuman(struct sockaddr *sa)
 }
 
 
-int UDP::server(int portnumber)
+int UDP::server(int portnumber, bool reusePort)
 {
     // Set hints
     struct addrinfo hints;
     memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_UNSPEC; // set to AF_INET to force IPv4
+    hints.ai_family = AF_INET; // peers are resolved as IPv4 and sent to from this socket
     hints.ai_socktype = SOCK_DGRAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
 
     // Get possible binding points
     struct addrinfo *servinfo; // the place to store the addresses possible
-    const char* service = std::to_string(portnumber).c_str();
-    int ret = getaddrinfo(NULL, service, &hints, &servinfo);
+    std::string service = std::to_string(portnumber);
+    int ret = getaddrinfo(NULL, service.c_str(), &hints, &servinfo);
     if (ret != 0)
     {
         log(ERROR, "get address error %s\n", gai_strerror(ret));
@@ -76,6 +77,13 @@ int UDP::server(int portnumber)
             continue;
         }
 
+        int one = 1;
+        if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == -1) {
+            log(ERROR, "SO_REUSEPORT: %s\n", strerror(errno));
+            close(sockfd);
+            continue;
+        }
+
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
             close(sockfd);
             continue;
@@ -94,51 +102,87 @@ int UDP::server(int portnumber)
     return sockfd;
 }
 
-// Stolen/Modified from Beej's Guide To Networking
-int UDP::send(const char* address, const int port, const char* buffer, const int bytes)
+int UDP::send(int sockfd, const struct sockaddr_in& address, const char* buffer, const int bytes)
 {
-    int sockfd;
-    struct addrinfo hints, *servinfo, *p;
-
+    if (sendto(sockfd, buffer, bytes, 0, (const struct sockaddr*) &address, sizeof address) == -1)
+    {
+        log(ERROR, "sendto error: %s\n", strerror(errno));
+        return 1;
+    }
 
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
+    return 0;
+}
 
-    const char* service = std::to_string(port).c_str();
-    int rv = getaddrinfo(address, service, &hints, &servinfo);
-    if (rv != 0)
+int UDP::send(int sockfd, const struct sockaddr_in& address, const struct iovec* iov, const int iovcnt)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_name = (void*) &address;
+    msg.msg_namelen = sizeof address;
+    msg.msg_iov = (struct iovec*) iov;
+    msg.msg_iovlen = iovcnt;
+
+    if (sendmsg(sockfd, &msg, 0) == -1)
     {
-        log(ERROR, "get address info: %s\n", gai_strerror(rv));
+        log(ERROR, "sendmsg error: %s\n", strerror(errno));
         return 1;
     }
 
-    // loop through all the results and make a socket
-    for(p = servinfo; p != NULL; p = p->ai_next)
+    return 0;
+}
+
+int UDP::sendBatch(int sockfd, const struct sockaddr_in* addresses, const int count,
+                   const char* headers, const int headerBytes,
+                   const char* buffer, const int bytes)
+{
+    std::vector<struct iovec> payloads(count);
+    for(int i = 0; i < count; i++)
     {
-        if ((sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+        payloads[i].iov_base = (void*) buffer; // shared by every destination
+        payloads[i].iov_len = bytes;
+    }
+
+    return sendEach(sockfd, addresses, count, headers, headerBytes, &payloads[0]);
+}
+
+int UDP::sendEach(int sockfd, const struct sockaddr_in* addresses, const int count,
+                  const char* headers, const int headerBytes,
+                  const struct iovec* payloads)
+{
+    struct mmsghdr msgs[BATCH_MAX];
+    struct iovec iov[BATCH_MAX][2];
+    int syscalls = 0;
+    int sent = 0;
+
+    while(sent < count)
+    {
+        int batch = (count - sent < BATCH_MAX) ? count - sent : BATCH_MAX;
+        memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+
+        for(int i = 0; i < batch; i++)
         {
-            log(ERROR, "socket\n");
-            continue;
+            iov[i][0].iov_base = (void*) &headers[(sent + i) * headerBytes];
+            iov[i][0].iov_len = headerBytes;
+            iov[i][1] = payloads[sent + i];
+
+            msgs[i].msg_hdr.msg_name = (void*) &addresses[sent + i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov = iov[i];
+            msgs[i].msg_hdr.msg_iovlen = (payloads[sent + i].iov_len > 0)? 2 : 1;
         }
 
-        break;
-    }
+        int ret = sendmmsg(sockfd, msgs, batch, 0);
+        syscalls++;
 
-    if (p == NULL)
-    {
-        log(ERROR, "failed to bind socket\n");
-        return 1;
-    }
+        if(ret <= 0)
+        {
+            // the entry at the front failed, skip it and keep going.
+            log(ERROR, "sendmmsg error: %s\n", strerror(errno));
+            ret = 1;
+        }
 
-    if (sendto(sockfd, buffer, bytes, 0, p->ai_addr, p->ai_addrlen) == -1)
-    {
-        log(ERROR, "sendto error\n");
-        return 1;
+        sent += ret;
     }
 
-    freeaddrinfo(servinfo);
-    close(sockfd);
-
-    return 0;
+    return syscalls;
 }
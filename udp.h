@@ -8,6 +8,8 @@ All Rights Reserved
 
 #include <functional>
 #include <string>
+#include <netinet/in.h>
+#include <sys/uio.h>
 
 
 class UDP
@@ -18,18 +20,51 @@ class UDP
     /**
      * starts a UDP client on the given port
      * @param portnumber - the number of the port to listen on
+     * @param reusePort - set SO_REUSEPORT, so every socket opened with it
+     *                    on the port shares the datagrams that arrive
      *
      * @return - something on failure, an fd on success.
      **/
-    static int server(int portnumber);
+    static int server(int portnumber, bool reusePort = false);
 
     /**
-     * Sends a single datagram socket to the given address from the buffer
-     * for the given number of bytes.
+     * Sends a single datagram over the given (already bound) socket to the
+     * given pre-resolved address from the buffer for the given number of
+     * bytes.
      *
      * @return 0 on success, anything else on failure.
      **/
-    static int send(const char* address, const int port, const char* buffer, const int bytes);
+    static int send(int sockfd, const struct sockaddr_in& address, const char* buffer, const int bytes);
+
+    /**
+     * Like send, but gathers the datagram from the given iovecs.
+     **/
+    static int send(int sockfd, const struct sockaddr_in& address, const struct iovec* iov, const int iovcnt);
+
+    /**
+     * Sends the same payload to each of the given addresses, prefixed with
+     * that destination's headerBytes long entry of headers. Every entry
+     * points at the one payload buffer and the whole fan-out is handed to
+     * the kernel with sendmmsg, one call per BATCH_MAX destinations unless
+     * an entry fails.
+     *
+     * @return the number of syscalls made.
+     **/
+    static int sendBatch(int sockfd, const struct sockaddr_in* addresses, const int count,
+                         const char* headers, const int headerBytes,
+                         const char* buffer, const int bytes);
+
+    /**
+     * Like sendBatch, but every destination gets its own payload, the
+     * datagram to addresses[i] is its header followed by payloads[i].
+     *
+     * @return the number of syscalls made.
+     **/
+    static int sendEach(int sockfd, const struct sockaddr_in* addresses, const int count,
+                        const char* headers, const int headerBytes,
+                        const struct iovec* payloads);
+
+    static const int BATCH_MAX = 64;
 
     static void *get_in_addr(struct sockaddr *sa);
 
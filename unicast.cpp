@@ -13,6 +13,8 @@ Provides a UDP based unicast service.
 #include "Debug.hpp"
 
 #include <arpa/inet.h>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <string>
 
@@ -25,6 +27,7 @@ Provides a UDP based unicast service.
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -32,180 +35,1795 @@ Provides a UDP based unicast service.
 #include <signal.h>
 
 const int MAX_UDP_PACKET_SIZE_BYTES = 65507;
+const int Unicast::RECV_BATCH_SIZE;
+const uint32_t Unicast::DEFAULT_COALESCE_BYTES;
+const uint32_t Unicast::FRAME_FRAGMENT;
+
+// retransmission timeout bounds and clock granularity, in us
+const uint64_t MIN_RTO_US = 1000;
+const uint64_t MAX_RTO_US = 4000000;
+const uint64_t CLOCK_GRANULARITY_US = 100;
+const uint32_t MAX_BACKOFF_SHIFT = 12;
+
+// a peer that hasn't acked a datagram sent this many times, the first of
+// them at least MIN_DEAD_US ago, is dead. The count alone isn't enough, on a
+// fast link ten doubling timeouts from MIN_RTO_US are gone in about a second.
+const uint32_t MAX_TRANSMISSIONS = 10;
+const uint64_t MIN_DEAD_US = 10000000;
+// payload bytes queued for one peer before the oldest is given up on, room
+// for every fragment of the largest message we reassemble.
+const uint64_t MAX_QUEUED_BYTES = 64 * 1024 * 1024;
+
+// the largest fragmented message we put back together, and how many a peer
+// may have partly received before the oldest is given up on
+const uint32_t MAX_REASSEMBLED_BYTES = Unicast::MAX_MESSAGE_BYTES;
+const size_t MAX_REASSEMBLING = 8;
+// completed ids remembered per peer to drop resent fragments of
+const size_t MAX_REASSEMBLED_IDS = 1024;
+// the most seqs past a peer's oldest unacked one DATA goes out to, the
+// receiver only tracks (and sacks) 64 past its cumulative ack.
+const uint32_t MAX_WINDOW = 64;
+// congestion window bounds, in datagrams
+const uint32_t INITIAL_WINDOW = 16;
+const uint32_t MIN_WINDOW = 4;
+// the pacer lets this many datagrams, or a timer tick's worth, go at once
+const uint32_t PACING_BURST = 4;
+const uint64_t TIMER_GRANULARITY_US = 1000;
+// bytes of retransmissions, queued DATA and fragments a peer gets to send
+// per round of retransmit() or flushMessages(), so one with a backlog only
+// takes its turn on the socket
+const uint64_t SEND_QUANTUM_BYTES = 16 * 1024;
+
+Unicast::Unicast(const char* hostfile, uint32_t portNumber, uint32_t retransmit_time_ms, uint32_t ackDelayMs,
+                 uint32_t coalesceBytes, uint32_t coalesceDelayMs, Transport transport, bool uring, int recvShards)
+:IPLookup(hostfile, portNumber),
+_port(portNumber),
+_stats(),
+_recvBuffers(RECV_BATCH_SIZE * MAX_UDP_PACKET_SIZE_BYTES),
+_recvTimeoutMs(-1)
+{
+    _socket = UDP::server(portNumber, recvShards > 1);
+    if(recvShards > 1)
+    {
+        _shards.reset(new RecvShards(_socket, recvShards, portNumber, addresses(), getNumberOfHosts(),
+                                     MAX_UDP_PACKET_SIZE_BYTES));
+        if(_shards->usable())
+        {
+            _shardDatagrams.resize(RECV_BATCH_SIZE);
+        }
+        else
+        {
+            log(WARN, "receive shards are unavailable, reading the socket here\n");
+            _shards.reset();
+        }
+    }
+    if(uring)
+    {
+        _uring.reset(new Uring(_socket, MAX_UDP_PACKET_SIZE_BYTES));
+        if(_uring->usable())
+        {
+            _ringDatagrams.resize(RECV_BATCH_SIZE);
+        }
+        else
+        {
+            log(WARN, "io_uring is unavailable, using sendmmsg and recvmmsg\n");
+            _uring.reset();
+        }
+    }
+    _filler = std::make_shared<const std::vector<char> >();
+    _peers.resize(getNumberOfHosts());
+    _unacked = 0;
+
+    // what each host's line says, or the default; both ends of a pair
+    // come to the same answer from the same two lines
+    const char* names[] = {"udp", "tcp", "shm"};
+    std::vector<std::string> entries(getNumberOfHosts());
+    for(int i = 0; i < getNumberOfHosts(); i++)
+    {
+        entries[i] = transportForId(i);
+        if(entries[i].empty())
+            entries[i] = names[transport];
+
+        if(entries[i] != "udp" && entries[i] != "tcp" && entries[i].compare(0, 3, "shm") != 0)
+        {
+            log(WARN, "unknown transport %s for host %d, using %s\n", entries[i].c_str(), i, names[transport]);
+            entries[i] = names[transport];
+        }
+    }
+
+    std::vector<bool> tcp(getNumberOfHosts(), false);
+    std::vector<bool> shm(getNumberOfHosts(), false);
+    const std::string& ours = entries[localhost()];
+    _transports.resize(getNumberOfHosts(), TRANSPORT_UDP);
+    _udp = false;
+
+    for(int i = 0; i < getNumberOfHosts(); i++)
+    {
+        if(i == localhost())
+            continue;
+
+        if(ours.compare(0, 3, "shm") == 0 && entries[i] == ours)
+            _transports[i] = TRANSPORT_SHM;
+        else if(ours == "tcp" || entries[i] == "tcp")
+            _transports[i] = TRANSPORT_TCP;
+
+        tcp[i] = _transports[i] == TRANSPORT_TCP;
+        shm[i] = _transports[i] == TRANSPORT_SHM;
+
+        if(_transports[i] == TRANSPORT_UDP)
+            _udp = true;
+        else
+            log(INFO, "reaching host %d over %s\n", i, names[_transports[i]]);
+    }
+    _broadcastHeaders.resize(getNumberOfHosts());
+    _ackDelayUs = ackDelayMs * 1000ULL;
+    _coalesceBytes = coalesceBytes;
+    _fragmentBytes = (coalesceBytes > DEFAULT_COALESCE_BYTES)? coalesceBytes : DEFAULT_COALESCE_BYTES;
+    _nextFragmented = 0;
+    _coalesceDelayUs = coalesceDelayMs * 1000ULL;
+    _flushHeaders.resize(getNumberOfHosts());
+    _flushAddresses.resize(getNumberOfHosts());
+    _flushPayloads.resize(getNumberOfHosts());
+    _nextRound = 0;
+    _queuedHeaders.resize(MAX_WINDOW);
+    _queuedPayloads.resize(MAX_WINDOW);
+
+    for(auto& peer : _peers)
+    {
+        peer.rto = retransmit_time_ms * 1000ULL;
+        resetWindow(peer);
+    }
+
+    _poll = -1;
+    if(std::find(tcp.begin(), tcp.end(), true) != tcp.end())
+    {
+        _mesh.reset(new TcpMesh(addresses(), tcp, localhost(), portNumber));
+        _chunks.resize(RECV_BATCH_SIZE);
+    }
+
+    if(std::find(shm.begin(), shm.end(), true) != shm.end())
+    {
+        _shm.reset(new ShmMesh(shm, localhost(), portNumber));
+        _shmChunks.resize(RECV_BATCH_SIZE);
+
+        // messages too big for a ring go over UDP in fragments
+        _udp = true;
+    }
+
+    if(_mesh || _shm)
+    {
+        _poll = epoll_create1(EPOLL_CLOEXEC);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = 0;
+        if(_poll == -1 ||
+           (_udp && epoll_ctl(_poll, EPOLL_CTL_ADD, (_shards)? _shards->getFd() : (_uring)? _uring->getFd() : _socket, &event) == -1) ||
+           (_mesh && epoll_ctl(_poll, EPOLL_CTL_ADD, _mesh->getFd(), &event) == -1) ||
+           (_shm && epoll_ctl(_poll, EPOLL_CTL_ADD, _shm->getFd(), &event) == -1))
+        {
+            log(ERROR, "could not poll the transports together: %s\n", strerror(errno));
+        }
+    }
+
+    // wall clock ms, so a restart always comes up with a later epoch and
+    // peers can tell it apart from late datagrams of our last run.
+    _epoch = (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    if(_epoch == 0)
+        _epoch = 1;
+}
+
+uint64_t Unicast::nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Unicast::sampleRtt(Peer& peer, uint64_t rttUs)
+{
+    _stats.rttSamples++;
+
+    if(peer.srtt == 0)
+    {
+        peer.srtt = rttUs;
+        peer.rttvar = rttUs / 2;
+    }
+    else
+    {
+        uint64_t delta = (peer.srtt > rttUs)? peer.srtt - rttUs : rttUs - peer.srtt;
+        peer.rttvar = (3 * peer.rttvar + delta) / 4;
+        peer.srtt = (7 * peer.srtt + rttUs) / 8;
+    }
+
+    // the peer may hold its ack for up to the ack delay, that's part of the
+    // round trip it measures already.
+    uint64_t variance = 4 * peer.rttvar;
+    peer.rto = peer.srtt + ((variance > CLOCK_GRANULARITY_US)? variance : CLOCK_GRANULARITY_US);
+
+    if(peer.rto < MIN_RTO_US)
+        peer.rto = MIN_RTO_US;
+    if(peer.rto > MAX_RTO_US)
+        peer.rto = MAX_RTO_US;
+}
+
+uint64_t Unicast::deadline(const Peer& peer, uint32_t transmissions, uint64_t now)
+{
+    // double the timeout for every time the datagram already went out
+    uint32_t shift = transmissions - 1;
+    if(shift > MAX_BACKOFF_SHIFT)
+        shift = MAX_BACKOFF_SHIFT;
+
+    uint64_t timeout = peer.rto << shift;
+    if(timeout > MAX_RTO_US)
+        timeout = MAX_RTO_US;
+
+    return now + timeout;
+}
+
+bool Unicast::admit(const Peer& peer) const
+{
+    return peer.unsent == 0 && peer.inFlight < peer.cwnd && peer.outstanding.size() < MAX_WINDOW;
+}
+
+bool Unicast::pace(Peer& peer, uint64_t now)
+{
+    if(peer.srtt == 0)
+        return true;
+
+    // a window per round trip
+    uint64_t interval = peer.srtt / peer.cwnd;
+    uint64_t burst = PACING_BURST * interval;
+    if(burst < TIMER_GRANULARITY_US)
+        burst = TIMER_GRANULARITY_US;
+
+    // what an idle spell saved up only goes so far
+    if(peer.paceUs + burst < now)
+        peer.paceUs = now - burst;
+
+    if(peer.paceUs > now)
+    {
+        _stats.pacingDelays++;
+        return false;
+    }
+
+    peer.paceUs += interval;
+    return true;
+}
+
+void Unicast::congested(Peer& peer, bool timeout)
+{
+    if(timeout)
+        _stats.timeouts++;
+
+    // once per window, the losses of one burst are one event. The cut is
+    // to 7/10 (CUBIC's) rather than half, and a timeout doesn't start over
+    // from the bottom as TCP would: on a LAN a loss is more often noise or
+    // a lost tail than a queue that won't drain.
+    if(peer.recovering)
+        return;
+
+    uint32_t cut = peer.cwnd * 7 / 10;
+    peer.ssthresh = (cut > MIN_WINDOW)? cut : MIN_WINDOW;
+    peer.cwnd = peer.ssthresh;
+    peer.windowCredit = 0;
+    peer.recovering = true;
+    peer.recoverySeq = peer.nextSeq - 1;
+    _stats.lossEvents++;
+}
+
+void Unicast::opened(Peer& peer, uint32_t ack, uint32_t acked)
+{
+    if(peer.recovering)
+    {
+        if((int32_t)(ack - peer.recoverySeq) < 0)
+            return;
+        peer.recovering = false;
+    }
+
+    if(peer.cwnd < peer.ssthresh)
+    {
+        peer.cwnd += acked;
+    }
+    else
+    {
+        peer.windowCredit += acked;
+        while(peer.windowCredit >= peer.cwnd)
+        {
+            peer.windowCredit -= peer.cwnd;
+            peer.cwnd++;
+        }
+    }
+
+    if(peer.cwnd > MAX_WINDOW)
+        peer.cwnd = MAX_WINDOW;
+}
+
+void Unicast::resetWindow(Peer& peer)
+{
+    peer.cwnd = INITIAL_WINDOW;
+    peer.ssthresh = MAX_WINDOW;
+    peer.windowCredit = 0;
+    peer.inFlight = 0;
+    peer.unsent = 0;
+    peer.recovering = false;
+    peer.recoverySeq = 0;
+}
+
+bool Unicast::spend(Peer& peer, size_t bytes)
+{
+    if(bytes > peer.deficit)
+    {
+        _stats.quantumsUsedUp++;
+        return false;
+    }
+
+    peer.deficit -= bytes;
+    return true;
+}
+
+bool Unicast::queuedReady(const Peer& peer) const
+{
+    return peer.unsent > 0 && peer.inFlight < peer.cwnd &&
+           peer.outstanding.size() - peer.unsent < MAX_WINDOW;
+}
+
+bool Unicast::sendQueued(const uint32_t node)
+{
+    Peer& peer = _peers[node];
+    uint64_t now = nowUs();
+    int count = 0;
+    bool starved = false;
+
+    while(queuedReady(peer) && count < (int) MAX_WINDOW)
+    {
+        Outstanding& entry = peer.outstanding[peer.outstanding.size() - peer.unsent];
+        if(! spend(peer, entry.payload->size()))
+        {
+            starved = true;
+            break;
+        }
+        if(! pace(peer, now))
+        {
+            peer.deficit += entry.payload->size();
+            break;
+        }
+
+        entry.transmissions = 1;
+        entry.sentUs = now;
+        entry.firstSentUs = now;
+        entry.deadlineUs = deadline(peer, entry.transmissions, now);
+        if(entry.deadlineUs < peer.nextDeadlineUs)
+            peer.nextDeadlineUs = entry.deadlineUs;
+        peer.unsent--;
+        peer.inFlight++;
+
+        _queuedHeaders[count].kind = DATAGRAM_DATA;
+        _queuedHeaders[count].seq = entry.seq;
+        stamp(node, _queuedHeaders[count]);
+        _queuedPayloads[count].iov_base = (void*) &(*entry.payload)[0];
+        _queuedPayloads[count].iov_len = entry.payload->size();
+        count++;
+    }
+
+    if(count == 0)
+        return starved;
+
+    std::vector<struct sockaddr_in> addresses(count, addressForId(node));
+    int syscalls = sendEach(&addresses[0], count, &_queuedHeaders[0], &_queuedPayloads[0]);
+
+    _stats.sendSyscalls += syscalls;
+    _stats.datagramsSent += count;
+    return starved;
+}
+
+void Unicast::stamp(const uint32_t node, Header& header)
+{
+    Peer& peer = _peers[node];
+
+    header.epoch = _epoch;
+    header.base = (peer.outstanding.empty())? peer.nextSeq : peer.outstanding.front().seq;
+
+    header.ackEpoch = peer.recvEpoch;
+    header.ack = peer.cumulative;
+    header.sack = peer.received;
+
+    if(peer.ackPending && header.kind != DATAGRAM_ACK)
+        _stats.acksPiggybacked++;
+
+    peer.ackPending = false;
+}
+
+void Unicast::send(const uint32_t node, Header& header, const char* buffer, const int bytes)
+{
+    stamp(node, header);
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void*) &header;
+    iov[0].iov_len = sizeof header;
+    iov[1].iov_base = (void*) buffer;
+    iov[1].iov_len = bytes;
+
+    _stats.datagramsSent++;
+    if(_uring)
+    {
+        _stats.sendSyscalls += _uring->send(addressForId(node), iov, (bytes > 0)? 2 : 1);
+        return;
+    }
+
+    _stats.sendSyscalls++;
+    UDP::send(_socket, addressForId(node), iov, (bytes > 0)? 2 : 1);
+}
+
+void Unicast::logStats()
+{
+    log(INFO, "unicast: %llu messages (%llu broadcasts) in %llu datagrams (%.2f per datagram) in %llu syscalls\n",
+        (unsigned long long) _stats.messagesSent,
+        (unsigned long long) _stats.broadcasts,
+        (unsigned long long) _stats.datagramsSent,
+        _stats.datagramsSent ? (double) _stats.messagesSent / _stats.datagramsSent : 0.0,
+        (unsigned long long) _stats.sendSyscalls);
+    log(INFO, "unicast: %llu datagrams received in %llu syscalls (%.2f per syscall)\n",
+        (unsigned long long) _stats.datagramsReceived,
+        (unsigned long long) _stats.recvSyscalls,
+        _stats.recvSyscalls ? (double) _stats.datagramsReceived / _stats.recvSyscalls : 0.0);
+    log(INFO, "unicast: %llu acks sent (%llu bytes), %llu piggybacked, %llu received, %llu duplicates dropped, %u messages unacked\n",
+        (unsigned long long) _stats.acksSent,
+        (unsigned long long) _stats.ackBytesSent,
+        (unsigned long long) _stats.acksPiggybacked,
+        (unsigned long long) _stats.acksReceived,
+        (unsigned long long) _stats.duplicatesDropped,
+        _unacked);
+    log(INFO, "unicast: %llu retransmissions, %llu rtt samples, %llu superseded, %llu abandoned, %llu peers declared dead\n",
+        (unsigned long long) _stats.retransmissions,
+        (unsigned long long) _stats.rttSamples,
+        (unsigned long long) _stats.superseded,
+        (unsigned long long) _stats.abandoned,
+        (unsigned long long) _stats.peersDeclaredDead);
+    log(INFO, "unicast: %llu datagrams waited for the window, pacer held back %llu times, %llu losses, %llu timeouts\n",
+        (unsigned long long) _stats.windowDeferred,
+        (unsigned long long) _stats.pacingDelays,
+        (unsigned long long) _stats.lossEvents,
+        (unsigned long long) _stats.timeouts);
+    log(INFO, "unicast: peers had more to send than their quantum %llu times\n",
+        (unsigned long long) _stats.quantumsUsedUp);
+    log(INFO, "unicast: %llu messages delivered to ourselves without the network\n",
+        (unsigned long long) _stats.loopbackDelivered);
+    log(INFO, "unicast: %llu messages sent in %llu fragments, %llu reassembled, %llu reassemblies dropped\n",
+        (unsigned long long) _stats.fragmented,
+        (unsigned long long) _stats.fragmentsSent,
+        (unsigned long long) _stats.reassembled,
+        (unsigned long long) _stats.reassemblyDropped);
+
+    if(_uring)
+        _uring->logStats();
+    if(_shards)
+        _shards->logStats();
+    if(_mesh)
+        _mesh->logStats();
+    if(_shm)
+        _shm->logStats();
+
+    for(uint32_t node = 0; node < _peers.size(); node++)
+    {
+        if((int) node == localhost() || _transports[node] == TRANSPORT_TCP)
+            continue;
+
+        const Peer& peer = _peers[node];
+        log(INFO, "unicast: peer %u srtt %.3f ms rttvar %.3f ms rto %.3f ms, %u outstanding (%llu bytes)%s\n",
+            node, peer.srtt / 1000.0, peer.rttvar / 1000.0,
+            peer.rto / 1000.0, (uint32_t) peer.outstanding.size(),
+            (unsigned long long) peer.queuedBytes,
+            peer.dead ? ", dead" : "");
+        log(INFO, "unicast: peer %u window %u ssthresh %u, %u in flight, %u waiting%s\n",
+            node, peer.cwnd, peer.ssthresh, peer.inFlight, peer.unsent,
+            peer.recovering ? ", recovering" : "");
+    }
+}
+
+void Unicast::retransmit()
+{
+    // retransmit the things that have not gotten an ack in time
+
+    uint64_t now = nowUs();
+    uint32_t first = _nextRound++;
+
+    for(uint32_t i = 0; i < _peers.size(); i++)
+    {
+        uint32_t node = (first + i) % _peers.size();
+        Peer& peer = _peers[node];
+
+        if(peer.nextDeadlineUs > now)
+            continue;
+
+        peer.nextDeadlineUs = UINT64_MAX;
+        peer.deficit += SEND_QUANTUM_BYTES;
+        bool timedOut = false;
+        bool starved = false;
+
+        for(auto& it : peer.outstanding)
+        {
+            // the rest waits for the window, it never went out
+            if(it.transmissions == 0)
+                break;
+
+            if(it.acked)
+                continue;
+
+            if(it.deadlineUs <= now)
+            {
+                if(it.transmissions >= MAX_TRANSMISSIONS &&
+                   now - it.firstSentUs >= MIN_DEAD_US)
+                {
+                    declareDead(node);
+                    break;
+                }
+
+                // handleAck already cut the window for a hole
+                if(! it.hole && ! timedOut)
+                {
+                    congested(peer, true);
+                    timedOut = true;
+                }
+
+                // the rest goes out in later rounds, the other peers get
+                // their turn first
+                if(! spend(peer, it.payload->size()))
+                {
+                    peer.nextDeadlineUs = now;
+                    starved = true;
+                    break;
+                }
+
+                // and as the pacer allows, not all at once
+                if(! pace(peer, now))
+                {
+                    peer.deficit += it.payload->size();
+                    peer.nextDeadlineUs = peer.paceUs;
+                    break;
+                }
+
+                //log(DEBUG, "retransmitting %d to %d\n", it.seq, node);
+
+                it.transmissions++;
+                it.sentUs = now;
+                it.deadlineUs = deadline(peer, it.transmissions, now);
+                it.hole = false;
+                _stats.retransmissions++;
+
+                Header header = {DATAGRAM_DATA};
+                header.seq = it.seq;
+                send(node, header, &(*it.payload)[0], it.payload->size());
+            }
+
+            if(it.deadlineUs < peer.nextDeadlineUs)
+                peer.nextDeadlineUs = it.deadlineUs;
+        }
+
+        // what isn't used on a backlog carries over, nothing else does
+        if(! starved)
+            peer.deficit = 0;
+    }
+}
+
+void Unicast::reliableSend(const uint32_t node, const std::vector<char> &message, const uint32_t replaces)
+{
+    if((int) node == localhost())
+    {
+        loopback(message);
+        return;
+    }
+
+    //log(DEBUG, "doing reliable send to %d of size %d\n", node, message.size());
+
+    if(! viaUdp(node, message))
+    {
+        sendDirect(node, message);
+        return;
+    }
+
+    // a fragmented message can't be superseded, it has no one datagram
+    if(replaces == 0 || ! fits(message))
+    {
+        coalesce(node, message);
+        return;
+    }
+
+    // alone in its datagram so a newer one can supersede it, after what
+    // was coalesced before it.
+    flushPeer(node);
+    sendPayload(node, frame(message), replaces);
+    _stats.messagesSent++;
+}
+
+uint32_t Unicast::queueForRetransmit(const uint32_t node, const Payload& payload, const uint32_t replaces,
+                                     bool sent)
+{
+    Peer& peer = _peers[node];
+
+    if(replaces != 0 && ! peer.outstanding.empty())
+    {
+        auto old = peer.replaceable.find(replaces);
+        uint32_t index = (old == peer.replaceable.end())? UINT32_MAX : old->second - peer.outstanding.front().seq;
+
+        // the seq can't be skipped, the peer would wait for it; a filler
+        // without a message takes its place.
+        if(index < peer.outstanding.size() &&
+           ! peer.outstanding[index].acked &&
+           peer.outstanding[index].replaces == replaces)
+        {
+            Outstanding& obsolete = peer.outstanding[index];
+            peer.queuedBytes -= obsolete.payload->size();
+            obsolete.payload = _filler;
+            obsolete.replaces = 0;
+            _stats.superseded++;
+        }
+    }
+
+    Outstanding entry;
+    entry.seq = peer.nextSeq++;
+    entry.payload = payload;
+    entry.acked = false;
+    entry.replaces = replaces;
+    entry.hole = false;
+
+    if(sent)
+    {
+        entry.transmissions = 1;
+        entry.sentUs = nowUs();
+        entry.firstSentUs = entry.sentUs;
+        entry.deadlineUs = deadline(peer, entry.transmissions, entry.sentUs);
+        peer.inFlight++;
+
+        if(entry.deadlineUs < peer.nextDeadlineUs)
+            peer.nextDeadlineUs = entry.deadlineUs;
+    }
+    else
+    {
+        // sendQueued stamps it when the window has room
+        entry.transmissions = 0;
+        entry.sentUs = 0;
+        entry.firstSentUs = 0;
+        entry.deadlineUs = UINT64_MAX;
+        peer.unsent++;
+        _stats.windowDeferred++;
+    }
+
+    if(replaces != 0)
+        peer.replaceable[replaces] = entry.seq;
+
+    peer.outstanding.push_back(entry);
+    peer.queuedBytes += payload->size();
+    _unacked++;
+
+    // the header's base tells the peer not to wait for what we drop here.
+    while(peer.queuedBytes > MAX_QUEUED_BYTES && peer.outstanding.size() > 1)
+        abandonFront(peer);
+
+    return entry.seq;
+}
+
+void Unicast::abandonFront(Peer& peer)
+{
+    Outstanding& entry = peer.outstanding.front();
+
+    if(! entry.acked)
+    {
+        peer.queuedBytes -= entry.payload->size();
+        _unacked--;
+        _stats.abandoned++;
+
+        if(entry.transmissions == 0)
+            peer.unsent--;
+        else
+            peer.inFlight--;
+    }
+
+    peer.outstanding.pop_front();
+}
+
+void Unicast::declareDead(const uint32_t node)
+{
+    Peer& peer = _peers[node];
+
+    log(WARN, "peer %d stopped acking, dropping %d queued messages until we hear from it\n",
+        node, (int) peer.outstanding.size());
+
+    while(! peer.outstanding.empty())
+        abandonFront(peer);
+
+    peer.replaceable.clear();
+    peer.nextDeadlineUs = UINT64_MAX;
+    resetWindow(peer);
+    peer.dead = true;
+    _stats.peersDeclaredDead++;
+}
+
+bool Unicast::allMessagesDelivered()
+{
+    log(DEBUG, "have %d messages left\n", _unacked);
+
+    if(_mesh && ! _mesh->allWritten())
+        return false;
+    if(_shm && ! _shm->allWritten())
+        return false;
+
+    for(auto& peer : _peers)
+    {
+        if(! peer.coalesced.empty() || ! peer.fragments.empty())
+            return false;
+    }
+
+    return _unacked == 0;
+}
+
+
+void Unicast::handleAck(uint32_t node, uint32_t ack, uint64_t sack)
+{
+    _stats.acksReceived++;
+
+    Peer& peer = _peers[node];
+
+    // the latest send of anything newly acked that only went out once
+    // (Karn), resent ones can't tell which copy got acked.
+    uint64_t sampleSentUs = 0;
+    uint32_t acked = 0;
+
+    // remove from the list of things to retransmit, everything up to ack
+    // goes from the front...
+    while(! peer.outstanding.empty() && (int32_t)(peer.outstanding.front().seq - ack) <= 0)
+    {
+        Outstanding& entry = peer.outstanding.front();
+        if(! entry.acked)
+        {
+            // never sent, the ack can't be for it
+            if(entry.transmissions == 0)
+                break;
+
+            peer.queuedBytes -= entry.payload->size();
+            peer.inFlight--;
+            acked++;
+            _unacked--;
+
+            if(entry.transmissions == 1 && entry.sentUs > sampleSentUs)
+                sampleSentUs = entry.sentUs;
+        }
+
+        peer.outstanding.pop_front();
+    }
+
+    // ...and what the bitmap names is found by index.
+    uint32_t highestSacked = ack;
+    for(int i = 0; sack != 0 && ! peer.outstanding.empty(); i++, sack >>= 1)
+    {
+        if(! (sack & 1))
+            continue;
+
+        highestSacked = ack + 1 + i;
+
+        uint32_t index = ack + 1 + i - peer.outstanding.front().seq;
+        if(index >= peer.outstanding.size())
+            break;
+
+        Outstanding& entry = peer.outstanding[index];
+        if(entry.acked || entry.transmissions == 0)
+            continue;
+
+        peer.queuedBytes -= entry.payload->size();
+        peer.inFlight--;
+        acked++;
+        entry.acked = true;
+        entry.payload.reset();
+        _unacked--;
+
+        if(entry.transmissions == 1 && entry.sentUs > sampleSentUs)
+            sampleSentUs = entry.sentUs;
+    }
+
+    while(! peer.outstanding.empty() && peer.outstanding.front().acked)
+        peer.outstanding.pop_front();
+
+    uint64_t now = nowUs();
+
+    if(sampleSentUs != 0)
+        sampleRtt(peer, now - sampleSentUs);
+
+    if(acked > 0)
+        opened(peer, ack, acked);
+
+    if(peer.outstanding.empty())
+    {
+        peer.nextDeadlineUs = UINT64_MAX;
+        return;
+    }
+
+    // holes below something the peer got were most likely lost, resend
+    // them now rather than at their deadline unless they just went out.
+    // Until there is an RTT sample nothing says what "just" is, they wait.
+    if(peer.srtt == 0)
+        return;
+
+    bool lost = false;
+    for(auto& it : peer.outstanding)
+    {
+        if((int32_t)(it.seq - highestSacked) >= 0)
+            break;
+
+        if(it.acked || it.deadlineUs <= now || now - it.sentUs < peer.srtt)
+            continue;
+
+        it.deadlineUs = now;
+        it.hole = true;
+        peer.nextDeadlineUs = now;
+        lost = true;
+    }
+
+    if(lost)
+        congested(peer, false);
+}
+
+
+void Unicast::sendAck(uint32_t node)
+{
+    Header ack = {DATAGRAM_ACK};
+
+    //log(DEBUG, "Sending ack for %d to host: %d\n", _peers[node].cumulative, node);
+
+    _stats.acksSent++;
+    _stats.ackBytesSent += sizeof ack;
+    send(node, ack, NULL, 0);
+}
+
+void Unicast::flushAcks()
+{
+    uint64_t now = nowUs();
+
+    for(uint32_t node = 0; node < _peers.size(); node++)
+    {
+        if(_peers[node].ackPending && _peers[node].ackDueUs <= now)
+            sendAck(node);
+    }
+}
+
+long Unicast::msUntilNextEvent(bool receiving)
+{
+    if(receiving && ! _loopback.empty())
+        return 0;
+
+    uint64_t now = nowUs();
+    long next = (_mesh)? _mesh->msUntilNextEvent(receiving) : -1;
+    if(_shm)
+    {
+        long ms = _shm->msUntilNextEvent(receiving);
+        if(next == -1 || (ms != -1 && ms < next))
+            next = ms;
+    }
+    if(next == 0)
+        return 0;
+
+    for(auto& peer : _peers)
+    {
+        if(fragmentsReady(peer))
+            return 0;
+
+        uint64_t due = peer.nextDeadlineUs;
+        if(queuedReady(peer) && peer.paceUs < due)
+            due = peer.paceUs;
+        if(peer.ackPending && peer.ackDueUs < due)
+            due = peer.ackDueUs;
+        if(! peer.coalesced.empty() && peer.coalescedDueUs < due)
+            due = peer.coalescedDueUs;
+
+        if(due == UINT64_MAX)
+            continue;
+
+        long ms = (due <= now)? 0 : (long) ((due - now + 999) / 1000);
+        if(next == -1 || ms < next)
+            next = ms;
+    }
+
+    return next;
+}
+
+bool Unicast::accept(Peer& peer, const Header& header)
+{
+    // left over from before the peer restarted
+    if(peer.recvEpoch != 0 && (int32_t)(header.epoch - peer.recvEpoch) < 0)
+        return false;
+
+    // the peer restarted (or this is the first we hear of it), anything it
+    // no longer retransmits counts as received.
+    if(header.epoch != peer.recvEpoch)
+    {
+        peer.recvEpoch = header.epoch;
+        peer.cumulative = header.base - 1;
+        peer.received = 0;
+        peer.reassembling.clear(); // fragment ids are per epoch
+        peer.reassembled.clear();
+    }
+
+    // the peer gave up on everything below base, stop waiting for it.
+    if((int32_t)(header.base - 1 - peer.cumulative) > 0)
+    {
+        uint32_t skipped = header.base - 1 - peer.cumulative;
+        peer.received = (skipped >= 64)? 0 : peer.received >> skipped;
+        peer.cumulative = header.base - 1;
+        advance(peer);
+    }
+
+    if(! peer.ackPending)
+    {
+        peer.ackPending = true;
+        peer.ackDueUs = nowUs() + _ackDelayUs;
+    }
+
+    if((int32_t)(header.seq - peer.cumulative) <= 0)
+        return false;
+
+    uint32_t offset = header.seq - peer.cumulative - 1;
+    if(offset >= 64)
+    {
+        // too far past a gap to track, deliver it but leave it unacked; if
+        // it is resent before the gap fills the protocol sees it twice.
+        log(TRACE, "untracked seq %u, %u past the last in-order one\n", header.seq, offset);
+        return true;
+    }
+
+    if(peer.received & (1ULL << offset))
+        return false;
+
+    peer.received |= (1ULL << offset);
+    advance(peer);
+
+    // past a gap, the sender learns of the loss sooner without the delay
+    if(offset > 0)
+        peer.ackDueUs = nowUs();
+
+    return true;
+}
+
+void Unicast::advance(Peer& peer)
+{
+    while(peer.received & 1)
+    {
+        peer.received >>= 1;
+        peer.cumulative++;
+    }
+}
 
-Unicast::Unicast(const char* hostfile, uint32_t portNumber, uint32_t retransmit_time_ms)
-:IPLookup(hostfile),
-_port(portNumber),
-_retransmitMS(retransmit_time_ms)
+bool Unicast::setReceiveTimeout(int timeoutMs)
 {
-    _socket = UDP::server(portNumber);
+    if(timeoutMs == _recvTimeoutMs)
+        return true;
+
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+
+    if (setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        log(WARN, "Error setting timeout\n");
+        _recvTimeoutMs = -1;
+        return false;
+    }
+
+    _recvTimeoutMs = timeoutMs;
+    return true;
 }
 
-void Unicast::retransmit()
+int Unicast::receive(char* buffer, int length, struct sockaddr* from, socklen_t fromLen)
 {
-    // retransmit all things that have not yet gotten an ack
+    int ra =  lookupSock(from, fromLen);
 
-    if(_retransmitTimer.getMsSinceInit() < _retransmitMS)
-        return;
+    if(ra == -1)
+        return -1;
+
+    return receive(ra, buffer, length);
+}
+
+int Unicast::receive(int ra, char* buffer, int length)
+{
+    if(length < (int) sizeof(Header))
+    {
+        log(WARN, "dropping runt datagram of %d bytes from %d\n", length, ra);
+        return -1;
+    }
 
-    //log(DEBUG, "retransmitting %d items\n", _retransmitQueue.size());
+    // reliability functions
+    Header* header = (Header*) buffer;
 
-    for(auto it : _retransmitQueue)
+    if(_peers[ra].dead)
     {
-        //auto ptr = (uint32_t*) &it.second[0];
-        //log(DEBUG, "\t%d to %d\n", ptr[0], it.first);
+        log(INFO, "heard from peer %d again\n", ra);
+        _peers[ra].dead = false;
+    }
+
+    if(header->ackEpoch == _epoch)
+        handleAck(ra, header->ack, header->sack);
 
-        auto host = hostnameForId(it.first);
-        UDP::send(host.c_str(), _port, (char*) &it.second[0], it.second.size());
+    switch(header->kind)
+    {
+        case DATAGRAM_ACK:
+            return -1;
+        case DATAGRAM_DATA:
+            if(! accept(_peers[ra], *header))
+            {
+                _stats.duplicatesDropped++;
+                return -1;
+            }
+
+            // a filler for a superseded message
+            if(length == (int) sizeof(Header))
+                return -1;
+
+            return ra;
+        case DATAGRAM_UNRELIABLE:
+            return ra;
+        default:
+            log(WARN, "dropping datagram of unknown kind %d from %d\n", header->kind, ra);
+            return -1;
     }
+}
 
-    _retransmitTimer.set_start_time();
+void Unicast::loopback(const std::vector<char> &message)
+{
+    _loopback.push_back(frame(message));
+    _stats.loopbackDelivered++;
 }
 
-void Unicast::reliableSend(const uint32_t node, const std::vector<char> &message)
+int Unicast::readOrTimeout(char* buffer, int& length, int timeoutMs)
 {
-    // send and add to list of things to retransmit.
-    std::vector<char> message2(message);
+    _reassembledHandedOut.clear();
+
+    if(! _loopback.empty())
+    {
+        length = _loopback.front()->size();
+        memcpy(buffer, &(*_loopback.front())[0], length);
+        _loopback.pop_front();
+        return localhost();
+    }
+
+    if(_poll != -1 || _uring || _shards)
+    {
+        Datagram datagram;
+        int count = readBatch(&datagram, 1, timeoutMs);
+
+        for(uint32_t node = 0; node < _peers.size(); node++)
+        {
+            if(_peers[node].ackPending)
+                sendAck(node);
+        }
+
+        if(count <= 0 || datagram.length > MAX_UDP_PACKET_SIZE_BYTES)
+            return -1;
+
+        length = datagram.length;
+        memcpy(buffer, datagram.data, length);
+        return datagram.sender;
+    }
+
+    while(true)
+    {
+        if(! setReceiveTimeout(timeoutMs))
+            return -1;
+
+        struct sockaddr_storage their_addr;
+        int numbytes;
+        socklen_t addr_len;
+        addr_len = sizeof their_addr;
+        _stats.recvSyscalls++;
+        if ((numbytes = recvfrom(_socket, buffer, MAX_UDP_PACKET_SIZE_BYTES , 0,
+                                 (struct sockaddr *)&their_addr, &addr_len)) == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvfrom");
+
+            return -1;
+        }
 
-    //log(DEBUG, "doing reliable send to %d of size %d\n", node, message2.size());
+        _stats.datagramsReceived++;
 
-    _retransmitQueue.push_back(std::make_pair(node, message2));
+        int ra = receive(buffer, numbytes, (struct sockaddr *)&their_addr, addr_len);
 
-    // transmit the first time.
-    auto host = hostnameForId(node);
-    UDP::send(host.c_str(), _port, &(message2[0]), message2.size());
+        // there's no batch to coalesce over here, ack right away.
+        for(uint32_t node = 0; node < _peers.size(); node++)
+        {
+            if(_peers[node].ackPending)
+                sendAck(node);
+        }
+
+        if(ra != -1)
+        {
+            char* data = buffer + sizeof(Header);
+            length = numbytes - sizeof(Header);
+            reassemble(ra, data, length);
+
+            if(data != NULL && length > MAX_UDP_PACKET_SIZE_BYTES)
+            {
+                log(WARN, "dropping a reassembled message of %d bytes from %d, too big for the buffer\n", length, ra);
+                data = NULL;
+            }
+
+            // hand back just the message
+            if(data != NULL)
+            {
+                memmove(buffer, data, length);
+                return ra;
+            }
+        }
+
+        // it was an ack (or from someone we don't know), wait for the next one.
+        length = 0;
+    }
 }
 
-bool Unicast::allMessagesDelivered()
+int Unicast::readBatch(Datagram* batch, int budget, int timeoutMs)
+{
+    int count = 0;
+    int flags = MSG_DONTWAIT;
+
+    if(budget > RECV_BATCH_SIZE)
+        budget = RECV_BATCH_SIZE;
+
+    // our own messages first, straight from the payload we sent.
+    _loopbackHandedOut.clear();
+    _reassembledHandedOut.clear();
+    while(count < budget && ! _loopback.empty())
+    {
+        _loopbackHandedOut.push_back(_loopback.front());
+        _loopback.pop_front();
+
+        const std::vector<char>& message = *_loopbackHandedOut.back();
+        batch[count].sender = localhost();
+        batch[count].data = const_cast<char*>(&message[0]);
+        batch[count].length = message.size();
+        count++;
+    }
+
+    if(count == budget)
+        return count;
+
+    if(_poll != -1)
+    {
+        // wait for any of them, then take what each has without waiting
+        if(timeoutMs > 0 && count == 0 && ! receivePending())
+        {
+            struct epoll_event event;
+            if(epoll_wait(_poll, &event, 1, timeoutMs) == -1 && errno != EINTR)
+                perror("epoll_wait");
+        }
+        timeoutMs = 0;
+
+        if(_shm)
+        {
+            int chunks = _shm->read(&_shmChunks[0], budget - count, 0);
+            for(int i = 0; i < chunks; i++)
+            {
+                batch[count].sender = _shmChunks[i].sender;
+                batch[count].data = _shmChunks[i].data;
+                batch[count].length = _shmChunks[i].length;
+                count++;
+            }
+        }
+
+        if(_mesh && count < budget)
+        {
+            int chunks = _mesh->read(&_chunks[0], budget - count, 0);
+            for(int i = 0; i < chunks; i++)
+            {
+                batch[count].sender = _chunks[i].sender;
+                batch[count].data = _chunks[i].data;
+                batch[count].length = _chunks[i].length;
+                count++;
+            }
+        }
+
+        if(! _udp || count == budget)
+            return count;
+    }
+
+    if(_shards)
+    {
+        if(timeoutMs > 0 && count == 0)
+            _shards->wait(timeoutMs);
+
+        // like the ring below, what the workers handed over is only given
+        // back on the next call
+        int fromShards = 0;
+        while(fromShards == 0 && count < budget)
+        {
+            int received = _shards->read(&_shardDatagrams[0], budget - count);
+            if(received == 0)
+                break;
+
+            _stats.datagramsReceived += received;
+            for(int i = 0; i < received; i++)
+            {
+                RecvShards::Datagram& datagram = _shardDatagrams[i];
+                if(take(datagram.data, datagram.length, datagram.from, datagram.fromLen, batch[count],
+                        datagram.sender))
+                {
+                    count++;
+                    fromShards++;
+                }
+            }
+        }
+
+        return count;
+    }
+
+    if(_uring)
+    {
+        if(timeoutMs > 0 && count == 0)
+            _uring->wait(timeoutMs);
+
+        // as with recvmmsg below, buffers only go back to the kernel on
+        // the next call, which is fine while everything was an ack
+        int fromRing = 0;
+        while(fromRing == 0 && count < budget)
+        {
+            int received = _uring->receive(&_ringDatagrams[0], budget - count);
+            if(received == 0)
+                break;
+
+            _stats.datagramsReceived += received;
+            for(int i = 0; i < received; i++)
+            {
+                Uring::Datagram& datagram = _ringDatagrams[i];
+                if(take(datagram.data, datagram.length, datagram.from, datagram.fromLen, batch[count]))
+                {
+                    count++;
+                    fromRing++;
+                }
+            }
+        }
+
+        return count;
+    }
+
+    // only wait for the socket if there was nothing of our own
+    if(timeoutMs > 0 && count == 0)
+    {
+        if(! setReceiveTimeout(timeoutMs))
+            return -1;
+
+        flags = MSG_WAITFORONE; // block for the first, take whatever else is queued
+    }
+
+    // keep going only while everything received was consumed here (acks),
+    // otherwise the next call would overwrite what we're handing back.
+    int fromSocket = 0;
+    while(fromSocket == 0)
+    {
+        int vlen = budget - count;
+        if(vlen <= 0)
+            break;
+
+        for(int i = 0; i < vlen; i++)
+        {
+            _recvIov[i].iov_base = &_recvBuffers[i * MAX_UDP_PACKET_SIZE_BYTES];
+            _recvIov[i].iov_len = MAX_UDP_PACKET_SIZE_BYTES;
+
+            memset(&_recvMsgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            _recvMsgs[i].msg_hdr.msg_name = &_recvAddrs[i];
+            _recvMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            _recvMsgs[i].msg_hdr.msg_iov = &_recvIov[i];
+            _recvMsgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        _stats.recvSyscalls++;
+        int ret = recvmmsg(_socket, _recvMsgs, vlen, flags, NULL);
+        if(ret <= 0)
+        {
+            if(ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("recvmmsg");
+            break;
+        }
+
+        _stats.datagramsReceived += ret;
+
+        for(int i = 0; i < ret; i++)
+        {
+            if(take((char*) _recvIov[i].iov_base, _recvMsgs[i].msg_len,
+                    (struct sockaddr*) &_recvAddrs[i], _recvMsgs[i].msg_hdr.msg_namelen, batch[count]))
+            {
+                count++;
+                fromSocket++;
+            }
+        }
+
+        // the socket is drained
+        if(ret < vlen)
+            break;
+
+        flags = MSG_DONTWAIT;
+    }
+
+    return count;
+}
+
+bool Unicast::take(char* data, int length, struct sockaddr* from, socklen_t fromLen, Datagram& datagram,
+                   int sender)
+{
+    sender = (sender == -1)? receive(data, length, from, fromLen) : receive(sender, data, length);
+    if(sender == -1)
+        return false;
+
+    data += sizeof(Header);
+    length -= sizeof(Header);
+    reassemble(sender, data, length);
+    if(data == NULL)
+        return false;
+
+    datagram.sender = sender;
+    datagram.data = data;
+    datagram.length = length;
+    return true;
+}
+
+int Unicast::sendEach(const struct sockaddr_in* addresses, const int count,
+                      const Header* headers, const struct iovec* payloads)
 {
-    log(DEBUG, "have %d messages left\n", _retransmitQueue.size());
-    return _retransmitQueue.size() == 0;
+    if(_uring)
+        return _uring->sendEach(addresses, count, (const char*) headers, sizeof(Header), payloads);
+
+    return UDP::sendEach(_socket, addresses, count, (const char*) headers, sizeof(Header), payloads);
 }
 
 
-void Unicast::handleAck(paxos::UnivAck_t* msg, int sender)
+void Unicast::sendMessage(const std::vector<char>& msg, const uint32_t replaces)
 {
+    //log(TRACE, "Sending message: %d\n", ((uint32_t*)(&msg[0]))[0]);
+    _stats.broadcasts++;
 
-    for(uint32_t i = 0; i < _retransmitQueue.size(); i++)
+    // ourselves and whoever isn't reached over UDP first
+    bool udp = false;
+    for(int i = 0; i < getNumberOfHosts(); i++)
     {
-        auto sender_message = _retransmitQueue[i];
-        if(sender_message.first != (uint32_t)sender)
-            continue;
+        if(i == localhost())
+            loopback(msg);
+        else if(viaUdp(i, msg))
+            udp = true;
+        else
+            sendDirect(i, msg);
+    }
 
-        auto vec = sender_message.second;
-        if(vec.size() != msg->size)
-            continue;
+    if(! udp)
+        return;
 
-        bool equals = true;
-        for(uint32_t j = 0; j < vec.size(); j++)
+    // a fragmented message can't be superseded, it has no one datagram
+    if(replaces == 0 || ! fits(msg))
+    {
+        for(int i = 0; i < getNumberOfHosts(); i++)
         {
-            if(vec[j] != msg->packet[j])
-                equals = false;
+            if(i != localhost() && viaUdp(i, msg))
+                coalesce(i, msg);
         }
+        return;
+    }
+
+    // a replaceable message gets a datagram of its own so a newer one can
+    // supersede it, whatever was coalesced before it goes first.
+    flushCoalesced(true);
+
+    auto payload = frame(msg);
+    int remote = 0;
+
+    for(int i = 0; i < getNumberOfHosts(); i++)
+    {
+        if(i == localhost() || ! viaUdp(i, msg))
+            continue;
+
+        _stats.messagesSent++;
+        Header& header = _broadcastHeaders[remote];
 
-        if(! equals)
+        // dead peers get the one copy, unqueued
+        if(_peers[i].dead)
+        {
+            header.kind = DATAGRAM_UNRELIABLE;
+            header.seq = 0;
+        }
+        else if(admit(_peers[i]))
+        {
+            header.kind = DATAGRAM_DATA;
+            header.seq = queueForRetransmit(i, payload, replaces);
+        }
+        else
+        {
+            queueForRetransmit(i, payload, replaces, false);
             continue;
+        }
 
-        // remove from the list of things to retransmit.
-        _retransmitQueue.erase(_retransmitQueue.begin() + i);
+        stamp(i, header);
+        _flushAddresses[remote++] = addressForId(i);
+    }
+
+    if(remote == 0)
         return;
+
+    // hand the whole fan-out to the kernel at once, every datagram
+    // pointing at the one payload
+    for(int i = 0; i < remote; i++)
+    {
+        _flushPayloads[i].iov_base = (void*) &(*payload)[0];
+        _flushPayloads[i].iov_len = payload->size();
+    }
+    int syscalls = sendEach(&_flushAddresses[0], remote, &_broadcastHeaders[0], &_flushPayloads[0]);
+
+    _stats.sendSyscalls += syscalls;
+    _stats.datagramsSent += remote;
+}
+
+bool Unicast::viaUdp(const uint32_t node, const std::vector<char> &message) const
+{
+    switch(_transports[node])
+    {
+        case TRANSPORT_TCP:
+            return false;
+        case TRANSPORT_SHM:
+            // too big for a ring, it goes in fragments
+            return ! _shm->fits(message);
+        default:
+            return true;
     }
 }
 
+void Unicast::sendDirect(const uint32_t node, const std::vector<char> &message)
+{
+    if(_transports[node] == TRANSPORT_TCP)
+        _mesh->queue(node, message);
+    else
+        _shm->queue(node, message);
+
+    _stats.messagesSent++;
+}
+
+Unicast::Payload Unicast::frame(const std::vector<char> &message)
+{
+    Frame frame = {(uint32_t) message.size()};
+
+    auto payload = std::make_shared<std::vector<char> >(sizeof frame + message.size());
+    memcpy(&(*payload)[0], &frame, sizeof frame);
+    if(! message.empty())
+        memcpy(&(*payload)[sizeof frame], &message[0], message.size());
+
+    return payload;
+}
 
-void Unicast::sendAck(uint32_t node, std::vector<char> msg_array)
+void Unicast::coalesce(const uint32_t node, const std::vector<char> &message)
 {
-    paxos::UnivAck_t a;
-    a.type = 1024;
-    a.size = msg_array.size();
+    Peer& peer = _peers[node];
+    Frame frame = {(uint32_t) message.size()};
+    size_t bytes = sizeof frame + message.size();
 
-    for(uint32_t i = 0; i < msg_array.size(); i++)
+    if(! fits(message))
     {
-        a.packet[i] = msg_array[i];
+        flushPeer(node); // what was coalesced before it goes first
+        std::vector<Payload> fragments = fragment(message);
+        // they go out in flushMessages' rounds, as much as the peer's
+        // quantum allows at a time
+        peer.fragments.insert(peer.fragments.end(), fragments.begin(), fragments.end());
+        _stats.messagesSent++;
+        return;
     }
 
-    std::vector<char> tosend;
-    paxos::pack_UnivAck(a, tosend);
+    if(! peer.coalesced.empty() && sizeof(Header) + peer.coalesced.size() + bytes > _coalesceBytes)
+        flushPeer(node);
+
+    if(peer.coalesced.empty())
+        peer.coalescedDueUs = nowUs() + _coalesceDelayUs;
+
+    const char* f = (const char*) &frame;
+    peer.coalesced.insert(peer.coalesced.end(), f, f + sizeof frame);
+    peer.coalesced.insert(peer.coalesced.end(), message.begin(), message.end());
+    _stats.messagesSent++;
+}
+
+void Unicast::sendPayload(const uint32_t node, const Payload& payload, const uint32_t replaces)
+{
+    Header header = {DATAGRAM_UNRELIABLE};
 
-    auto host = hostnameForId(node);
+    // nothing gets buffered for a dead peer, it only gets this one try.
+    if(! _peers[node].dead)
+    {
+        // behind what waits for the window, sendQueued sends it in turn
+        if(! admit(_peers[node]))
+        {
+            queueForRetransmit(node, payload, replaces, false);
+            return;
+        }
 
-    //log(DEBUG, "Sending ack of size: %d to host: %d\n",tosend.size(), node);
+        header.kind = DATAGRAM_DATA;
+        header.seq = queueForRetransmit(node, payload, replaces);
+    }
 
-    UDP::send(host.c_str(), _port, &tosend[0], tosend.size());
+    send(node, header, &(*payload)[0], payload->size());
 }
 
-int Unicast::readOrTimeout(char* buffer, int& length, int timeoutMs)
+void Unicast::flushPeer(const uint32_t node)
 {
-    recv:
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeoutMs * 1000;
+    Peer& peer = _peers[node];
+    if(peer.coalesced.empty())
+        return;
 
-    if (setsockopt(_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        log(WARN, "Error setting timeout\n");
-        return -1;
+    // copied, the buffer keeps its capacity for the next datagram
+    auto payload = std::make_shared<const std::vector<char> >(peer.coalesced);
+    peer.coalesced.clear();
+
+    sendPayload(node, payload, 0);
+}
+
+bool Unicast::fits(const std::vector<char> &message) const
+{
+    return sizeof(Header) + sizeof(Frame) + message.size() <= _fragmentBytes;
+}
+
+std::vector<Unicast::Payload> Unicast::fragment(const std::vector<char> &message)
+{
+    const size_t overhead = sizeof(Header) + sizeof(Frame) + sizeof(Fragment);
+    const size_t piece = _fragmentBytes - overhead;
+
+    Fragment fragment;
+    fragment.message = _nextFragmented++;
+    fragment.count = (message.size() + piece - 1) / piece;
+    fragment.total = message.size();
+
+    std::vector<Payload> fragments;
+    fragments.reserve(fragment.count);
+
+    for(fragment.index = 0; fragment.index < fragment.count; fragment.index++)
+    {
+        fragment.offset = fragment.index * piece;
+        size_t bytes = message.size() - fragment.offset;
+        if(bytes > piece)
+            bytes = piece;
+
+        Frame frame = {(uint32_t) (sizeof fragment + bytes) | FRAME_FRAGMENT};
+
+        auto payload = std::make_shared<std::vector<char> >(sizeof frame + sizeof fragment + bytes);
+        char* out = &(*payload)[0];
+        memcpy(out, &frame, sizeof frame);
+        memcpy(out + sizeof frame, &fragment, sizeof fragment);
+        memcpy(out + sizeof frame + sizeof fragment, &message[fragment.offset], bytes);
+        fragments.push_back(payload);
     }
 
+    _stats.fragmented++;
+    return fragments;
+}
+
+bool Unicast::fragmentsReady(const Peer& peer) const
+{
+    return ! peer.fragments.empty() && (peer.dead || admit(peer));
+}
 
-    struct sockaddr_storage their_addr;
-    int numbytes;
-    socklen_t addr_len;
-    addr_len = sizeof their_addr;
-    if ((numbytes = recvfrom(_socket, buffer, MAX_UDP_PACKET_SIZE_BYTES , 0,
-                             (struct sockaddr *)&their_addr, &addr_len)) == -1) {
-        if(errno != 11)
-            perror("recvfrom");
+bool Unicast::sendFragments(const uint32_t node)
+{
+    Peer& peer = _peers[node];
 
-        return -1;
+    // a dead peer gets them all at once, nothing is queued for it
+    size_t count = peer.fragments.size();
+    if(! peer.dead)
+    {
+        size_t room = 0;
+        if(admit(peer))
+        {
+            room = peer.cwnd - peer.inFlight;
+            if(MAX_WINDOW - peer.outstanding.size() < room)
+                room = MAX_WINDOW - peer.outstanding.size();
+        }
+        if(room < count)
+            count = room;
     }
 
-    length = numbytes;
+    // as many as the peer's deficit covers
+    size_t affordable = 0;
+    while(affordable < count && spend(peer, peer.fragments[affordable]->size()))
+        affordable++;
+    bool starved = affordable < count;
+    count = affordable;
 
+    if(count == 0)
+        return starved;
 
-    struct sockaddr* theirp = (struct sockaddr *)&their_addr;
-    int ra =  lookupSock(theirp, addr_len);
+    std::vector<Payload> fragments(peer.fragments.begin(), peer.fragments.begin() + count);
+    peer.fragments.erase(peer.fragments.begin(), peer.fragments.begin() + count);
 
-    if(ra == -1)
-        return -2;
+    std::vector<Header> headers(count);
+    std::vector<struct sockaddr_in> addresses(count, addressForId(node));
+    std::vector<struct iovec> payloads(count);
 
+    for(size_t i = 0; i < count; i++)
+    {
+        Header& header = headers[i];
+        header.kind = DATAGRAM_UNRELIABLE;
+        if(! peer.dead)
+        {
+            header.kind = DATAGRAM_DATA;
+            header.seq = queueForRetransmit(node, fragments[i], 0);
+        }
+        stamp(node, header);
+
+        payloads[i].iov_base = (void*) &(*fragments[i])[0];
+        payloads[i].iov_len = fragments[i]->size();
+    }
 
+    int syscalls = sendEach(&addresses[0], count, &headers[0], &payloads[0]);
 
-    // reliability functions
-    std::vector<char> vecbuf;
-    for(int i = 0; i < length; i++)
-        vecbuf.push_back(buffer[i]);
+    _stats.fragmentsSent += count;
+    _stats.sendSyscalls += syscalls;
+    _stats.datagramsSent += count;
+    return starved;
+}
+
+void Unicast::reassemble(const uint32_t node, char*& data, int& length)
+{
+    Frame frame;
+    Fragment fragment;
+
+    if(length < (int) sizeof frame)
+        return;
+
+    memcpy(&frame, data, sizeof frame);
+    if(! (frame.length & FRAME_FRAGMENT))
+        return;
+
+    uint32_t bytes = frame.length & ~FRAME_FRAGMENT;
+    char* piece = data + sizeof frame + sizeof fragment;
+    data = NULL;
 
-    uint32_t* bufstar = (uint32_t*) buffer;
-    if(bufstar[0] == 1024)
+    if(bytes < sizeof fragment || sizeof frame + bytes != (uint32_t) length)
     {
-        //LOG(TRACE, "handling ack");
-        handleAck((paxos::UnivAck_t*) buffer, ra);
-        length = 0;
-        ra = -1;
+        log(WARN, "dropping a malformed fragment from %d\n", node);
+        _stats.reassemblyDropped++;
+        return;
+    }
+
+    memcpy(&fragment, piece - sizeof fragment, sizeof fragment);
+    bytes -= sizeof fragment;
 
-        goto recv;
+    if(fragment.total > MAX_REASSEMBLED_BYTES || fragment.index >= fragment.count ||
+       fragment.count > fragment.total || fragment.offset > fragment.total ||
+       bytes > fragment.total - fragment.offset)
+    {
+        log(WARN, "dropping fragment %u/%u of message %u (%u bytes) from %d, out of bounds\n",
+            fragment.index, fragment.count, fragment.message, fragment.total, node);
+        _stats.reassemblyDropped++;
+        return;
     }
-    else
+
+    Peer& peer = _peers[node];
+
+    // a late copy of one we already have, or older than any we remember
+    if(peer.reassembled.count(fragment.message) ||
+       (peer.reassembled.size() == MAX_REASSEMBLED_IDS && fragment.message < *peer.reassembled.begin()))
+        return;
+
+    auto found = peer.reassembling.find(fragment.message);
+    if(found == peer.reassembling.end())
     {
-        sendAck(ra, vecbuf);
+        // ids only grow within an epoch, the smallest is the oldest
+        if(peer.reassembling.size() >= MAX_REASSEMBLING)
+        {
+            log(WARN, "giving up on reassembling message %u from %d\n", peer.reassembling.begin()->first, node);
+            peer.reassembling.erase(peer.reassembling.begin());
+            _stats.reassemblyDropped++;
+        }
+
+        Reassembly& added = peer.reassembling[fragment.message];
+        Frame whole = {fragment.total};
+        added.message.resize(sizeof whole + fragment.total);
+        memcpy(&added.message[0], &whole, sizeof whole);
+        added.have.resize(fragment.count);
+        added.missing = fragment.count;
+        found = peer.reassembling.find(fragment.message);
     }
 
+    Reassembly& reassembly = found->second;
+    if(reassembly.have.size() != fragment.count ||
+       reassembly.message.size() != sizeof frame + fragment.total)
+    {
+        log(WARN, "dropping fragment %u of message %u from %d, it disagrees with the others\n",
+            fragment.index, fragment.message, node);
+        _stats.reassemblyDropped++;
+        return;
+    }
 
-    return ra;
-}
+    // resent past the receive window, the ack never made it
+    if(reassembly.have[fragment.index])
+        return;
+
+    memcpy(&reassembly.message[sizeof frame + fragment.offset], piece, bytes);
+    reassembly.have[fragment.index] = true;
+    if(--reassembly.missing > 0)
+        return;
+
+    _reassembledHandedOut.push_back(std::vector<char>());
+    _reassembledHandedOut.back().swap(reassembly.message);
+    peer.reassembling.erase(found);
+    _stats.reassembled++;
 
+    peer.reassembled.insert(fragment.message);
+    if(peer.reassembled.size() > MAX_REASSEMBLED_IDS)
+        peer.reassembled.erase(peer.reassembled.begin());
 
-void Unicast::sendMessage(const std::vector<char>& msg)
+    data = &_reassembledHandedOut.back()[0];
+    length = _reassembledHandedOut.back().size();
+}
+
+void Unicast::flushMessages()
 {
+    if(_mesh)
+        _mesh->flush();
+    if(_shm)
+        _shm->flush();
+    if(! _udp)
+        return;
 
-    std::vector<char> msgcopy(msg);
+    flushCoalesced(false);
 
-    //log(TRACE, "Sending message: %d\n", ((uint32_t*)(&msgcopy[0]))[0]);
-    for(int i = 0; i < getNumberOfHosts(); i++)
+    uint32_t first = _nextRound++;
+
+    for(uint32_t i = 0; i < _peers.size(); i++)
+    {
+        uint32_t node = (first + i) % _peers.size();
+        Peer& peer = _peers[node];
+        if(! queuedReady(peer) && ! fragmentsReady(peer))
+            continue;
+
+        peer.deficit += SEND_QUANTUM_BYTES;
+        bool starved = queuedReady(peer) && sendQueued(node);
+        if(! starved && fragmentsReady(peer))
+            starved = sendFragments(node);
+
+        if(! starved)
+            peer.deficit = 0;
+    }
+}
+
+void Unicast::flushCoalesced(bool all)
+{
+    uint64_t now = nowUs();
+    std::vector<Payload> payloads; // alive until they're on the wire
+    int count = 0;
+
+    for(uint32_t node = 0; node < _peers.size(); node++)
     {
-        reliableSend(i, msg);
+        Peer& peer = _peers[node];
+        if(peer.coalesced.empty() || (! all && peer.coalescedDueUs > now))
+            continue;
+
+        payloads.push_back(std::make_shared<const std::vector<char> >(peer.coalesced));
+        peer.coalesced.clear();
+
+        if(! peer.dead && ! admit(peer))
+        {
+            queueForRetransmit(node, payloads.back(), 0, false);
+            continue;
+        }
+
+        Header& header = _flushHeaders[count];
+        header.kind = DATAGRAM_UNRELIABLE;
+        header.seq = 0;
+        if(! peer.dead)
+        {
+            header.kind = DATAGRAM_DATA;
+            header.seq = queueForRetransmit(node, payloads.back(), 0);
+        }
+        stamp(node, header);
+
+        _flushAddresses[count] = addressForId(node);
+        _flushPayloads[count].iov_base = (void*) &(*payloads.back())[0];
+        _flushPayloads[count].iov_len = payloads.back()->size();
+        count++;
     }
 
+    if(count == 0)
+        return;
+
+    // every peer's datagram in one go
+    int syscalls = sendEach(&_flushAddresses[0], count, &_flushHeaders[0], &_flushPayloads[0]);
+
+    _stats.sendSyscalls += syscalls;
+    _stats.datagramsSent += count;
 }
 
 
@@ -219,8 +1837,23 @@ void Unicast::unreliableSend(const uint32_t node, const std::vector<char> &messa
 {
     //log(DEBUG, "doing unreliable send to %d of size %d\n", node, message.size());
 
-    auto host = hostnameForId(node);
-    UDP::send(host.c_str(), _port, &(message[0]), message.size());
+    if((int) node == localhost())
+    {
+        loopback(message);
+        return;
+    }
+
+    if(! viaUdp(node, message))
+    {
+        sendDirect(node, message);
+        return;
+    }
+
+    auto payload = frame(message);
+
+    Header header = {DATAGRAM_UNRELIABLE};
+    send(node, header, &(*payload)[0], payload->size());
+    _stats.messagesSent++;
 }
 
 
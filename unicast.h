@@ -11,17 +11,25 @@ Provides a UDP based unicast service.
 #ifndef UNICAST_H
 #define UNICAST_H
 
+#include <cstdint>
+#include <deque>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <map>
+#include <set>
 #include <vector>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <utility>
 
 #include "Timer.hpp"
 #include "IPLookup.h"
 #include "Debug.hpp"
-#include "paxos.h"
+#include "tcpmesh.h"
+#include "shmmesh.h"
+#include "uring.h"
+#include "recvshards.h"
 
 
 class Unicast : public IPLookup
@@ -30,19 +38,159 @@ class Unicast : public IPLookup
     // int localhost() // gets id of localhost
     // int getNumberOfHosts() // gets number of processes
 public:
-    Unicast(const char* hostfile, uint32_t portNumber, uint32_t retransmit_time_ms);
+    // retransmit_time_ms is the retransmission timeout used until a peer's
+    // round trip time has been measured. ackDelayMs is how long an ack may
+    // wait to be coalesced with later ones or piggybacked on traffic to the
+    // same peer. Messages to the same peer are coalesced into datagrams of
+    // up to coalesceBytes, waiting at most coalesceDelayMs for company. A
+    // message too big for one datagram of that size (DEFAULT_COALESCE_BYTES
+    // if it is smaller) goes out in fragments of it. None of that applies
+    // to peers reached over TCP or shared memory, every message goes to
+    // the peer's stream or ring.
+    //
+    // transport is what a host whose hostfile line names none runs over.
+    // A pair of hosts share memory if both lines say shm (or the same
+    // shm:group), otherwise they use TCP if either says tcp, UDP if not;
+    // every host has to be given the same hostfile and transport.
+    //
+    // With uring the socket is driven through io_uring (see Uring) where
+    // the kernel supports it, through sendmmsg and recvmmsg elsewhere.
+    // recvShards above 1 opens that many sockets on the port and has a
+    // thread drain each (see RecvShards), io_uring is only used for sends
+    // then.
+    enum Transport
+    {
+        TRANSPORT_UDP,  // datagrams, acked and retransmitted here
+        TRANSPORT_TCP,  // one TCP connection per pair of hosts, see TcpMesh
+        TRANSPORT_SHM   // shared-memory rings on one machine, see ShmMesh
+    };
+
+    Unicast(const char* hostfile, uint32_t portNumber, uint32_t retransmit_time_ms, uint32_t ackDelayMs = 0,
+            uint32_t coalesceBytes = DEFAULT_COALESCE_BYTES, uint32_t coalesceDelayMs = 0,
+            Transport transport = TRANSPORT_UDP, bool uring = false, int recvShards = 1);
+
+    // the most a datagram can carry without IP fragmentation on ethernet
+    static const uint32_t DEFAULT_COALESCE_BYTES = 1472;
+    // the longest message a peer puts back together, anything longer is
+    // never delivered
+    static const uint32_t MAX_MESSAGE_BYTES = 32 * 1024 * 1024;
+
+    // Every datagram Unicast puts on the wire starts with this header, the
+    // protocol message (if any) follows it. Any kind can carry an ack for
+    // the DATA the destination sent us.
+    struct Header
+    {
+        uint32_t kind;      // a datagram_kind
+        uint32_t epoch;     // sender's incarnation, picked at startup
+        uint32_t seq;       // per-peer sequence number of a DATA datagram
+        uint32_t base;      // the sender no longer retransmits any seq below this
+        uint32_t ackEpoch;  // epoch of the stream ack and sack cover, 0 for no ack
+        uint32_t ack;       // every seq up to and including this one arrived
+        uint64_t sack;      // bit i set: seq ack + 1 + i arrived
+    };
+
+    // prefixes every message in a datagram
+    struct Frame
+    {
+        uint32_t length; // of the message that follows, FRAME_FRAGMENT set for a fragment
+    };
+
+    // A message too big for one datagram goes out in fragments, each alone
+    // in a DATA datagram of its own so it is acked and retransmitted by
+    // itself. The datagram's Frame has FRAME_FRAGMENT set and its length
+    // covers this and the piece of the message that follows it. Fragments
+    // are reassembled before readBatch hands the message back.
+    struct Fragment
+    {
+        uint32_t message;   // the sender's id for the message, unique per epoch
+        uint32_t index;     // of this fragment, below count
+        uint32_t count;
+        uint32_t offset;    // of the piece in the message
+        uint32_t total;     // bytes in the whole message
+    };
+
+    static const uint32_t FRAME_FRAGMENT = 0x80000000;
+
+    enum datagram_kind
+    {
+        DATAGRAM_DATA = 1,          // reliable, retransmitted until acked
+        DATAGRAM_ACK = 2,           // carries only an ack, no payload
+        DATAGRAM_UNRELIABLE = 3     // sent once, never acked
+    };
+
+    // A received datagram, data points into Unicast's receive ring (or at
+    // a message we sent ourselves, which must not be written to) and is
+    // only valid until the next call to readBatch. It holds one or more
+    // messages, each a Frame followed by the message.
+    struct Datagram
+    {
+        int sender;
+        char* data;
+        int length;
+    };
+
+    // the bound socket every datagram goes in and out over, for event
+    // loops; when some peers are reached otherwise an fd that is readable
+    // whenever the socket, streams or rings are, and over io_uring the
+    // ring's fd, which is readable when datagrams have arrived, or with
+    // receive shards one readable when their workers have handed some over.
+    int getSocket() const
+    {
+        return (_poll != -1)? _poll : (_shards)? _shards->getFd() : (_uring)? _uring->getFd() : _socket;
+    }
+
+    // most datagrams a single readBatch call hands back.
+    static const int RECV_BATCH_SIZE = 64;
 
     // reads a socket or times out, if read returns the id of the message sender
     // filling the buffer and setting the length.
     int readOrTimeout(char* buffer, int& length, int timeoutMs);
 
-    void retransmit();  // retransmits messages.
-    void handleAck(paxos::UnivAck_t* msg, int sender); // handles the ack
-    void sendAck(uint32_t node, std::vector<char> msg); // send an ack for a message we got
+    // reads up to budget datagrams (at most RECV_BATCH_SIZE) with as few
+    // syscalls as possible, waiting up to timeoutMs for the first one; a
+    // timeout of 0 only takes what is already queued. Messages we sent
+    // ourselves come first, then the socket. Acks and duplicates are
+    // handled here and not returned. Returns the number of datagrams
+    // stored in batch.
+    int readBatch(Datagram* batch, int budget, int timeoutMs);
+
+    // messages are waiting for readBatch that won't make the socket
+    // readable: ones we sent ourselves, ones read off a stream already or
+    // left in a ring, ones a receive shard handed over; or the io_uring
+    // receive has to be posted again.
+    bool receivePending() const
+    {
+        return ! _loopback.empty() || (_mesh && _mesh->pending()) || (_shm && _shm->pending()) ||
+               (_shards && _shards->pending()) || (_uring && ! _shards && _uring->pending());
+    }
+
+    void retransmit();  // retransmits messages whose deadline has passed.
+    void handleAck(uint32_t node, uint32_t ack, uint64_t sack); // handles an ack from node
+    void sendAck(uint32_t node); // send node an ack for everything we got from it
 
+    // sends the acks that have waited out the ack delay, call once the
+    // protocol has handled a batch so its replies can carry them instead.
+    void flushAcks();
 
-    void reliableSend(const uint32_t node, const std::vector<char> &message);
-    void sendMessage(const std::vector<char> &message);
+    // sends the coalesced messages that have waited out the coalesce
+    // delay, with no delay everything sent since the last call, and what
+    // waits for room acks made in a peer's window. Messages don't go out
+    // before this is called.
+    void flushMessages();
+
+    // ms until flushAcks, flushMessages or retransmit has something to
+    // send, or 0 while messages to ourselves wait for readBatch; -1 if
+    // nothing is waiting. With receiving false, what waits for readBatch
+    // doesn't count, the caller isn't taking any more just now.
+    long msUntilNextEvent(bool receiving = true);
+
+
+    // a message sent with a nonzero replaces key makes any earlier one with
+    // the same key that is still waiting for its ack obsolete, so only the
+    // newest is retransmitted. Messages to ourselves skip the network and
+    // wait for readBatch, unacked and never retransmitted.
+    void reliableSend(const uint32_t node, const std::vector<char> &message, const uint32_t replaces = 0);
+    void sendMessage(const std::vector<char> &message, const uint32_t replaces = 0);
 
     bool allMessagesDelivered(); // tells us if all messages have been delivered
 
@@ -56,25 +204,274 @@ public:
 
 
 
-    // true if the ack is an ack for the given message, false if it is not.
-    static inline bool identifies(char* universal_ack, std::vector<char> other){
-        paxos::UnivAck_t* ua = (paxos::UnivAck_t*) universal_ack;
+    // transport counters, reported by logStats()
+    struct Stats
+    {
+        uint64_t broadcasts;        // calls to sendMessage
+        uint64_t messagesSent;      // to other hosts, however they were coalesced
+        uint64_t sendSyscalls;      // every syscall that put a datagram on the wire
+        uint64_t datagramsSent;
+        uint64_t recvSyscalls;
+        uint64_t datagramsReceived;
+        uint64_t acksSent;          // ACK datagrams
+        uint64_t ackBytesSent;      // bytes of those
+        uint64_t acksPiggybacked;   // acks that rode along on DATA or UNRELIABLE
+        uint64_t acksReceived;      // datagrams carrying an ack for us
+        uint64_t duplicatesDropped;
+        uint64_t retransmissions;
+        uint64_t rttSamples;
+        uint64_t superseded;        // queued messages replaced by a newer one
+        uint64_t abandoned;         // queued messages given up on, cap or dead peer
+        uint64_t peersDeclaredDead;
+        uint64_t loopbackDelivered; // messages to ourselves, never on the wire
+        uint64_t fragmented;        // messages sent in fragments
+        uint64_t fragmentsSent;     // first transmissions, retransmissions aren't counted
+        uint64_t reassembled;       // fragmented messages received whole
+        uint64_t reassemblyDropped; // partly received ones given up on or malformed fragments
+        uint64_t windowDeferred;    // DATA datagrams that waited for room in a peer's window
+        uint64_t pacingDelays;      // times the pacer held a peer's datagrams back
+        uint64_t lossEvents;        // times a peer's window was cut for losses
+        uint64_t timeouts;          // of those, retransmission timeouts
+        uint64_t quantumsUsedUp;    // times a peer's backlog had to wait for the next round
+    };
 
-        for(uint32_t i = 0; i < ua->size; i++)
-        {
-            if(ua->packet[i] != other[i])
-                return false;
-        }
+    const Stats& stats() const {return _stats;}
+    void logStats();
 
-        return true;
-    }
 
     private:
-        std::vector<std::pair<uint32_t, std::vector<char> > > _retransmitQueue;
+        typedef std::shared_ptr<const std::vector<char> > Payload;
+
+        // a DATA datagram waiting for its ack
+        struct Outstanding
+        {
+            uint32_t seq;
+            Payload payload;
+            bool acked;
+            uint32_t transmissions; // 0 while it waits for the window
+            uint64_t sentUs;        // last time it went out
+            uint64_t firstSentUs;   // first time it went out
+            uint64_t deadlineUs;    // when it goes out again
+            uint32_t replaces;      // key a newer message can replace it by, 0 for none
+            bool hole;              // an ack skipped it, resent without waiting out the deadline
+        };
+
+        // a fragmented message being put back together
+        struct Reassembly
+        {
+            std::vector<char> message;  // a Frame and then the message
+            std::vector<bool> have;     // by fragment index
+            uint32_t missing;
+        };
+
+        // per-peer reliability state
+        struct Peer
+        {
+            uint32_t nextSeq;   // seq the next DATA datagram to this peer gets
+            // every DATA datagram from the oldest unacked one on, by seq, so
+            // an ack finds its entry by index.
+            std::deque<Outstanding> outstanding;
+            uint64_t queuedBytes;   // payload held by outstanding
+            std::map<uint32_t, uint32_t> replaceable; // replaces key -> seq of the newest with it
+            // gave up on the peer, its messages go out once and aren't queued
+            // until we hear from it again.
+            bool dead;
+
+            // round trip estimate (RFC 6298), all in us
+            uint64_t srtt;          // 0 until the first sample
+            uint64_t rttvar;
+            uint64_t rto;
+            uint64_t nextDeadlineUs;    // no outstanding deadline is earlier
+
+            // congestion window (RFC 5681, in datagrams), first transmissions
+            // wait in outstanding while inFlight is at cwnd
+            uint32_t cwnd;
+            uint32_t ssthresh;
+            uint32_t windowCredit;  // acks towards the next increase above ssthresh
+            uint32_t inFlight;      // sent and neither acked nor abandoned
+            uint32_t unsent;        // the last ones in outstanding, never sent yet
+            bool recovering;        // the window was cut, until recoverySeq is acked
+            uint32_t recoverySeq;
+            uint64_t paceUs;        // the pacer lets the next datagram go then
+            // bytes of backlog the peer may still send this round (deficit
+            // round robin), only kept while its backlog outlasts it
+            uint64_t deficit;
+
+            // what we have received from the peer
+            uint32_t recvEpoch;     // 0 until the first DATA arrives
+            uint32_t cumulative;    // every seq up to this one arrived
+            uint64_t received;      // bit i set: cumulative + 1 + i arrived
+            bool ackPending;        // received DATA we haven't acked yet
+            uint64_t ackDueUs;      // when the pending ack has to go out
+
+            // fragmented messages from the peer still missing pieces, by id
+            std::map<uint32_t, Reassembly> reassembling;
+            // ids of the latest ones completed, their fragments may still be
+            // resent if they arrived past the receive window unacked
+            std::set<uint32_t> reassembled;
+
+            // fragments not sent yet, they wait for room in the window
+            std::deque<Payload> fragments;
+
+            // frames coalesced for the peer's next datagram
+            std::vector<char> coalesced;
+            uint64_t coalescedDueUs; // when they have to go out
+
+            Peer()
+            :nextSeq(1),
+            queuedBytes(0),
+            dead(false),
+            srtt(0),
+            rttvar(0),
+            rto(0),
+            nextDeadlineUs(UINT64_MAX),
+            cwnd(0),
+            ssthresh(0),
+            windowCredit(0),
+            inFlight(0),
+            unsent(0),
+            recovering(false),
+            recoverySeq(0),
+            paceUs(0),
+            deficit(0),
+            recvEpoch(0),
+            cumulative(0),
+            received(0),
+            ackPending(false),
+            ackDueUs(0),
+            coalescedDueUs(0)
+            {}
+        };
+
+        static uint64_t nowUs();
+        void sampleRtt(Peer& peer, uint64_t rttUs);
+        // when an entry sent now for the given time should go out again
+        uint64_t deadline(const Peer& peer, uint32_t transmissions, uint64_t now);
+
+        // queues a DATA datagram for node, sent says whether it goes out now
+        // or waits for the window
+        uint32_t queueForRetransmit(const uint32_t node, const Payload& payload, const uint32_t replaces,
+                                    bool sent = true);
+        // true if a new DATA datagram may go out to the peer right away
+        bool admit(const Peer& peer) const;
+        // takes a datagram's turn off the peer's pacer, false if it has to
+        // wait until paceUs
+        bool pace(Peer& peer, uint64_t now);
+        // cuts the peer's window for a loss, once for all of a window's
+        void congested(Peer& peer, bool timeout);
+        // grows the peer's window for datagrams newly acked up to ack
+        void opened(Peer& peer, uint32_t ack, uint32_t acked);
+        // takes bytes off the peer's deficit, false if it hasn't that many
+        // left this round
+        bool spend(Peer& peer, size_t bytes);
+        // true if queued datagrams could go to the peer once the pacer lets them
+        bool queuedReady(const Peer& peer) const;
+        // sends node's queued datagrams its window has room for, true if
+        // some have to wait for the next round
+        bool sendQueued(const uint32_t node);
+        // back to the initial window, nothing in flight
+        static void resetWindow(Peer& peer);
+        void abandonFront(Peer& peer);
+        void declareDead(const uint32_t node);
+        // fills in the epoch, base and any ack owed to node
+        void stamp(const uint32_t node, Header& header);
+        void send(const uint32_t node, Header& header, const char* buffer, const int bytes);
+        // queues a message we sent ourselves for readBatch
+        void loopback(const std::vector<char> &message);
+        // a message alone in its payload
+        static Payload frame(const std::vector<char> &message);
+        // adds a message to node's next datagram, sending that first if it
+        // can't take the message
+        void coalesce(const uint32_t node, const std::vector<char> &message);
+        // sends node's coalesced messages
+        void flushPeer(const uint32_t node);
+        // true if a message fits one datagram, false if it has to be fragmented
+        bool fits(const std::vector<char> &message) const;
+        // splits a message into fragment payloads that each fit a datagram
+        std::vector<Payload> fragment(const std::vector<char> &message);
+        // true if node has fragments waiting and room to send some
+        bool fragmentsReady(const Peer& peer) const;
+        // sends node's waiting fragments, each as its own DATA datagram
+        // (UNRELIABLE to a dead peer), as many as its window has room for,
+        // true if some have to wait for the next round
+        bool sendFragments(const uint32_t node);
+        // if a received payload is a fragment, adds it to the sender's
+        // reassembly and points data at the whole message (framed) once it
+        // is complete, at NULL until then. Other payloads are left alone.
+        void reassemble(const uint32_t node, char*& data, int& length);
+        // sends the coalesced messages that are due, or all of them
+        void flushCoalesced(bool all);
+        // true unless node is reached over TCP, or shared memory with room
+        // for the message in a ring
+        bool viaUdp(const uint32_t node, const std::vector<char> &message) const;
+        // queues a message for a peer viaUdp says no to
+        void sendDirect(const uint32_t node, const std::vector<char> &message);
+        // sends a coalesced or framed payload to node as a DATA datagram, or
+        // UNRELIABLE to a dead peer
+        void sendPayload(const uint32_t node, const Payload& payload, const uint32_t replaces);
+        // records a DATA datagram, false if it is a duplicate that must not
+        // be delivered again.
+        bool accept(Peer& peer, const Header& header);
+        // moves cumulative past everything received in order
+        void advance(Peer& peer);
+        bool setReceiveTimeout(int timeoutMs);
+        // sends each address its header and payload, over io_uring or
+        // with sendmmsg, and returns the number of syscalls made
+        int sendEach(const struct sockaddr_in* addresses, const int count,
+                     const Header* headers, const struct iovec* payloads);
+        // runs a datagram off the socket through receive() and reassemble(),
+        // true if it stored a message for the protocol in datagram. sender
+        // is looked up from the address unless it is known already.
+        bool take(char* data, int length, struct sockaddr* from, socklen_t fromLen, Datagram& datagram,
+                  int sender = -1);
+        // runs the reliability functions on a datagram, returns the sender
+        // if it should go to the protocol, -1 otherwise.
+        int receive(char* buffer, int length, struct sockaddr* from, socklen_t fromLen);
+        int receive(int sender, char* buffer, int length);
+
+        // one payload is shared by every peer a broadcast was queued for.
+        std::vector<Peer> _peers;
+        uint32_t _unacked; // total over all peers
+        std::vector<Header> _broadcastHeaders; // one per remote host, reused by sendMessage
+        std::deque<Payload> _loopback;          // messages to ourselves, oldest first
+        std::vector<Payload> _loopbackHandedOut; // kept alive until the next readBatch
+        std::vector<std::vector<char> > _reassembledHandedOut; // likewise
+        uint32_t _nextFragmented;   // id the next message we fragment gets
+        uint32_t _epoch;
+        uint64_t _ackDelayUs;
+        uint32_t _coalesceBytes;    // most a coalesced datagram carries, header included
+        uint32_t _fragmentBytes;    // most a fragment's datagram carries, header included
+        uint64_t _coalesceDelayUs;
+        // filled in by flushCoalesced and sendMessage, one entry per peer it sends to
+        std::vector<Header> _flushHeaders;
+        std::vector<struct sockaddr_in> _flushAddresses;
+        std::vector<struct iovec> _flushPayloads;
+        // filled in by sendQueued, one entry per datagram the window lets go
+        std::vector<Header> _queuedHeaders;
+        std::vector<struct iovec> _queuedPayloads;
+        uint32_t _nextRound; // retransmit and flushMessages start their rounds at peers in turn
+        Payload _filler; // stands in for superseded messages, carries no message
+        std::vector<Transport> _transports; // by host, how we reach it
+        std::unique_ptr<TcpMesh> _mesh; // set if a peer is reached over TCP
+        std::vector<TcpMesh::Chunk> _chunks; // what _mesh->read hands back
+        std::unique_ptr<ShmMesh> _shm;  // set if a peer shares memory with us
+        std::vector<ShmMesh::Chunk> _shmChunks; // what _shm->read hands back
+        bool _udp;  // something can arrive over the socket
+        int _poll;  // the socket and meshes together, -1 without meshes
+        std::unique_ptr<Uring> _uring; // set when the socket runs over io_uring
+        std::vector<Uring::Datagram> _ringDatagrams; // what _uring->receive hands back
+        std::unique_ptr<RecvShards> _shards; // set when workers drain several sockets
+        std::vector<RecvShards::Datagram> _shardDatagrams; // what _shards->read hands back
         uint32_t _port;
-        uint32_t _socket;
-        Timer _retransmitTimer;
-        uint32_t _retransmitMS;
+        int _socket; // bound server socket, all datagrams go out over it
+        Stats _stats;
+
+        // receive ring, one MAX_UDP_PACKET_SIZE_BYTES slot per batch entry
+        std::vector<char> _recvBuffers;
+        struct mmsghdr _recvMsgs[RECV_BATCH_SIZE];
+        struct iovec _recvIov[RECV_BATCH_SIZE];
+        struct sockaddr_storage _recvAddrs[RECV_BATCH_SIZE];
+        int _recvTimeoutMs; // SO_RCVTIMEO currently on the socket, -1 if unknown
 };
 
 #endif
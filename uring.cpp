@@ -0,0 +1,550 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+An io_uring backend for Unicast's UDP socket.
+**/
+
+#include "uring.h"
+#include "Debug.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifdef URING_MULTISHOT
+
+// SQEs, every send batch is at most this many datagrams
+const unsigned SQ_ENTRIES = 256;
+// room for a receive completion per buffer and a full batch of sends
+const unsigned CQ_ENTRIES = 4096;
+// buffers the receive can fill before we give any back, a power of two
+const unsigned BUFFERS = 256;
+const uint16_t BUFFER_GROUP = 1;
+
+Uring::Uring(int socket, size_t datagramBytes)
+:_socket(socket),
+_fd(-1),
+_ringMapping(MAP_FAILED),
+_ringBytes(0),
+_sqes((struct io_uring_sqe*) MAP_FAILED),
+_sqesBytes(0),
+_sqLocalTail(0),
+_bufRing((struct io_uring_buf_ring*) MAP_FAILED),
+_bufRingBytes(0),
+_buffers((char*) MAP_FAILED),
+_bufTail(0),
+_armed(false),
+_stats()
+{
+    // each buffer starts with what recvmsg fills in, then the sender's
+    // address and the datagram
+    _bufferBytes = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + datagramBytes;
+    _bufferBytes = (_bufferBytes + 63) & ~(size_t) 63;
+
+    memset(&_recvMsg, 0, sizeof _recvMsg);
+    _recvMsg.msg_namelen = sizeof(struct sockaddr_storage);
+
+    if(! setup() || ! probe())
+    {
+        if(_fd != -1)
+            close(_fd);
+        _fd = -1;
+        return;
+    }
+
+    _sendMsgs.resize(_sqEntries);
+    _sendIov.resize(2 * _sqEntries);
+}
+
+Uring::~Uring()
+{
+    if(_fd != -1)
+    {
+        // the kernel must be done with the buffers before they go away
+        if(_armed)
+            cancel(TAG_RECEIVE);
+        close(_fd);
+    }
+
+    if(_ringMapping != MAP_FAILED)
+        munmap(_ringMapping, _ringBytes);
+    if(_sqes != MAP_FAILED)
+        munmap(_sqes, _sqesBytes);
+    if(_bufRing != MAP_FAILED)
+        munmap(_bufRing, _bufRingBytes);
+    if(_buffers != MAP_FAILED)
+        munmap(_buffers, BUFFERS * _bufferBytes);
+}
+
+bool Uring::setup()
+{
+    // no COOP_TASKRUN, the kernel has to interrupt us to post a receive
+    // completion or an event loop sleeping on getFd() would never wake
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = CQ_ENTRIES;
+
+    _fd = syscall(__NR_io_uring_setup, SQ_ENTRIES, &params);
+    if(_fd == -1)
+    {
+        log(INFO, "uring: io_uring_setup: %s\n", strerror(errno));
+        return false;
+    }
+
+    // both arrived with 5.5, along with everything else we need but the
+    // buffer ring and multishot receive, which are checked for below
+    if(! (params.features & IORING_FEAT_SINGLE_MMAP) || ! (params.features & IORING_FEAT_NODROP))
+    {
+        log(INFO, "uring: the kernel's io_uring is too old\n");
+        return false;
+    }
+
+    _ringBytes = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                          params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    _ringMapping = mmap(NULL, _ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        _fd, IORING_OFF_SQ_RING);
+
+    _sqesBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe*) mmap(NULL, _sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        _fd, IORING_OFF_SQES);
+
+    _bufRingBytes = BUFFERS * sizeof(struct io_uring_buf);
+    _bufRing = (struct io_uring_buf_ring*) mmap(NULL, _bufRingBytes, PROT_READ | PROT_WRITE,
+                                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    _buffers = (char*) mmap(NULL, BUFFERS * _bufferBytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(_ringMapping == MAP_FAILED || _sqes == MAP_FAILED || _bufRing == MAP_FAILED || _buffers == MAP_FAILED)
+    {
+        log(INFO, "uring: mmap: %s\n", strerror(errno));
+        return false;
+    }
+
+    char* ring = (char*) _ringMapping;
+    _sqHead = (unsigned*) (ring + params.sq_off.head);
+    _sqTail = (unsigned*) (ring + params.sq_off.tail);
+    _sqMask = *(unsigned*) (ring + params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+    _sqArray = (unsigned*) (ring + params.sq_off.array);
+    _cqHead = (unsigned*) (ring + params.cq_off.head);
+    _cqTail = (unsigned*) (ring + params.cq_off.tail);
+    _cqMask = *(unsigned*) (ring + params.cq_off.ring_mask);
+    _cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+    _sqLocalTail = *_sqTail;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t) (uintptr_t) _bufRing;
+    reg.ring_entries = BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+
+    if(syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        log(INFO, "uring: registering the buffer ring: %s\n", strerror(errno));
+        return false;
+    }
+
+    for(unsigned buffer = 0; buffer < BUFFERS; buffer++)
+        recycle(buffer);
+    publishBuffers();
+
+    return true;
+}
+
+bool Uring::probe()
+{
+    // a socket nothing is sent to, the receive is cancelled right after
+    int sock = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock == -1)
+        return false;
+
+    prepareReceive(sock, TAG_PROBE);
+    publish();
+    enter(0);
+
+    // a kernel without multishot recvmsg fails it while submitting
+    bool supported = true;
+    bool finished = false;
+    Completion completion;
+    while(pop(completion))
+    {
+        if(completion.tag == TAG_PROBE && completion.res < 0)
+        {
+            log(INFO, "uring: multishot receive: %s\n", strerror(-completion.res));
+            supported = false;
+        }
+        if(completion.tag == TAG_PROBE && ! (completion.flags & IORING_CQE_F_MORE))
+            finished = true;
+    }
+
+    if(! finished)
+        cancel(TAG_PROBE);
+
+    close(sock);
+    return supported;
+}
+
+void Uring::enter(unsigned wait)
+{
+    while(true)
+    {
+        unsigned submit = _sqLocalTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+        _stats.enters++;
+
+        if(syscall(__NR_io_uring_enter, _fd, submit, wait, (wait > 0)? IORING_ENTER_GETEVENTS : 0, NULL, 0) != -1)
+            return;
+
+        if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            log(ERROR, "uring: io_uring_enter: %s\n", strerror(errno));
+            return;
+        }
+    }
+}
+
+struct io_uring_sqe* Uring::nextSqe()
+{
+    // every submission is entered right after it is filled in, so there
+    // is always room
+    unsigned index = _sqLocalTail & _sqMask;
+    _sqArray[index] = index;
+    _sqLocalTail++;
+
+    struct io_uring_sqe* sqe = &_sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    return sqe;
+}
+
+void Uring::publish()
+{
+    __atomic_store_n(_sqTail, _sqLocalTail, __ATOMIC_RELEASE);
+}
+
+bool Uring::pop(Completion& completion)
+{
+    unsigned head = *_cqHead;
+    if(head == __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const struct io_uring_cqe* cqe = &_cqes[head & _cqMask];
+    completion.tag = cqe->user_data;
+    completion.res = cqe->res;
+    completion.flags = cqe->flags;
+
+    __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void Uring::reap(unsigned& sendsDone)
+{
+    Completion completion;
+    while(pop(completion))
+    {
+        if(completion.tag != TAG_SEND)
+        {
+            _stash.push_back(completion);
+            continue;
+        }
+
+        sendsDone++;
+        if(completion.res < 0)
+        {
+            _stats.sendErrors++;
+            log(ERROR, "uring: sendmsg error: %s\n", strerror(-completion.res));
+        }
+    }
+}
+
+void Uring::prepareReceive(int fd, uint64_t tag)
+{
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) &_recvMsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = tag;
+}
+
+void Uring::arm()
+{
+    prepareReceive(_socket, TAG_RECEIVE);
+    publish();
+    enter(0);
+
+    _armed = true;
+    _stats.arms++;
+}
+
+void Uring::cancel(uint64_t tag)
+{
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = tag;
+    sqe->user_data = TAG_CANCEL;
+    publish();
+
+    bool cancelled = false;
+    bool finished = false;
+    while(! cancelled || ! finished)
+    {
+        enter(1);
+
+        Completion completion;
+        while(pop(completion))
+        {
+            if(completion.tag == TAG_CANCEL)
+            {
+                cancelled = true;
+                // it had already finished
+                if(completion.res == -ENOENT || completion.res == -EALREADY)
+                    finished = true;
+            }
+            else if(completion.tag == tag && ! (completion.flags & IORING_CQE_F_MORE))
+            {
+                finished = true;
+            }
+        }
+    }
+
+    if(tag == TAG_RECEIVE)
+        _armed = false;
+}
+
+void Uring::recycle(uint16_t buffer)
+{
+    // the tail shares its bytes with the first entry's resv, leave that
+    // be. Not through bufs, which the header's flexible array trick puts
+    // 8 bytes in when compiled as C++.
+    struct io_uring_buf* entry = (struct io_uring_buf*) _bufRing + (_bufTail & (BUFFERS - 1));
+    entry->addr = (uint64_t) (uintptr_t) (_buffers + buffer * _bufferBytes);
+    entry->len = _bufferBytes;
+    entry->bid = buffer;
+    _bufTail++;
+}
+
+void Uring::publishBuffers()
+{
+    __atomic_store_n(&_bufRing->tail, _bufTail, __ATOMIC_RELEASE);
+}
+
+int Uring::submitSends(int count)
+{
+    publish();
+
+    uint64_t enters = _stats.enters;
+    unsigned done = 0;
+    enter(count);
+    reap(done);
+
+    // receive completions can be among the ones waited for
+    while(done < (unsigned) count)
+    {
+        enter(count - done);
+        reap(done);
+    }
+
+    _stats.sends += count;
+    return _stats.enters - enters;
+}
+
+int Uring::sendEach(const struct sockaddr_in* addresses, const int count,
+                    const char* headers, const int headerBytes,
+                    const struct iovec* payloads)
+{
+    int enters = 0;
+    int sent = 0;
+
+    while(sent < count)
+    {
+        int batch = std::min(count - sent, (int) _sqEntries);
+
+        for(int i = 0; i < batch; i++)
+        {
+            struct iovec* iov = &_sendIov[2 * i];
+            iov[0].iov_base = (void*) &headers[(sent + i) * headerBytes];
+            iov[0].iov_len = headerBytes;
+            iov[1] = payloads[sent + i];
+
+            struct msghdr& msg = _sendMsgs[i];
+            memset(&msg, 0, sizeof msg);
+            msg.msg_name = (void*) &addresses[sent + i];
+            msg.msg_namelen = sizeof(struct sockaddr_in);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (payloads[sent + i].iov_len > 0)? 2 : 1;
+
+            struct io_uring_sqe* sqe = nextSqe();
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = _socket;
+            sqe->addr = (uint64_t) (uintptr_t) &msg;
+            sqe->len = 1;
+            sqe->user_data = TAG_SEND;
+        }
+
+        enters += submitSends(batch);
+        sent += batch;
+    }
+
+    return enters;
+}
+
+int Uring::send(const struct sockaddr_in& address, const struct iovec* iov, const int iovcnt)
+{
+    int count = std::min(iovcnt, 2);
+    std::copy(iov, iov + count, _sendIov.begin());
+
+    struct msghdr& msg = _sendMsgs[0];
+    memset(&msg, 0, sizeof msg);
+    msg.msg_name = (void*) &address;
+    msg.msg_namelen = sizeof address;
+    msg.msg_iov = &_sendIov[0];
+    msg.msg_iovlen = count;
+
+    struct io_uring_sqe* sqe = nextSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = _socket;
+    sqe->addr = (uint64_t) (uintptr_t) &msg;
+    sqe->len = 1;
+    sqe->user_data = TAG_SEND;
+
+    return submitSends(1);
+}
+
+int Uring::receive(Datagram* datagrams, int budget)
+{
+    for(uint16_t buffer : _handedOut)
+        recycle(buffer);
+    _handedOut.clear();
+    publishBuffers();
+
+    // it stopped for lack of buffers (or never started), there are some now
+    if(! _armed)
+        arm();
+
+    int count = 0;
+    Completion completion;
+    while(count < budget)
+    {
+        if(! _stash.empty())
+        {
+            completion = _stash.front();
+            _stash.pop_front();
+        }
+        else if(! pop(completion))
+        {
+            break;
+        }
+
+        if(completion.tag != TAG_RECEIVE)
+            continue;
+
+        if(! (completion.flags & IORING_CQE_F_MORE))
+            _armed = false;
+
+        if(completion.res < 0)
+        {
+            if(completion.res == -ENOBUFS)
+                _stats.noBuffers++;
+            else
+                log(WARN, "uring: receive error: %s\n", strerror(-completion.res));
+            continue;
+        }
+
+        if(! (completion.flags & IORING_CQE_F_BUFFER))
+            continue;
+
+        uint16_t buffer = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+        char* base = _buffers + buffer * _bufferBytes;
+        const struct io_uring_recvmsg_out* out = (const struct io_uring_recvmsg_out*) base;
+
+        if(out->flags & MSG_TRUNC)
+        {
+            _stats.truncated++;
+            recycle(buffer);
+            continue;
+        }
+
+        datagrams[count].from = (struct sockaddr*) (base + sizeof *out);
+        datagrams[count].fromLen = std::min(out->namelen, _recvMsg.msg_namelen);
+        datagrams[count].data = base + sizeof *out + _recvMsg.msg_namelen + _recvMsg.msg_controllen;
+        datagrams[count].length = out->payloadlen;
+        _handedOut.push_back(buffer);
+        count++;
+    }
+
+    publishBuffers();
+    _stats.received += count;
+    return count;
+}
+
+bool Uring::pending() const
+{
+    return ! _stash.empty() || ! _armed ||
+           *_cqHead != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+}
+
+void Uring::wait(int timeoutMs)
+{
+    if(pending())
+        return;
+
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if(poll(&pfd, 1, timeoutMs) == -1 && errno != EINTR)
+        log(WARN, "uring: poll: %s\n", strerror(errno));
+}
+
+void Uring::logStats()
+{
+    log(INFO, "uring: %llu io_uring_enter calls, %llu datagrams sent (%llu errors), %llu received, %llu truncated\n",
+        (unsigned long long) _stats.enters,
+        (unsigned long long) _stats.sends,
+        (unsigned long long) _stats.sendErrors,
+        (unsigned long long) _stats.received,
+        (unsigned long long) _stats.truncated);
+    log(INFO, "uring: multishot receive posted %llu times, ran out of buffers %llu times\n",
+        (unsigned long long) _stats.arms,
+        (unsigned long long) _stats.noBuffers);
+}
+
+#else
+
+// without the headers there is no ring to set up, Unicast goes on with
+// sendmmsg and recvmmsg
+
+Uring::Uring(int socket, size_t datagramBytes)
+:_socket(socket),
+_fd(-1),
+_stats()
+{
+}
+
+Uring::~Uring() {}
+
+int Uring::sendEach(const struct sockaddr_in* addresses, const int count,
+                    const char* headers, const int headerBytes,
+                    const struct iovec* payloads)
+{
+    return 0;
+}
+
+int Uring::send(const struct sockaddr_in& address, const struct iovec* iov, const int iovcnt) {return 0;}
+int Uring::receive(Datagram* datagrams, int budget) {return 0;}
+bool Uring::pending() const {return false;}
+void Uring::wait(int timeoutMs) {}
+void Uring::logStats() {}
+
+#endif
@@ -0,0 +1,175 @@
+/**
+Copyright 2014 - Joseph Lewis <joseph@josephlewis.net>
+All Rights Reserved
+
+Part of CS505 Lab 2 - Reliable Total Order Multicast Protocol
+
+An io_uring backend for Unicast's UDP socket, in place of sendmmsg and
+recvmmsg. One multishot receive stays posted on the socket and the kernel
+puts every datagram that arrives into a buffer of a ring registered with
+it, so reading is only a look at the completion queue. Sends are queued
+as one SQE per datagram and submitted in a single io_uring_enter per
+batch. Talks to the kernel directly, liburing isn't needed.
+**/
+
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __has_include
+  #if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+  #endif
+#endif
+
+// a multishot recvmsg into a registered buffer ring takes the headers of
+// Linux 6.0 or newer; built against older ones Uring is never usable()
+#ifdef IORING_RECV_MULTISHOT
+  #define URING_MULTISHOT
+#endif
+
+class Uring
+{
+public:
+    // sets up a ring for socket, whose datagrams are at most
+    // datagramBytes. usable() says whether the kernel could do it all,
+    // nothing else may be called if it couldn't.
+    Uring(int socket, size_t datagramBytes);
+    ~Uring();
+
+    bool usable() const {return _fd != -1;}
+
+    // readable while completions are waiting, for event loops; the socket
+    // itself rarely is, the receive takes datagrams off it as they come.
+    int getFd() const {return _fd;}
+
+    // like UDP::sendEach, every datagram is submitted at once and the
+    // call returns once the kernel has taken them all. Returns the number
+    // of io_uring_enter calls made.
+    int sendEach(const struct sockaddr_in* addresses, const int count,
+                 const char* headers, const int headerBytes,
+                 const struct iovec* payloads);
+
+    // like UDP::send with iovecs.
+    int send(const struct sockaddr_in& address, const struct iovec* iov, const int iovcnt);
+
+    // a datagram the receive put in a buffer, valid until the next call
+    // to receive().
+    struct Datagram
+    {
+        char* data;
+        int length;
+        struct sockaddr* from;
+        socklen_t fromLen;
+    };
+
+    // gives the buffers the last call handed out back to the kernel and
+    // stores at most budget datagrams that have arrived since. Never
+    // waits. Returns the number stored.
+    int receive(Datagram* datagrams, int budget);
+
+    // waits up to timeoutMs for something to receive.
+    void wait(int timeoutMs);
+
+    // receive() has something to do without the ring fd being readable.
+    bool pending() const;
+
+    // what it did, added to the syscall counts of Unicast::Stats
+    struct Stats
+    {
+        uint64_t enters;        // io_uring_enter calls
+        uint64_t sends;         // SQEs for datagrams
+        uint64_t sendErrors;
+        uint64_t received;      // datagrams handed out
+        uint64_t truncated;     // too big for a buffer, dropped
+        uint64_t arms;          // times the multishot receive was posted
+        uint64_t noBuffers;     // it stopped because every buffer was in use
+    };
+
+    const Stats& stats() const {return _stats;}
+    void logStats();
+
+private:
+    // what a completion was for, in its user_data
+    enum Tag
+    {
+        TAG_RECEIVE = 1,
+        TAG_SEND = 2,
+        TAG_PROBE = 3,
+        TAG_CANCEL = 4
+    };
+
+    struct Completion
+    {
+        uint64_t tag;
+        int32_t res;
+        uint32_t flags;
+    };
+
+    bool setup();
+    // true if the kernel takes a multishot recvmsg at all
+    bool probe();
+    // submits whatever was published and waits for wait completions
+    void enter(unsigned wait);
+    struct io_uring_sqe* nextSqe();
+    // makes what nextSqe() filled in visible to the kernel
+    void publish();
+    // takes the oldest completion off the queue, false if there is none
+    bool pop(Completion& completion);
+    // moves completions off the queue, those of sends are counted in
+    // sendsDone and the rest stashed for receive()
+    void reap(unsigned& sendsDone);
+    void prepareReceive(int fd, uint64_t tag);
+    void arm();
+    // cancels the multishot receive with the given tag and waits for it
+    // to finish, its completions are dropped
+    void cancel(uint64_t tag);
+    // gives a buffer back to the kernel, publishBuffers() makes it take them
+    void recycle(uint16_t buffer);
+    void publishBuffers();
+    // submits count sendmsg SQEs of _sendMsgs and waits for them
+    int submitSends(int count);
+
+    int _socket;
+    int _fd;
+
+    // the submission and completion queues as mapped from the kernel
+    void* _ringMapping;
+    size_t _ringBytes;
+    struct io_uring_sqe* _sqes;
+    size_t _sqesBytes;
+    unsigned* _sqHead;
+    unsigned* _sqTail;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned* _sqArray;
+    unsigned _sqLocalTail;  // SQEs filled in, not all published yet
+    unsigned* _cqHead;
+    unsigned* _cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe* _cqes;
+
+    // the registered buffer ring and the buffers it hands out
+    struct io_uring_buf_ring* _bufRing;
+    size_t _bufRingBytes;
+    char* _buffers;
+    size_t _bufferBytes;
+    uint16_t _bufTail;      // buffers given back, not all published yet
+
+    struct msghdr _recvMsg;         // what the receive fills in, name only
+    bool _armed;                    // the multishot receive is posted
+    std::deque<Completion> _stash;  // receive completions reaped while sending
+    std::vector<uint16_t> _handedOut; // buffers the last receive() handed out
+
+    std::vector<struct msghdr> _sendMsgs;
+    std::vector<struct iovec> _sendIov; // two per datagram
+    Stats _stats;
+};
+
+#endif